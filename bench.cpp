@@ -0,0 +1,259 @@
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+
+#include "parser.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+#ifdef CXXLISP_GC_ENABLED
+#include <gc.h>
+#endif
+
+using namespace cxxlisp;
+using namespace std;
+
+//===================================================================
+// Allocation counter
+//
+// Counts allocations through the global operator new. With GC enabled,
+// lisp objects are allocated by libgc instead, and counted by
+// GC_get_total_bytes().
+//===================================================================
+
+static size_t alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+void *operator new(size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw bad_alloc();
+}
+
+// GCC can't see that the replaced operator new uses malloc().
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+class AllocCounter {
+  size_t count_ = alloc_count;
+  size_t bytes_ = alloc_bytes;
+#ifdef CXXLISP_GC_ENABLED
+  size_t gcBytes_ = GC_get_total_bytes();
+#endif
+
+public:
+  void Report(benchmark::State &state) {
+    auto avg = benchmark::Counter::kAvgIterations;
+    state.counters["allocs"] = benchmark::Counter(alloc_count - count_, avg);
+    state.counters["alloc_bytes"] =
+        benchmark::Counter(alloc_bytes - bytes_, avg);
+#ifdef CXXLISP_GC_ENABLED
+    state.counters["gc_bytes"] =
+        benchmark::Counter(GC_get_total_bytes() - gcBytes_, avg);
+#endif
+  }
+};
+
+//===================================================================
+// Helpers
+//===================================================================
+
+static Value compile(VM &vm, string_view src) {
+  Parser parser{vm, src};
+  return Compiler().Compile(vm, parser.Read());
+}
+
+// Defines `prelude` in a fresh VM, and measures evaluation of `expr`,
+// which is compiled once.
+static void bench_eval(benchmark::State &state, string_view prelude,
+                       string_view expr) {
+  VM vm;
+  run(vm, prelude);
+  Value code = compile(vm, expr);
+
+  AllocCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Eval().Execute(vm, code));
+  }
+  counter.Report(state);
+}
+
+// Lisp source of `n` pseudo-random numbers, with a fixed seed.
+static string random_list(int n) {
+  mt19937 rng(42);
+  string s = "'(";
+  for (int i = 0; i < n; i++) {
+    s += to_string(rng() % 10000) + " ";
+  }
+  return s + ")";
+}
+
+// Lisp source with `n` definitions of various syntax.
+static string generate_source(int n) {
+  string s;
+  for (int i = 0; i < n; i++) {
+    string id = to_string(i);
+    s += "(define (f" + id + " x y)\n"
+         "  ;; comment\n"
+         "  (if (< x " + id + ") '(a b . c) `(\"str" + id +
+         "\" ,x ,@y #t #\\a 1.5)))\n";
+  }
+  return s;
+}
+
+//===================================================================
+// Benchmarks
+//===================================================================
+
+static void BM_Fib(benchmark::State &state) {
+  bench_eval(state,
+             "(define (fib n)"
+             "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+             "(fib 15)");
+}
+BENCHMARK(BM_Fib);
+
+static void BM_Tak(benchmark::State &state) {
+  bench_eval(state,
+             "(define (tak x y z)"
+             "  (if (not (< y x)) z"
+             "    (tak (tak (- x 1) y z) (tak (- y 1) z x)"
+             "         (tak (- z 1) x y))))",
+             "(tak 12 8 4)");
+}
+BENCHMARK(BM_Tak);
+
+static void BM_Ackermann(benchmark::State &state) {
+  bench_eval(state,
+             "(define (ack m n)"
+             "  (if (= m 0) (+ n 1)"
+             "    (if (= n 0) (ack (- m 1) 1)"
+             "      (ack (- m 1) (ack m (- n 1))))))",
+             "(ack 2 5)");
+}
+BENCHMARK(BM_Ackermann);
+
+static void BM_NQueens(benchmark::State &state) {
+  bench_eval(state,
+             "(define (ok? row dist placed)"
+             "  (if (null? placed) #t"
+             "    (if (= (car placed) (+ row dist)) #f"
+             "      (if (= (car placed) (- row dist)) #f"
+             "        (if (= (car placed) row) #f"
+             "          (ok? row (+ dist 1) (cdr placed)))))))"
+             "(define (queens n k placed)"
+             "  (if (= k n) 1 (count-cols n k placed 0)))"
+             "(define (count-cols n k placed col)"
+             "  (if (= col n) 0"
+             "    (+ (if (ok? col 1 placed)"
+             "         (queens n (+ k 1) (cons col placed)) 0)"
+             "       (count-cols n k placed (+ col 1)))))",
+             "(queens 6 0 '())");
+}
+BENCHMARK(BM_NQueens);
+
+static void BM_ListSort(benchmark::State &state) {
+  bench_eval(state,
+             "(define (merge a b)"
+             "  (if (null? a) b"
+             "    (if (null? b) a"
+             "      (if (< (car a) (car b))"
+             "        (cons (car a) (merge (cdr a) b))"
+             "        (cons (car b) (merge a (cdr b)))))))"
+             "(define (split l a b)"
+             "  (if (null? l) (cons a b) (split (cdr l) b (cons (car l) a))))"
+             "(define (msort l)"
+             "  (if (null? l) l"
+             "    (if (null? (cdr l)) l"
+             "      (let ((p (split l '() '())))"
+             "        (merge (msort (car p)) (msort (cdr p)))))))"
+             "(define data " +
+                 random_list(500) + ")",
+             "(msort data)");
+}
+BENCHMARK(BM_ListSort);
+
+static void BM_StringBuilder(benchmark::State &state) {
+  bench_eval(state,
+             "(define (build n sb)"
+             "  (if (= n 0) (sb->string sb)"
+             "    (begin (sb-append! sb \"line \" n \"\\n\")"
+             "           (build (- n 1) sb))))",
+             "(build 500 (make-string-builder))");
+}
+BENCHMARK(BM_StringBuilder);
+
+static void BM_StringAppend(benchmark::State &state) {
+  bench_eval(state,
+             "(define (build n s)"
+             "  (if (= n 0) s"
+             "    (build (- n 1)"
+             "      (string-append s \"line \" (number->string n) \"\\n\"))))",
+             "(build 500 \"\")");
+}
+BENCHMARK(BM_StringAppend);
+
+static void BM_Parser(benchmark::State &state) {
+  VM vm;
+  string src = generate_source(state.range(0));
+  AllocCounter counter;
+  for (auto _ : state) {
+    Parser parser{vm, src};
+    try {
+      for (;;) {
+        benchmark::DoNotOptimize(parser.Read());
+      }
+    } catch (EndOfSourceException &) {
+    }
+  }
+  counter.Report(state);
+  state.SetBytesProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_Parser)->Arg(10)->Arg(100)->Unit(benchmark::kMillisecond);
+
+static void BM_VMConstruction(benchmark::State &state) {
+  AllocCounter counter;
+  for (auto _ : state) {
+    VM vm;
+    benchmark::DoNotOptimize(vm.RootEnv());
+  }
+  counter.Report(state);
+}
+BENCHMARK(BM_VMConstruction)->Unit(benchmark::kMillisecond);
+
+static void macro_expand(benchmark::State &state, bool cached) {
+  VM vm;
+  vm.EnableMacroCache = cached;
+  run(vm, "(defmacro my-let* (bindings . body)"
+          "  (if (null? bindings) `(begin ,@body)"
+          "    `(let (,(car bindings)) (my-let* ,(cdr bindings) ,@body))))");
+  Parser parser{vm, "(my-let* ((a 1) (b 2) (c 3) (d 4) (e 5) (f 6) (g 7)"
+                    "           (h 8) (i 9) (j 10))"
+                    "  `(,a ,b (,c ,@(list d e)) ,f ,g ,h ,i ,j))"};
+  Value form = parser.Read();
+
+  AllocCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Compiler().Compile(vm, form));
+  }
+  counter.Report(state);
+}
+
+static void BM_MacroExpand(benchmark::State &state) {
+  macro_expand(state, false);
+}
+BENCHMARK(BM_MacroExpand);
+
+// Same use every time, so all but the first are hits of the macro cache.
+static void BM_MacroExpandCached(benchmark::State &state) {
+  macro_expand(state, true);
+}
+BENCHMARK(BM_MacroExpandCached);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,17 @@
+;; List allocation and recursion.
+(define (ok? row dist placed)
+  (if (null? placed) #t
+    (if (= (car placed) (+ row dist)) #f
+      (if (= (car placed) (- row dist)) #f
+        (if (= (car placed) row) #f
+          (ok? row (+ dist 1) (cdr placed)))))))
+
+(define (queens n k placed)
+  (if (= k n) 1 (count-cols n k placed 0)))
+
+(define (count-cols n k placed col)
+  (if (= col n) 0
+    (+ (if (ok? col 1 placed) (queens n (+ k 1) (cons col placed)) 0)
+       (count-cols n k placed (+ col 1)))))
+
+(queens 8 0 '())
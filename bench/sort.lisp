@@ -0,0 +1,26 @@
+;; Merge sort of a list of pseudo-random numbers.
+(define (merge a b)
+  (if (null? a) b
+    (if (null? b) a
+      (if (< (car a) (car b))
+        (cons (car a) (merge (cdr a) b))
+        (cons (car b) (merge a (cdr b)))))))
+
+(define (split l a b)
+  (if (null? l) (cons a b) (split (cdr l) b (cons (car l) a))))
+
+(define (msort l)
+  (if (null? l) l
+    (if (null? (cdr l)) l
+      (let ((p (split l '() '())))
+        (merge (msort (car p)) (msort (cdr p)))))))
+
+(define (random-list n x)
+  (if (= n 0) '()
+    (cons x (random-list (- n 1) (modulo (+ (* x 1103515245) 12345) 65536)))))
+
+(define (sort-times n data)
+  (if (> n 0)
+    (begin (msort data) (sort-times (- n 1) data))))
+
+(sort-times 20 (random-list 500 1))
@@ -0,0 +1,22 @@
+;; String building, searching and splitting.
+(define (build n sb)
+  (if (= n 0) (sb->string sb)
+    (begin (sb-append! sb "field" n "," "日本語" ",x\n")
+           (build (- n 1) sb))))
+
+(define text (build 500 (make-string-builder)))
+
+(define (count-fields lines n)
+  (if (null? lines) n
+    (count-fields (cdr lines)
+                  (+ n (vector-length (list->vector
+                                       (string-split (car lines) ",")))))))
+
+(define (repeat n)
+  (if (> n 0)
+    (begin (count-fields (string-split text "\n") 0)
+           (string-length text)
+           (string-ref text 2000)
+           (repeat (- n 1)))))
+
+(repeat 50)
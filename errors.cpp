@@ -7,10 +7,16 @@ using namespace std;
 
 string LispException::StackTrace() const {
   stringstream s;
-  int i = Stack.size();
-  for (auto const &stack : Stack) {
-    i--;
-    s << i << ": " << stack << endl;
+  if (Stack) {
+    int i = Stack->size();
+    for (size_t j = 0; j < Stack->size(); j++) {
+      i--;
+      s << i << ": " << Stack->at(j);
+      if (Locations && j < Locations->size() && !Locations->at(j).empty()) {
+        s << " at " << Locations->at(j);
+      }
+      s << endl;
+    }
   }
   s << "error: " << what() << endl;
   return s.str();
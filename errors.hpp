@@ -1,10 +1,13 @@
 #pragma once
 #include <exception>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace cxxlisp {
 
+class Value;
+
 /**
  * Base class of lisp exceptions.
  */
@@ -18,7 +21,18 @@ public:
 
   std::string StackTrace() const;
 
-  std::vector<std::string> Stack;
+  /**
+   * Lisp stack at the point of error, innermost first.
+   *
+   * Values are formatted only when StackTrace() is called. See
+   * VM::UnwindStack().
+   */
+  std::shared_ptr<std::vector<Value>> Stack;
+
+  /**
+   * Source location of each frame of Stack, or empty if unknown.
+   */
+  std::shared_ptr<std::vector<std::string>> Locations;
 };
 
 /**
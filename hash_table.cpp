@@ -0,0 +1,102 @@
+#include "hash_table.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+// Initial capacity of the slot array.
+static const size_t MIN_CAPACITY = 8;
+
+uint64_t HashTable::hash(Value key) const {
+  uint64_t h = (kind_ == Kind::EQ) ? hash_eq(key) : hash_equal(key);
+  return h < MIN_HASH ? h + MIN_HASH : h;
+}
+
+bool HashTable::match(const Slot &slot, uint64_t h, Value key) const {
+  if (slot.Hash != h) {
+    return false;
+  }
+  return (kind_ == Kind::EQ) ? slot.Key == key : is_equal(slot.Key, key);
+}
+
+HashTable::Slot *HashTable::find(Value key, uint64_t h) {
+  if (slots_.empty()) {
+    return nullptr;
+  }
+  size_t mask = slots_.size() - 1;
+  for (size_t i = h & mask;; i = (i + 1) & mask) {
+    Slot &slot = slots_[i];
+    if (slot.Hash == EMPTY) {
+      return nullptr;
+    } else if (match(slot, h, key)) {
+      return &slot;
+    }
+  }
+}
+
+void HashTable::rehash(size_t capacity) {
+  vector<Slot> old(capacity, Slot{EMPTY, NIL, NIL});
+  old.swap(slots_);
+  size_t mask = capacity - 1;
+  for (auto &slot : old) {
+    if (slot.IsLive()) {
+      size_t i = slot.Hash & mask;
+      while (slots_[i].Hash != EMPTY) {
+        i = (i + 1) & mask;
+      }
+      slots_[i] = slot;
+    }
+  }
+  used_ = size_;
+}
+
+Value *HashTable::Find(Value key) {
+  Slot *slot = find(key, hash(key));
+  return slot ? &slot->Val : nullptr;
+}
+
+void HashTable::Set(Value key, Value val) {
+  uint64_t h = hash(key);
+  if (Slot *slot = find(key, h)) {
+    slot->Val = val;
+    return;
+  }
+
+  // Keep load factor (including tombstones) under 3/4.
+  if ((used_ + 1) * 4 > slots_.size() * 3) {
+    size_t capacity = max(MIN_CAPACITY, slots_.size());
+    while ((size_ + 1) * 2 > capacity) {
+      capacity *= 2;
+    }
+    rehash(capacity);
+  }
+
+  size_t mask = slots_.size() - 1;
+  size_t i = h & mask;
+  while (slots_[i].IsLive()) {
+    i = (i + 1) & mask;
+  }
+  if (slots_[i].Hash == EMPTY) {
+    used_++;
+  }
+  slots_[i] = Slot{h, key, val};
+  size_++;
+}
+
+bool HashTable::Delete(Value key) {
+  Slot *slot = find(key, hash(key));
+  if (!slot) {
+    return false;
+  }
+  *slot = Slot{TOMBSTONE, NIL, NIL};
+  size_--;
+  return true;
+}
+
+void HashTable::Clear() {
+  slots_.clear();
+  size_ = 0;
+  used_ = 0;
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Hash table with open addressing.
+ *
+ * Slots are kept in one contiguous array and probed linearly. Each slot
+ * caches the hash of its key, so probing compares hashes first and calls
+ * the equality function only when they match. Deleted slots are left as
+ * tombstones until the next rehash.
+ */
+class HashTable final : public gc_cleanup, noncopyable {
+public:
+  // Equality of keys.
+  enum class Kind : uint8_t {
+    EQ,    // eq?
+    EQUAL, // equal?
+  };
+
+  struct Slot {
+    uint64_t Hash; // EMPTY, TOMBSTONE or hash of the key.
+    Value Key;
+    Value Val;
+
+    bool IsLive() const { return Hash >= MIN_HASH; }
+  };
+
+  static const uint64_t EMPTY = 0;
+  static const uint64_t TOMBSTONE = 1;
+  static const uint64_t MIN_HASH = 2;
+
+private:
+  Kind kind_;
+  std::vector<Slot> slots_; // Capacity is zero or a power of two.
+  size_t size_ = 0;
+  size_t used_ = 0; // Live slots and tombstones.
+
+  uint64_t hash(Value key) const;
+  bool match(const Slot &slot, uint64_t h, Value key) const;
+  Slot *find(Value key, uint64_t h);
+  void rehash(size_t capacity);
+
+public:
+  explicit HashTable(Kind kind) : kind_(kind) {}
+
+  Kind GetKind() const { return kind_; }
+  size_t Size() const { return size_; }
+
+  /**
+   * Returns pointer to the value of `key`, or nullptr if not found.
+   *
+   * The pointer is valid until the next Set().
+   */
+  Value *Find(Value key);
+
+  void Set(Value key, Value val);
+  bool Delete(Value key);
+  void Clear();
+
+  /**
+   * Slots for iteration. Skip the ones which are not live.
+   */
+  const std::vector<Slot> &Slots() const { return slots_; }
+};
+
+} // namespace cxxlisp
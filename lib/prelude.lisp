@@ -1,7 +1,13 @@
-(define (caar x) (car (car x)))
-(define (cadr x) (car (cdr x)))
-(define (cdar x) (cdr (car x)))
-(define (cddr x) (cdr (cdr x)))
+;; Define a stable procedure which the optimizer may inline.
+(defmacro define-inline (name . body)
+  `(begin
+     (define ,name ,@body)
+     (procedure-set-stable! ,(car name))))
+
+(define-inline (caar x) (car (car x)))
+(define-inline (cadr x) (car (cdr x)))
+(define-inline (cdar x) (cdr (car x)))
+(define-inline (cddr x) (cdr (cdr x)))
 
 (define string<=? <=)
 (define string<? <)
@@ -9,7 +15,7 @@
 (define string>? >)
 (define string=? =)
 
-(define (newline) (display "\n"))
+(define-inline (newline) (display "\n"))
 
 ;; List functions.
 (define (list? li)
@@ -71,3 +77,31 @@
       (if (pair? ls) (every1 pred ls) #t)
     (not (apply any (lambda xs (not (apply pred xs))) ls lol))))
 
+
+;; Record type.
+;;
+;; (define-record-type point (make-point x y) point?
+;;   (x point-x set-point-x!)
+;;   (y point-y))
+;;
+;; Accessors and modifiers are stable, so the optimizer replaces their calls
+;; with direct slot access.
+(defmacro define-record-type (type ctor pred . fields)
+  (let ((def (lambda (name val)
+               `(define ,name (procedure-set-name! ',name ,val))))
+        (def-stable (lambda (name val)
+                      `(begin ,(def name val) (procedure-set-stable! ,name))))
+        (field-defs
+         (lambda (field)
+           `(begin
+              ,(def-stable (cadr field) `(record-accessor ,type ',(car field)))
+              ,@(if (null? (cddr field))
+                    '()
+                  (list (def-stable (car (cddr field))
+                                    `(record-modifier ,type ',(car field)))))))))
+    `(begin
+       (define ,type (make-record-type ',type ',(map car fields)))
+       ,(def (car ctor) `(record-constructor ,type ',(cdr ctor)))
+       ,(def pred `(record-predicate ,type))
+       ,@(map field-defs fields)
+       ',type)))
@@ -0,0 +1,105 @@
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+// Classification and case conversion are for ASCII only.
+
+static bool is_upper(char32_t c) { return c >= 'A' && c <= 'Z'; }
+static bool is_lower(char32_t c) { return c >= 'a' && c <= 'z'; }
+static bool is_digit(char32_t c) { return c >= '0' && c <= '9'; }
+
+static Value char_p(Ctx &ctx, Value v) { return v.IsChar(); }
+
+static Value char_to_integer(Ctx &ctx, Char c) { return (vint_t)c.Code(); }
+
+static Value integer_to_char(Ctx &ctx, vint_t n) {
+  if (n < 0 || n > 0x10ffff) {
+    throw LispException("Invalid code point " + to_string(n) + ".");
+  }
+  return Char((char32_t)n);
+}
+
+static Value char_upcase(Ctx &ctx, Char c) {
+  return is_lower(c.Code()) ? Char(c.Code() - 'a' + 'A') : c;
+}
+
+static Value char_downcase(Ctx &ctx, Char c) {
+  return is_upper(c.Code()) ? Char(c.Code() - 'A' + 'a') : c;
+}
+
+static Value char_alphabetic_p(Ctx &ctx, Char c) {
+  return is_upper(c.Code()) || is_lower(c.Code());
+}
+
+static Value char_numeric_p(Ctx &ctx, Char c) { return is_digit(c.Code()); }
+
+static Value char_whitespace_p(Ctx &ctx, Char c) {
+  char32_t code = c.Code();
+  return code == ' ' || (code >= '\t' && code <= '\r');
+}
+
+static Value char_upper_case_p(Ctx &ctx, Char c) { return is_upper(c.Code()); }
+
+static Value char_lower_case_p(Ctx &ctx, Char c) { return is_lower(c.Code()); }
+
+template <typename Op> static Value char_compare(Value args, Op op) {
+  char32_t a = car(args).AsChar().Code();
+  for (auto v : cdr(args)) {
+    char32_t b = v.AsChar().Code();
+    if (!op(a, b)) {
+      return false;
+    }
+    a = b;
+  }
+  return true;
+}
+
+static Value char_eq_p(Ctx &ctx, Value args) {
+  return char_compare(args, equal_to<char32_t>());
+}
+
+static Value char_lt_p(Ctx &ctx, Value args) {
+  return char_compare(args, less<char32_t>());
+}
+
+static Value char_le_p(Ctx &ctx, Value args) {
+  return char_compare(args, less_equal<char32_t>());
+}
+
+static Value char_gt_p(Ctx &ctx, Value args) {
+  return char_compare(args, greater<char32_t>());
+}
+
+static Value char_ge_p(Ctx &ctx, Value args) {
+  return char_compare(args, greater_equal<char32_t>());
+}
+
+#define F(id, f) add_proc(vm, false, id, f);
+#define FV(id, f) add_proc_varg(vm, false, id, f);
+#define M(id, f) add_proc(vm, true, id, f);
+#define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
+
+void lib_char_init(VM &vm) {
+  P("char?", char_p);
+  P("char->integer", char_to_integer);
+  P("integer->char", integer_to_char);
+  P("char-upcase", char_upcase);
+  P("char-downcase", char_downcase);
+  P("char-alphabetic?", char_alphabetic_p);
+  P("char-numeric?", char_numeric_p);
+  P("char-whitespace?", char_whitespace_p);
+  P("char-upper-case?", char_upper_case_p);
+  P("char-lower-case?", char_lower_case_p);
+  PV("char=?", char_eq_p);
+  PV("char<?", char_lt_p);
+  PV("char<=?", char_le_p);
+  PV("char>?", char_gt_p);
+  PV("char>=?", char_ge_p);
+}
+
+} // namespace cxxlisp
@@ -1,3 +1,4 @@
+#include "utf8.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
@@ -6,7 +7,7 @@ namespace cxxlisp {
 using namespace std;
 
 static Value null_p(Ctx &ctx, Value v) { return v.IsNil(); }
-static Value number_p(Ctx &ctx, Value v) { return v.IsNumber(); }
+static Value number_p(Ctx &ctx, Value v) { return v.IsNumeric(); }
 static Value pair_p(Ctx &ctx, Value v) { return v.IsCell(); }
 static Value string_p(Ctx &ctx, Value v) { return v.IsString(); }
 static Value boolean_p(Ctx &ctx, Value v) { return v.IsBoolean(); }
@@ -14,7 +15,7 @@ static Value procedure_p(Ctx &ctx, Value v) { return v.IsProcedure(); }
 static Value symbol_p(Ctx &ctx, Value v) { return v.IsAtom(); }
 
 static Value not_(Ctx &ctx, bool v) { return !v; }
-static Value break_(Ctx &ctx, Value v) { throw BreakException(v); }
+static Value break_(Ctx &ctx, Value v) { return ctx.vm->Escape(NIL, v); }
 
 static Value procedure_set_name(Ctx &ctx, Atom name, Procedure &proc) {
   proc.SetName(ctx.vm->AtomToString(name));
@@ -26,6 +27,11 @@ static Value procedure_set_macro(Ctx &ctx, Procedure &proc) {
   return &proc;
 }
 
+static Value procedure_set_stable(Ctx &ctx, Procedure &proc) {
+  proc.SetIsStable(true);
+  return &proc;
+}
+
 static Value defmacro(Ctx &ctx, Value args) {
   auto [name, arg_list, code] = uncons_rest<Atom, Value, Value>(args);
   auto i = [&](const char *a) { return ctx.vm->Intern(a); };
@@ -84,6 +90,34 @@ static Value macroexpand_1(Ctx &ctx, Value code) {
   return Compiler().ExpandOne(ctx, code);
 }
 
+// (module-cache-stats)
+//
+// Returns (hits misses) of the module cache of load.
+static Value module_cache_stats(Ctx &ctx) {
+  ModuleCache &cache = ctx.vm->Modules();
+  return list((vint_t)cache.Hits(), (vint_t)cache.Misses());
+}
+
+// (macro-cache-enable! flag)
+//
+// Turn the macro expansion cache on or off, for macros which aren't pure.
+static Value macro_cache_enable(Ctx &ctx, bool flag) {
+  ctx.vm->EnableMacroCache = flag;
+  if (!flag) {
+    ctx.vm->Macros().Clear();
+  }
+  return UNDEF;
+}
+
+// (macro-cache-stats)
+//
+// Returns (hits misses invalidations) of the macro expansion cache.
+static Value macro_cache_stats(Ctx &ctx) {
+  MacroCache &cache = ctx.vm->Macros();
+  return list((vint_t)cache.Hits(), (vint_t)cache.Misses(),
+              (vint_t)cache.Invalidations());
+}
+
 static Value puts(Ctx &ctx, Value args) {
   for (Value p = args; !p.IsNil(); p = cdr(p)) {
     Value v = car(p);
@@ -99,7 +133,11 @@ static Value puts(Ctx &ctx, Value args) {
 static Value display(Ctx &ctx, Value args) {
   for (auto v : args) {
     if (v.IsString()) {
-      cout << v.AsString();
+      v.AsStringValue().Each([](string_view piece) { cout << piece; });
+    } else if (v.IsChar()) {
+      string s;
+      utf8_encode(s, v.AsChar());
+      cout << s;
     } else {
       cout << v;
     }
@@ -114,52 +152,59 @@ static Value write(Ctx &ctx, Value args) {
   return NIL;
 }
 
-static Value load(Ctx &ctx, const string &filename) {
+static Value load(Ctx &ctx, string_view filename) {
   return run_file(*ctx.vm, filename);
 }
 
-static Value equal_p(Ctx &ctx, Value a, Value b) {
-  if (a.IsCell()) {
-    if (equal_p(ctx, car(a), car(b)).Truthy()) {
-      return equal_p(ctx, cdr(a), cdr(b));
-    } else {
-      return false;
-    }
-  } else {
-    return a == b;
+// "file:line:column" where `form` was read, or #f if unknown.
+static Value source_location(Ctx &ctx, Value form) {
+  SourceMap &sources = ctx.vm->Sources();
+  SourceLocation loc = sources.Find(form);
+  if (!loc.IsKnown()) {
+    return BOOL_F;
   }
+  return Value(sources.Describe(loc));
 }
 
+static Value equal_p(Ctx &ctx, Value a, Value b) { return is_equal(a, b); }
+
 #define F(id, f) add_proc(vm, false, id, f);
 #define FV(id, f) add_proc_varg(vm, false, id, f);
 #define M(id, f) add_proc(vm, true, id, f);
 #define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
 
 void lib_core_init(VM &vm) {
-  F("null?", null_p);
-  F("number?", number_p);
-  F("pair?", pair_p);
-  F("strng?", string_p);
-  F("boolean?", boolean_p);
-  F("procedure?", procedure_p);
-  F("symbol?", symbol_p);
-
-  F("not", not_);
+  P("null?", null_p);
+  P("number?", number_p);
+  P("pair?", pair_p);
+  P("strng?", string_p);
+  P("boolean?", boolean_p);
+  P("procedure?", procedure_p);
+  P("symbol?", symbol_p);
+
+  P("not", not_);
   F("break", break_);
 
   MV("defmacro", defmacro);
   F("procedure-set-name!", procedure_set_name);
   F("procedure-set-macro!", procedure_set_macro);
+  F("procedure-set-stable!", procedure_set_stable);
   M("quasiquote", quasiquote);
   F("macroexpand", macroexpand);
   F("macroexpand-1", macroexpand_1);
+  F("macro-cache-enable!", macro_cache_enable);
+  F("macro-cache-stats", macro_cache_stats);
+  F("module-cache-stats", module_cache_stats);
 
   FV("puts", puts);
   FV("display", display);
   FV("write", write);
 
   F("load", load);
-  F("equal?", equal_p);
+  F("source-location", source_location);
+  P("equal?", equal_p);
 }
 
 } // namespace cxxlisp
@@ -0,0 +1,160 @@
+#include "hash_table.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+// (make-hash-table [equality]) where equality is eq?, eqv? or equal?.
+static Value make_hash_table(Ctx &ctx, Value args) {
+  if (args.IsNil()) {
+    return new HashTable(HashTable::Kind::EQUAL);
+  }
+  const string &name = car(args).AsProcedure().Name();
+  if (name == "eq?" || name == "eqv?") {
+    return new HashTable(HashTable::Kind::EQ);
+  } else if (name == "equal?") {
+    return new HashTable(HashTable::Kind::EQUAL);
+  } else {
+    throw LispException("Unsupported hash table equality '" + name + "'.");
+  }
+}
+
+static Value hash_table_p(Ctx &ctx, Value v) { return v.IsHashTable(); }
+
+static Value hash_table_count(Ctx &ctx, HashTable &ht) {
+  return (vint_t)ht.Size();
+}
+
+// (hash-table-ref table key [thunk])
+static Value hash_table_ref(Ctx &ctx, Value args) {
+  auto [table, key, rest] = uncons_rest<Value, Value, Value>(args);
+  if (Value *v = table.AsHashTable().Find(key)) {
+    return *v;
+  } else if (!rest.IsNil()) {
+    return Eval().Call(ctx, car(rest), NIL);
+  }
+  throw LispException("Key " + key.ToString() + " not found.");
+}
+
+static Value hash_table_ref_default(Ctx &ctx, HashTable &ht, Value key,
+                                    Value default_) {
+  Value *v = ht.Find(key);
+  return v ? *v : default_;
+}
+
+static Value hash_table_contains_p(Ctx &ctx, HashTable &ht, Value key) {
+  return ht.Find(key) != nullptr;
+}
+
+static Value hash_table_set_i(Ctx &ctx, HashTable &ht, Value key, Value val) {
+  ht.Set(key, val);
+  return val;
+}
+
+static Value hash_table_delete_i(Ctx &ctx, HashTable &ht, Value key) {
+  return ht.Delete(key);
+}
+
+static Value hash_table_clear_i(Ctx &ctx, HashTable &ht) {
+  ht.Clear();
+  return NIL;
+}
+
+static Value update(Ctx &ctx, HashTable &ht, Value key, Value f, Value cur) {
+  Value v = Eval().Call(ctx, f, list(cur));
+  if (v.IsEscape()) {
+    return v;
+  }
+  ht.Set(key, v);
+  return v;
+}
+
+// (hash-table-update! table key proc [thunk])
+static Value hash_table_update_i(Ctx &ctx, Value args) {
+  auto [table, key, f, rest] = uncons_rest<Value, Value, Value, Value>(args);
+  HashTable &ht = table.AsHashTable();
+  Value cur;
+  if (Value *v = ht.Find(key)) {
+    cur = *v;
+  } else if (!rest.IsNil()) {
+    cur = Eval().Call(ctx, car(rest), NIL);
+    if (cur.IsEscape()) {
+      return cur;
+    }
+  } else {
+    throw LispException("Key " + key.ToString() + " not found.");
+  }
+  return update(ctx, ht, key, f, cur);
+}
+
+static Value hash_table_update_default_i(Ctx &ctx, HashTable &ht, Value key,
+                                         Value f, Value default_) {
+  Value *v = ht.Find(key);
+  return update(ctx, ht, key, f, v ? *v : default_);
+}
+
+// (hash-table-walk table proc) calls (proc key value) for each entry.
+static Value hash_table_walk(Ctx &ctx, HashTable &ht, Value f) {
+  // Index, not iterator, because `f` may modify the table.
+  for (size_t i = 0; i < ht.Slots().size(); i++) {
+    auto &slot = ht.Slots()[i];
+    if (slot.IsLive()) {
+      Value r = Eval().Call(ctx, f, list(slot.Key, slot.Val));
+      if (r.IsEscape()) {
+        return r;
+      }
+    }
+  }
+  return NIL;
+}
+
+template <typename F> static Value collect(HashTable &ht, F f) {
+  Value r = NIL;
+  for (auto &slot : ht.Slots()) {
+    if (slot.IsLive()) {
+      r = cons(f(slot), r);
+    }
+  }
+  return r;
+}
+
+static Value hash_table_keys(Ctx &ctx, HashTable &ht) {
+  return collect(ht, [](auto &slot) { return slot.Key; });
+}
+
+static Value hash_table_values(Ctx &ctx, HashTable &ht) {
+  return collect(ht, [](auto &slot) { return slot.Val; });
+}
+
+static Value hash_table_to_alist(Ctx &ctx, HashTable &ht) {
+  return collect(ht, [](auto &slot) { return cons(slot.Key, slot.Val); });
+}
+
+#define F(id, f) add_proc(vm, false, id, f);
+#define FV(id, f) add_proc_varg(vm, false, id, f);
+#define M(id, f) add_proc(vm, true, id, f);
+#define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
+
+void lib_hash_table_init(VM &vm) {
+  FV("make-hash-table", make_hash_table);
+  P("hash-table?", hash_table_p);
+  F("hash-table-count", hash_table_count);
+  FV("hash-table-ref", hash_table_ref);
+  F("hash-table-ref/default", hash_table_ref_default);
+  F("hash-table-contains?", hash_table_contains_p);
+  F("hash-table-set!", hash_table_set_i);
+  F("hash-table-delete!", hash_table_delete_i);
+  F("hash-table-clear!", hash_table_clear_i);
+  FV("hash-table-update!", hash_table_update_i);
+  F("hash-table-update!/default", hash_table_update_default_i);
+  F("hash-table-walk", hash_table_walk);
+  F("hash-table-keys", hash_table_keys);
+  F("hash-table-values", hash_table_values);
+  F("hash-table->alist", hash_table_to_alist);
+}
+
+} // namespace cxxlisp
@@ -46,11 +46,13 @@ static Value reverse(Ctx &ctx, Value args) {
 #define FV(id, f) add_proc_varg(vm, false, id, f);
 #define M(id, f) add_proc(vm, true, id, f);
 #define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
 
 void lib_list_init(VM &vm) {
   F("cons", cons_);
-  F("car", car_);
-  F("cdr", cdr_);
+  P("car", car_);
+  P("cdr", cdr_);
   F("set-car!", set_car_i);
   F("set-cdr!", set_cdr_i);
 
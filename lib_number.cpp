@@ -1,5 +1,6 @@
 #include <cmath>
 
+#include "number.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
@@ -7,108 +8,238 @@ namespace cxxlisp {
 
 using namespace std;
 
-inline Value fold_num(Value vals, function<vint_t(vint_t, vint_t)> f) {
-  Value head = car(vals);
-  if (head.Type() == ValueType::NUMBER) {
-    return fold<vint_t>(vals, f);
-  } else {
-    throw BUG();
+//===================================================================
+// Kernels
+//
+// Two fixnums are handled inline, and the others go to the generic
+// functions in number.cpp, which promote to bignum on overflow.
+//===================================================================
+
+inline Value add2(Value a, Value b) {
+  vint_t r;
+  if (a.IsNumber() && b.IsNumber() &&
+      !__builtin_add_overflow(a.AsNumber(), b.AsNumber(), &r)) {
+    return r;
   }
+  return num_add(a, b);
 }
 
-static Value multiply(Ctx &ctx, Value args) {
-  return fold_num(args, [](vint_t a, vint_t b) { return a * b; });
+inline Value sub2(Value a, Value b) {
+  vint_t r;
+  if (a.IsNumber() && b.IsNumber() &&
+      !__builtin_sub_overflow(a.AsNumber(), b.AsNumber(), &r)) {
+    return r;
+  }
+  return num_sub(a, b);
 }
 
-static Value divide(Ctx &ctx, Value args) {
-  return fold_num(args, [](vint_t a, vint_t b) { return a / b; });
+inline Value mul2(Value a, Value b) {
+  vint_t r;
+  if (a.IsNumber() && b.IsNumber() &&
+      !__builtin_mul_overflow(a.AsNumber(), b.AsNumber(), &r)) {
+    return r;
+  }
+  return num_mul(a, b);
 }
 
-static Value add(Ctx &ctx, Value args) {
-  Value head = car(args);
-  if (head.Type() == ValueType::NUMBER) {
-    return fold<vint_t>(args, [](vint_t a, vint_t b) { return a + b; });
-  } else if (head.Type() == ValueType::STRING) {
-    return foldc<string>(
-        args, [](const string &a, const string &b) { return a + b; });
+inline Value div2(Value a, Value b) {
+  if (a.IsNumber() && b.IsNumber()) {
+    vint_t x = a.AsNumber();
+    vint_t y = b.AsNumber();
+    if (y != 0 && !(x == INT64_MIN && y == -1)) {
+      return x / y;
+    }
+  } else if (a.IsFlonum() || b.IsFlonum()) {
+    return to_double(a) / to_double(b);
+  }
+  return num_quotient(a, b);
+}
+
+template <typename Op> inline bool num_cmp(Value a, Value b, Op op) {
+  if (a.IsNumber() && b.IsNumber()) {
+    return op(a.AsNumber(), b.AsNumber());
+  } else if (a.IsFlonum() || b.IsFlonum()) {
+    return op(to_double(a), to_double(b));
   } else {
-    throw BUG();
+    return op(num_compare_exact(a, b), 0);
   }
 }
 
-static Value sub(Ctx &ctx, Value args) {
-  Value head = car(args);
-  Value rest = cdr(args);
-  if (head.Type() == ValueType::NUMBER) {
-    vint_t r = head.AsNumber();
-    for (auto v : rest) {
-      r -= v.AsNumber();
-      rest = cdr(rest);
-    }
+// `r` of `a` and `b`, which is inexact if either is.
+inline Value contagious(Value r, Value a, Value b) {
+  if ((a.IsFlonum() || b.IsFlonum()) && !r.IsFlonum()) {
+    return to_double(r);
+  }
+  return r;
+}
+
+inline Value min2(Value a, Value b) {
+  return contagious(num_cmp(b, a, std::less<>()) ? b : a, a, b);
+}
+
+inline Value max2(Value a, Value b) {
+  return contagious(num_cmp(b, a, std::greater<>()) ? b : a, a, b);
+}
+
+/**
+ * Fold numbers in `args` by `op`.
+ *
+ * `op` is a template parameter, so it is inlined into the loop.
+ */
+template <typename Op> inline Value fold_num(Value args, Op op) {
+  Cell &head = args.AsCell();
+  Value r = head.Car;
+  if (head.Cdr.IsNil()) {
+    check_number(r);
     return r;
+  }
+
+  // Fast path of two arguments.
+  Cell &second = head.Cdr.AsCell();
+  r = op(r, second.Car);
+  for (Value p = second.Cdr; !p.IsNil();) {
+    Cell &c = p.AsCell();
+    r = op(r, c.Car);
+    p = c.Cdr;
+  }
+  return r;
+}
+
+/**
+ * Compare each adjacent pair in `args` by `op`.
+ *
+ * Stops at the first pair which doesn't satisfy `op`.
+ */
+template <typename Op> inline Value compare(Value args, Op op) {
+  Cell *c = &args.AsCell();
+  Value a = c->Car;
+  if (a.IsString()) {
+    string_view s = a.AsString();
+    for (Value p = c->Cdr; !p.IsNil(); p = c->Cdr) {
+      c = &p.AsCell();
+      string_view t = c->Car.AsString();
+      if (!op(s, t)) {
+        return false;
+      }
+      s = t;
+    }
   } else {
-    throw BUG();
+    check_number(a);
+    for (Value p = c->Cdr; !p.IsNil(); p = c->Cdr) {
+      c = &p.AsCell();
+      if (!num_cmp(a, c->Car, op)) {
+        return false;
+      }
+      a = c->Car;
+    }
   }
+  return true;
 }
 
-static Value modulo(Ctx &ctx, vint_t a, vint_t b) { return a % b; }
+//===================================================================
+// Procedures
+//===================================================================
+
+static Value multiply(Ctx &ctx, Value args) { return fold_num(args, mul2); }
 
-static Value abs_(Ctx &ctx, vint_t a) { return abs(a); }
-static Value nagative_p(Ctx &ctx, vint_t a) { return a < 0; }
-static Value positive_p(Ctx &ctx, vint_t a) { return a >= 0; }
-static Value zero_p(Ctx &ctx, vint_t a) { return a == 0; }
+static Value divide(Ctx &ctx, Value args) { return fold_num(args, div2); }
 
-static Value min_(Ctx &ctx, Value args) {
-  return fold_num(args, [](vint_t a, vint_t b) { return min(a, b); });
+static Value add(Ctx &ctx, Value args) {
+  if (car(args).IsString()) {
+    return string_concat(args);
+  } else {
+    return fold_num(args, add2);
+  }
 }
 
-static Value max_(Ctx &ctx, Value args) {
-  return fold_num(args, [](vint_t a, vint_t b) { return max(a, b); });
+static Value sub(Ctx &ctx, Value args) { return fold_num(args, sub2); }
+
+static Value quotient(Ctx &ctx, Value a, Value b) {
+  return num_quotient(a, b);
 }
 
-inline Value comp_(Ctx &ctx, Value args, function<bool(vint_t, vint_t)> f_int,
-                   function<bool(const string &, const string &)> f_str) {
-  Value head = car(args);
-  bool result = true;
-  if (head.Type() == ValueType::NUMBER) {
-    fold<vint_t>(args, [&](vint_t a, vint_t b) {
-      result = f_int(a, b);
-      return b;
-    });
-    return result;
-  } else if (head.Type() == ValueType::STRING) {
-    foldc<string>(args, [&](const string &a, const string &b) {
-      result = f_str(a, b);
-      return b;
-    });
-    return result;
-  } else {
-    throw BUG();
+static Value remainder(Ctx &ctx, Value a, Value b) {
+  return num_remainder(a, b);
+}
+
+static Value modulo(Ctx &ctx, Value a, Value b) { return num_modulo(a, b); }
+
+static Value expt(Ctx &ctx, Value a, Value b) { return num_expt(a, b); }
+
+static Value abs_(Ctx &ctx, Value a) {
+  return num_sign(a) < 0 ? sub2(0, a) : a;
+}
+
+static Value nagative_p(Ctx &ctx, Value a) { return num_sign(a) < 0; }
+static Value positive_p(Ctx &ctx, Value a) { return num_sign(a) >= 0; }
+
+static Value zero_p(Ctx &ctx, Value a) {
+  if (a.IsFlonum()) {
+    return a.AsFlonum() == 0.0;
+  }
+  return num_sign(a) == 0;
+}
+
+static Value min_(Ctx &ctx, Value args) { return fold_num(args, min2); }
+static Value max_(Ctx &ctx, Value args) { return fold_num(args, max2); }
+
+static double round_even(double d) { return std::nearbyint(d); }
+static double floor_(double d) { return std::floor(d); }
+static double ceiling_(double d) { return std::ceil(d); }
+static double truncate_(double d) { return std::trunc(d); }
+
+template <double (*F)(double)> static Value round_by(Ctx &ctx, Value a) {
+  if (a.IsFlonum()) {
+    return F(a.AsFlonum());
+  }
+  check_number(a);
+  return a;
+}
+
+static Value square(Ctx &ctx, Value a) { return mul2(a, a); }
+
+static Value sqrt_(Ctx &ctx, Value a) {
+  if (a.IsNumber() && a.AsNumber() >= 0) {
+    vint_t r = (vint_t)std::sqrt((double)a.AsNumber());
+    if (r * r == a.AsNumber()) {
+      return r;
+    }
+  }
+  return std::sqrt(to_double(a));
+}
+
+static Value exact(Ctx &ctx, Value a) { return to_exact(a); }
+static Value inexact(Ctx &ctx, Value a) { return to_double(a); }
+
+static Value real_p(Ctx &ctx, Value v) { return v.IsNumeric(); }
+static Value integer_p(Ctx &ctx, Value v) {
+  if (v.IsFlonum()) {
+    double d = v.AsFlonum();
+    return std::isfinite(d) && d == std::trunc(d);
   }
+  return v.IsExactInteger();
+}
+static Value exact_p(Ctx &ctx, Value v) {
+  check_number(v);
+  return v.IsExactInteger();
+}
+static Value inexact_p(Ctx &ctx, Value v) {
+  check_number(v);
+  return v.IsFlonum();
 }
 
 static Value greater(Ctx &ctx, Value args) {
-  return comp_(
-      ctx, args, [](auto a, auto b) { return a > b; },
-      [](auto a, auto b) { return a > b; });
+  return compare(args, std::greater<>());
 }
 
 static Value greater_eq(Ctx &ctx, Value args) {
-  return comp_(
-      ctx, args, [](auto a, auto b) { return a >= b; },
-      [](auto a, auto b) { return a >= b; });
+  return compare(args, std::greater_equal<>());
 }
 
-static Value less(Ctx &ctx, Value args) {
-  return comp_(
-      ctx, args, [](auto a, auto b) { return a < b; },
-      [](auto a, auto b) { return a < b; });
-}
+static Value less(Ctx &ctx, Value args) { return compare(args, std::less<>()); }
 
 static Value less_eq(Ctx &ctx, Value args) {
-  return comp_(
-      ctx, args, [](auto a, auto b) { return a <= b; },
-      [](auto a, auto b) { return a <= b; });
+  return compare(args, std::less_equal<>());
 }
 
 static Value eq_p(Ctx &ctx, Value args) {
@@ -120,36 +251,60 @@ static Value eq_p(Ctx &ctx, Value args) {
   return true;
 }
 
+static Value num_eq_p(Ctx &ctx, Value args) {
+  if (car(args).IsNumeric()) {
+    return compare(args, std::equal_to<>());
+  } else {
+    return eq_p(ctx, args);
+  }
+}
+
 #define F(id, f) add_proc(vm, false, id, f);
 #define FV(id, f) add_proc_varg(vm, false, id, f);
 #define M(id, f) add_proc(vm, true, id, f);
 #define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
 
 void lib_number_init(VM &vm) {
-  FV("+", add);
-  FV("-", sub);
-  FV("*", multiply);
-  FV("/", divide);
-  F("modulo", modulo);
-  F("abs", abs_);
-  F("nagative?", nagative_p);
-  F("positive?", positive_p);
-  F("zero?", zero_p);
-  F("min", min_);
-  F("max", max_);
-  // F("round", round_);
-  // F("floor", floor_);
-  // F("ceiling", ceiling_);
-  // F("square", square_);
-
-  FV(">", greater);
-  FV(">=", greater_eq);
-  FV("<", less);
-  FV("<=", less_eq);
-
-  FV("eq?", eq_p);
-  FV("eqv?", eq_p);
-  FV("=", eq_p);
+  PV("+", add);
+  PV("-", sub);
+  PV("*", multiply);
+  PV("/", divide);
+  P("quotient", quotient);
+  P("remainder", remainder);
+  P("modulo", modulo);
+  P("expt", expt);
+  P("abs", abs_);
+  P("nagative?", nagative_p);
+  P("positive?", positive_p);
+  P("zero?", zero_p);
+  PV("min", min_);
+  PV("max", max_);
+  P("round", round_by<round_even>);
+  P("floor", round_by<floor_>);
+  P("ceiling", round_by<ceiling_>);
+  P("truncate", round_by<truncate_>);
+  P("square", square);
+  P("sqrt", sqrt_);
+  P("exact", exact);
+  P("inexact", inexact);
+  P("inexact->exact", exact);
+  P("exact->inexact", inexact);
+
+  P("real?", real_p);
+  P("integer?", integer_p);
+  P("exact?", exact_p);
+  P("inexact?", inexact_p);
+
+  PV(">", greater);
+  PV(">=", greater_eq);
+  PV("<", less);
+  PV("<=", less_eq);
+
+  PV("eq?", eq_p);
+  PV("eqv?", eq_p);
+  PV("=", num_eq_p);
 }
 
 } // namespace cxxlisp
@@ -0,0 +1,191 @@
+#include "persistent.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+//===================================================================
+// pmap
+//===================================================================
+
+// (pmap key1 val1 key2 val2 ...)
+static Value pmap(Ctx &ctx, Value args) {
+  PMap *m = PMap::Empty()->Transient();
+  for (Value p = args; !p.IsNil(); p = cdr(cdr(p))) {
+    if (cdr(p).IsNil()) {
+      throw LispException("pmap requires even number of arguments.");
+    }
+    m->SetInPlace(car(p), car(cdr(p)));
+  }
+  m->Persistent();
+  return m;
+}
+
+static Value pmap_p(Ctx &ctx, Value v) { return v.IsPMap(); }
+
+static Value pmap_count(Ctx &ctx, PMap &m) { return (vint_t)m.Size(); }
+
+// (pmap-ref map key [default])
+static Value pmap_ref(Ctx &ctx, Value args) {
+  auto [m, key, rest] = uncons_rest<Value, Value, Value>(args);
+  if (const Value *v = m.AsPMap().Find(key)) {
+    return *v;
+  } else if (!rest.IsNil()) {
+    return car(rest);
+  }
+  throw LispException("Key " + key.ToString() + " not found.");
+}
+
+static Value pmap_contains_p(Ctx &ctx, PMap &m, Value key) {
+  return m.Find(key) != nullptr;
+}
+
+static Value pmap_set(Ctx &ctx, PMap &m, Value key, Value val) {
+  return m.Set(key, val);
+}
+
+static Value pmap_delete(Ctx &ctx, PMap &m, Value key) {
+  return m.Delete(key);
+}
+
+static Value pmap_set_i(Ctx &ctx, PMap &m, Value key, Value val) {
+  m.SetInPlace(key, val);
+  return &m;
+}
+
+static Value pmap_delete_i(Ctx &ctx, PMap &m, Value key) {
+  m.DeleteInPlace(key);
+  return &m;
+}
+
+static Value pmap_to_alist(Ctx &ctx, PMap &m) {
+  Value r = NIL;
+  m.Each([&r](Value k, Value v) { r = cons(cons(k, v), r); });
+  return r;
+}
+
+static Value pmap_keys(Ctx &ctx, PMap &m) {
+  Value r = NIL;
+  m.Each([&r](Value k, Value v) { r = cons(k, r); });
+  return r;
+}
+
+//===================================================================
+// pvector
+//===================================================================
+
+static Value list_to_pvector(Ctx &ctx, Value li) {
+  PVector *v = PVector::Empty()->Transient();
+  for (auto x : li) {
+    v->PushInPlace(x);
+  }
+  v->Persistent();
+  return v;
+}
+
+static Value pvector(Ctx &ctx, Value args) {
+  return list_to_pvector(ctx, args);
+}
+
+static Value pvector_p(Ctx &ctx, Value v) { return v.IsPVector(); }
+
+static Value pvector_length(Ctx &ctx, PVector &v) {
+  return (vint_t)v.Size();
+}
+
+static Value pvector_ref(Ctx &ctx, PVector &v, vint_t idx) {
+  return v.Ref(idx);
+}
+
+static Value pvector_set(Ctx &ctx, PVector &v, vint_t idx, Value x) {
+  return v.Set(idx, x);
+}
+
+static Value pvector_push(Ctx &ctx, PVector &v, Value x) { return v.Push(x); }
+
+static Value pvector_pop(Ctx &ctx, PVector &v) { return v.Pop(); }
+
+static Value pvector_set_i(Ctx &ctx, PVector &v, vint_t idx, Value x) {
+  v.SetInPlace(idx, x);
+  return &v;
+}
+
+static Value pvector_push_i(Ctx &ctx, PVector &v, Value x) {
+  v.PushInPlace(x);
+  return &v;
+}
+
+static Value pvector_pop_i(Ctx &ctx, PVector &v) {
+  v.PopInPlace();
+  return &v;
+}
+
+static Value pvector_to_list(Ctx &ctx, PVector &v) {
+  Value r = NIL;
+  for (vint_t i = (vint_t)v.Size() - 1; i >= 0; i--) {
+    r = cons(v.Ref(i), r);
+  }
+  return r;
+}
+
+//===================================================================
+// Transient
+//===================================================================
+
+static Value transient(Ctx &ctx, Value v) {
+  if (v.IsPMap()) {
+    return v.AsPMap().Transient();
+  } else {
+    return v.AsPVector().Transient();
+  }
+}
+
+static Value persistent_i(Ctx &ctx, Value v) {
+  if (v.IsPMap()) {
+    v.AsPMap().Persistent();
+  } else {
+    v.AsPVector().Persistent();
+  }
+  return v;
+}
+
+#define F(id, f) add_proc(vm, false, id, f);
+#define FV(id, f) add_proc_varg(vm, false, id, f);
+#define M(id, f) add_proc(vm, true, id, f);
+#define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
+
+void lib_persistent_init(VM &vm) {
+  FV("pmap", pmap);
+  P("pmap?", pmap_p);
+  F("pmap-count", pmap_count);
+  FV("pmap-ref", pmap_ref);
+  F("pmap-contains?", pmap_contains_p);
+  F("pmap-set", pmap_set);
+  F("pmap-delete", pmap_delete);
+  F("pmap-set!", pmap_set_i);
+  F("pmap-delete!", pmap_delete_i);
+  F("pmap->alist", pmap_to_alist);
+  F("pmap-keys", pmap_keys);
+
+  FV("pvector", pvector);
+  F("list->pvector", list_to_pvector);
+  P("pvector?", pvector_p);
+  F("pvector-length", pvector_length);
+  F("pvector-ref", pvector_ref);
+  F("pvector-set", pvector_set);
+  F("pvector-push", pvector_push);
+  F("pvector-pop", pvector_pop);
+  F("pvector-set!", pvector_set_i);
+  F("pvector-push!", pvector_push_i);
+  F("pvector-pop!", pvector_pop_i);
+  F("pvector->list", pvector_to_list);
+
+  F("transient", transient);
+  F("persistent!", persistent_i);
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,164 @@
+#include <fstream>
+#include <iostream>
+
+#include "trace.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+// (profile-start [interval-us])
+static Value profile_start(Ctx &ctx, Value args) {
+  int interval = Profiler::DEFAULT_INTERVAL_US;
+  if (!args.IsNil()) {
+    interval = (int)car(args).AsNumber();
+  }
+  ctx.vm->Profile().Clear();
+  ctx.vm->Profile().Start(interval);
+  return UNDEF;
+}
+
+// Write by `write` to the file of the optional path in `args`, or stdout.
+template <typename F> static void write_output(Value args, F write) {
+  if (args.IsNil()) {
+    write(cout);
+  } else {
+    string path(car(args).AsString());
+    ofstream os(path);
+    if (!os.is_open()) {
+      throw LispException("Can't open '" + path + "'.");
+    }
+    write(os);
+  }
+}
+
+// (profile-stop [path])
+//
+// Write the folded stacks to `path`, or stdout. Returns the number of
+// samples.
+static Value profile_stop(Ctx &ctx, Value args) {
+  Profiler &prof = ctx.vm->Profile();
+  prof.Stop();
+  write_output(args, [&](ostream &os) { prof.Write(os); });
+  return (vint_t)prof.Samples();
+}
+
+// (procedure-stats-start)
+static Value procedure_stats_start(Ctx &ctx) {
+  ctx.vm->Stats().Clear();
+  ctx.vm->EnableCallStats = true;
+  return UNDEF;
+}
+
+// (procedure-stats-stop)
+static Value procedure_stats_stop(Ctx &ctx) {
+  ctx.vm->EnableCallStats = false;
+  return UNDEF;
+}
+
+// (procedure-stats)
+//
+// Returns a list of (name calls self-ms total-ms), sorted by self time.
+static Value procedure_stats(Ctx &ctx) {
+  auto entries = ctx.vm->Stats().Sorted();
+  Value r = NIL;
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    auto &[proc, entry] = *it;
+    r = cons(list(ctx.vm->Intern(profile_name(*proc)), (vint_t)entry.Calls,
+                  entry.SelfNs / 1e6, entry.TotalNs / 1e6),
+             r);
+  }
+  return r;
+}
+
+// (alloc-profile-start)
+static Value alloc_profile_start(Ctx &ctx) {
+  ctx.vm->Allocs().Start();
+  return UNDEF;
+}
+
+// (alloc-profile-stop)
+static Value alloc_profile_stop(Ctx &ctx) {
+  ctx.vm->Allocs().Stop();
+  return UNDEF;
+}
+
+// (alloc-stats)
+//
+// Returns a list of (procedure form objects bytes), sorted by bytes.
+// `procedure` is #f at top level.
+static Value alloc_stats(Ctx &ctx) {
+  auto sites = ctx.vm->Allocs().Sites();
+  Value r = NIL;
+  for (auto it = sites.rbegin(); it != sites.rend(); ++it) {
+    Value proc = it->Proc ? Value(ctx.vm->Intern(profile_name(*it->Proc)))
+                          : Value(BOOL_F);
+    Value form = it->Form ? Value(it->Form) : NIL;
+    r = cons(list(proc, form, (vint_t)it->Total.Count,
+                  (vint_t)it->Total.Bytes),
+             r);
+  }
+  return r;
+}
+
+// (room)
+static Value room(Ctx &ctx) {
+  write_room(cout, *ctx.vm);
+  return UNDEF;
+}
+
+// (trace-events-start)
+static Value trace_events_start(Ctx &ctx) {
+  Tracer::Instance().Start();
+  return UNDEF;
+}
+
+// (trace-events-stop [path])
+//
+// Write the events as JSON to `path`, or stdout. Returns the number of
+// events.
+static Value trace_events_stop(Ctx &ctx, Value args) {
+  Tracer &tracer = Tracer::Instance();
+  tracer.Stop();
+  write_output(args, [&](ostream &os) { tracer.Write(os); });
+  return (vint_t)tracer.Size();
+}
+
+// (coverage-start)
+static Value coverage_start(Ctx &ctx) {
+  ctx.vm->Cover().Clear();
+  ctx.vm->EnableCoverage = true;
+  return UNDEF;
+}
+
+// (coverage-stop [path])
+//
+// Write the coverage in lcov format to `path`, or stdout.
+static Value coverage_stop(Ctx &ctx, Value args) {
+  ctx.vm->EnableCoverage = false;
+  write_output(args, [&](ostream &os) { ctx.vm->Cover().Write(os, *ctx.vm); });
+  return UNDEF;
+}
+
+#define F(id, f) add_proc(vm, false, id, f);
+#define FV(id, f) add_proc_varg(vm, false, id, f);
+
+void lib_profile_init(VM &vm) {
+  FV("profile-start", profile_start);
+  FV("profile-stop", profile_stop);
+  F("procedure-stats-start", procedure_stats_start);
+  F("procedure-stats-stop", procedure_stats_stop);
+  F("procedure-stats", procedure_stats);
+  F("alloc-profile-start", alloc_profile_start);
+  F("alloc-profile-stop", alloc_profile_stop);
+  F("alloc-stats", alloc_stats);
+  F("room", room);
+  F("trace-events-start", trace_events_start);
+  FV("trace-events-stop", trace_events_stop);
+  F("coverage-start", coverage_start);
+  FV("coverage-stop", coverage_stop);
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,91 @@
+#include "record.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+static Value make_record_type(Ctx &ctx, Atom name, Value fields) {
+  vector<Value> v;
+  for (auto f : fields) {
+    f.AsAtom();
+    v.push_back(f);
+  }
+  return new RecordType(ctx.vm->AtomToString(name), std::move(v));
+}
+
+// (record-constructor type [fields]) where fields defaults to all fields.
+static Value record_constructor(Ctx &ctx, Value args) {
+  RecordType &type = car(args).AsRecordType();
+  vector<int> idxs;
+  if (cdr(args).IsNil()) {
+    for (size_t i = 0; i < type.Fields().size(); i++) {
+      idxs.push_back((int)i);
+    }
+  } else {
+    for (auto f : car(cdr(args))) {
+      idxs.push_back(type.FieldIndex(f));
+    }
+  }
+
+  RecordType *t = &type;
+  return new Procedure((int)idxs.size(), [t, idxs](Ctx &ctx, Value args) {
+    auto r = new Record(t);
+    for (int idx : idxs) {
+      r->Slot(idx) = car(args);
+      args = cdr(args);
+    }
+    return Value(r);
+  });
+}
+
+static Value record_predicate(Ctx &ctx, RecordType &type) {
+  RecordType *t = &type;
+  return new Procedure(1, [t](Ctx &ctx, Value args) {
+    Value v = car(args);
+    return Value(v.IsRecord() && &v.AsRecord().Type() == t);
+  });
+}
+
+static Value record_accessor(Ctx &ctx, RecordType &type, Value field) {
+  RecordType *t = &type;
+  int idx = type.FieldIndex(field);
+  auto proc = new Procedure(1, [t, idx](Ctx &ctx, Value args) {
+    return check_record(car(args), *t).Slot(idx);
+  });
+  proc->SetIntrinsic(list(Value::CreateSpecialForm(SpecialForm::RECORD_REF),
+                          t, (vint_t)idx));
+  return proc;
+}
+
+static Value record_modifier(Ctx &ctx, RecordType &type, Value field) {
+  RecordType *t = &type;
+  int idx = type.FieldIndex(field);
+  auto proc = new Procedure(2, [t, idx](Ctx &ctx, Value args) {
+    return check_record(car(args), *t).Slot(idx) = car(cdr(args));
+  });
+  proc->SetIntrinsic(list(Value::CreateSpecialForm(SpecialForm::RECORD_SET),
+                          t, (vint_t)idx));
+  return proc;
+}
+
+static Value record_p(Ctx &ctx, Value v) { return v.IsRecord(); }
+
+#define F(id, f) add_proc(vm, false, id, f);
+#define FV(id, f) add_proc_varg(vm, false, id, f);
+#define M(id, f) add_proc(vm, true, id, f);
+#define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
+
+void lib_record_init(VM &vm) {
+  F("make-record-type", make_record_type);
+  FV("record-constructor", record_constructor);
+  F("record-predicate", record_predicate);
+  F("record-accessor", record_accessor);
+  F("record-modifier", record_modifier);
+  P("record?", record_p);
+}
+
+} // namespace cxxlisp
@@ -1,3 +1,8 @@
+#include <cstring>
+
+#include "number.hpp"
+#include "string_builder.hpp"
+#include "utf8.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
@@ -5,26 +10,75 @@ namespace cxxlisp {
 
 using namespace std;
 
-static Value string_length(Ctx &ctx, const string &str) {
-  return (vint_t)str.size();
+// Substrings shorter than this are copied, so that small slices don't keep
+// a large base string alive.
+static const vint_t SLICE_MIN = 32;
+
+// Check that start..end is in 0..len. Indices are in characters, or in
+// bytes for cursors.
+static void check_range(size_t len, vint_t start, vint_t end) {
+  if (start < 0 || end < start || end > (vint_t)len) {
+    throw LispException("Invalid range " + to_string(start) + ".." +
+                        to_string(end) + " for string of length " +
+                        to_string(len) + ".");
+  }
 }
 
-static Value substring(Ctx &ctx, const string &str, vint_t start, vint_t end) {
-  return str.substr(start, end - start);
+static Value string_length(Ctx &ctx, Value str) {
+  return (vint_t)str.AsStringValue().Length();
 }
 
-static Value string_append(Ctx &ctx, Value args) {
-  stringstream s;
-  for (auto v : args) {
-    s << v.AsString();
+static Value slice(const StringValue &str, size_t start, size_t end) {
+  if ((vint_t)(end - start) < SLICE_MIN) {
+    return string(str.Ref().substr(start, end - start));
+  }
+  return new StringValue(&str, start, end - start);
+}
+
+static Value substring(Ctx &ctx, Value v, vint_t start, vint_t end) {
+  const StringValue &str = v.AsStringValue();
+  check_range(str.Length(), start, end);
+  return slice(str, str.ByteOffset(start), str.ByteOffset(end));
+}
+
+// Results shorter than this are copied into a flat string.
+static const size_t ROPE_MIN = 256;
+
+Value string_concat(Value strs) {
+  size_t size = 0;
+  for (auto v : strs) {
+    size += v.AsStringValue().Size();
   }
-  return s.str();
+
+  if (size < ROPE_MIN) {
+    string r;
+    r.reserve(size);
+    for (auto v : strs) {
+      r += v.AsString();
+    }
+    return r;
+  }
+
+  // Build a rope, so appending to a long string doesn't copy it.
+  const StringValue *r = nullptr;
+  for (auto v : strs) {
+    const StringValue &s = v.AsStringValue();
+    if (s.Size() > 0) {
+      r = r ? new StringValue(r, &s) : &s;
+    }
+  }
+  return r;
 }
 
-static Value string_to_list(Ctx &ctx, const string &str) {
+static Value string_append(Ctx &ctx, Value args) {
+  return string_concat(args);
+}
+
+static Value string_to_list(Ctx &ctx, string_view str) {
   Value head = NIL;
-  for (int i = (int)str.size() - 1; i >= 0; i--) {
-    head = cons((vint_t)str[i], head);
+  for (size_t pos = str.size(); pos > 0;) {
+    pos = utf8_prev(str, pos);
+    head = cons(utf8_decode(str, pos), head);
   }
   return head;
 }
@@ -32,36 +86,292 @@ static Value string_to_list(Ctx &ctx, const string &str) {
 static Value list_to_string(Ctx &ctx, Value li) {
   string str;
   for (auto c : li) {
-    str.push_back((char)c.AsNumber());
+    utf8_encode(str, c.AsChar());
   }
   return str;
 }
 
-static Value string_to_number(Ctx &ctx, const string &str) { return stoi(str); }
-static Value number_to_string(Ctx &ctx, vint_t v) { return to_string(v); }
-static Value string_to_symbol(Ctx &ctx, const string &str) {
-  return ctx.vm->Intern(str);
+static Value string_ref(Ctx &ctx, Value v, vint_t idx) {
+  const StringValue &str = v.AsStringValue();
+  check_range(str.Length(), idx, idx + 1);
+  return utf8_decode(str.Ref(), str.ByteOffset(idx));
+}
+
+// (string-for-each proc str) calls (proc char) for each character.
+static Value string_for_each(Ctx &ctx, Value f, Value v) {
+  string_view str = v.AsString();
+  for (size_t pos = 0; pos < str.size(); pos = utf8_next(str, pos)) {
+    Value r = Eval().Call(ctx, f, list(utf8_decode(str, pos)));
+    if (r.IsEscape()) {
+      return r;
+    }
+  }
+  return NIL;
+}
+
+static Value string_to_number(Ctx &ctx, string_view str) {
+  Value v;
+  if (parse_number(str, v)) {
+    return v;
+  } else {
+    return false;
+  }
+}
+
+static Value number_to_string_(Ctx &ctx, Value v) {
+  check_number(v);
+  return number_to_string(v);
+}
+static Value string_to_symbol(Ctx &ctx, string_view str) {
+  return ctx.vm->Intern(string(str));
 }
 static Value symbol_to_string(Ctx &ctx, Atom v) {
-  return ctx.vm->AtomToString(v);
+  return ctx.vm->InternString(ctx.vm->AtomToString(v));
+}
+
+//===================================================================
+// Searching
+//
+// memchr() and memmem() are vectorized in glibc, and memmem() uses the
+// two-way algorithm, so they are much faster than a byte loop.
+//===================================================================
+
+static size_t find_bytes(string_view str, string_view pat, size_t start) {
+  const char *p;
+  if (pat.size() == 1) {
+    p = (const char *)memchr(str.data() + start, pat[0], str.size() - start);
+  } else {
+    p = (const char *)memmem(str.data() + start, str.size() - start,
+                             pat.data(), pat.size());
+  }
+  return p ? p - str.data() : string_view::npos;
+}
+
+// Byte offset of the optional start index in `rest`.
+static size_t optional_start(const StringValue &str, Value rest) {
+  vint_t start = rest.IsNil() ? 0 : car(rest).AsNumber();
+  check_range(str.Length(), start, str.Length());
+  return str.ByteOffset(start);
+}
+
+// Character index of the match at byte offset `pos`, or #f.
+static Value found(const StringValue &str, size_t pos) {
+  if (pos == string_view::npos) {
+    return false;
+  }
+  return (vint_t)str.CharIndex(pos);
+}
+
+// (string-index str pred [start]) where pred is a char or a procedure.
+static Value string_index(Ctx &ctx, Value args) {
+  auto [v, pred, rest] = uncons_rest<Value, Value, Value>(args);
+  const StringValue &str = v.AsStringValue();
+  string_view s = str.Ref();
+  size_t start = optional_start(str, rest);
+  if (pred.IsChar()) {
+    string c;
+    utf8_encode(c, pred.AsChar());
+    return found(str, find_bytes(s, c, start));
+  }
+  for (size_t pos = start; pos < s.size(); pos = utf8_next(s, pos)) {
+    Value r = Eval().Call(ctx, pred, list(utf8_decode(s, pos)));
+    if (r.IsEscape()) {
+      return r;
+    } else if (r.Truthy()) {
+      return found(str, pos);
+    }
+  }
+  return false;
+}
+
+// (string-contains str pattern [start])
+static Value string_contains(Ctx &ctx, Value args) {
+  auto [v, pat, rest] = uncons_rest<Value, Value, Value>(args);
+  const StringValue &str = v.AsStringValue();
+  size_t start = optional_start(str, rest);
+  return found(str, find_bytes(str.Ref(), pat.AsString(), start));
+}
+
+// (string-split str delimiter) returns the list of fields, as slices if long
+// enough.
+static Value string_split(Ctx &ctx, Value v, string_view delim) {
+  if (delim.empty()) {
+    throw LispException("Empty delimiter for string-split.");
+  }
+  const StringValue &str = v.AsStringValue();
+  string_view s = str.Ref();
+  vector<size_t> starts{0};
+  for (size_t i = find_bytes(s, delim, 0); i != string_view::npos;
+       i = find_bytes(s, delim, i + delim.size())) {
+    starts.push_back(i + delim.size());
+  }
+
+  Value r = NIL;
+  size_t end = s.size();
+  for (auto it = starts.rbegin(); it != starts.rend(); ++it) {
+    r = cons(slice(str, *it, end), r);
+    end = *it - delim.size();
+  }
+  return r;
+}
+
+// (string-join list [delimiter]), delimiter defaults to " ".
+static Value string_join(Ctx &ctx, Value args) {
+  auto [strs, rest] = uncons_rest<Value, Value>(args);
+  string_view delim = rest.IsNil() ? " " : car(rest).AsString();
+  string r;
+  bool first = true;
+  for (auto v : strs) {
+    if (!first) {
+      r += delim;
+    }
+    r += v.AsString();
+    first = false;
+  }
+  return r;
+}
+
+//===================================================================
+// String builder
+//===================================================================
+
+static Value make_string_builder(Ctx &ctx) { return new StringBuilder(); }
+
+static Value string_builder_p(Ctx &ctx, Value v) {
+  return v.IsStringBuilder();
+}
+
+// (sb-append! sb v ...) appends strings and chars as is, and other values
+// as printed by display.
+static Value sb_append_i(Ctx &ctx, Value args) {
+  StringBuilder &sb = car(args).AsStringBuilder();
+  for (auto v : cdr(args)) {
+    if (v.IsString()) {
+      sb.Append(v.AsStringValue());
+    } else if (v.IsChar()) {
+      string c;
+      utf8_encode(c, v.AsChar());
+      sb.Append(c);
+    } else {
+      sb.Append(v.ToString(ctx.vm));
+    }
+  }
+  return NIL;
+}
+
+static Value sb_length(Ctx &ctx, StringBuilder &sb) {
+  return (vint_t)sb.Size();
+}
+
+static Value sb_to_string(Ctx &ctx, StringBuilder &sb) { return sb.Ref(); }
+
+static Value sb_clear_i(Ctx &ctx, StringBuilder &sb) {
+  sb.Clear();
+  return NIL;
+}
+
+//===================================================================
+// String cursors
+//
+// A cursor is a byte offset into the string, so moving it is O(1) even for
+// non-ASCII strings. Scanning with cursors doesn't allocate, unlike
+// string->list.
+//===================================================================
+
+// Check that `cur` is in `str`, or at its end, at the start of a character.
+static void check_cursor(string_view str, vint_t cur) {
+  check_range(str.size(), cur, cur);
+  if (!utf8_is_boundary(str, cur)) {
+    throw LispException("Cursor " + to_string(cur) +
+                        " is in the middle of a character.");
+  }
+}
+
+static Value string_cursor_start(Ctx &ctx, string_view str) { return 0; }
+
+static Value string_cursor_end(Ctx &ctx, string_view str) {
+  return (vint_t)str.size();
+}
+
+static Value string_cursor_next(Ctx &ctx, string_view str, vint_t cur) {
+  check_range(str.size(), cur, cur + 1);
+  check_cursor(str, cur);
+  return (vint_t)utf8_next(str, cur);
+}
+
+static Value string_cursor_prev(Ctx &ctx, string_view str, vint_t cur) {
+  check_range(str.size(), cur - 1, cur);
+  check_cursor(str, cur);
+  return (vint_t)utf8_prev(str, cur);
+}
+
+static Value string_cursor_ref(Ctx &ctx, string_view str, vint_t cur) {
+  check_range(str.size(), cur, cur + 1);
+  check_cursor(str, cur);
+  return utf8_decode(str, cur);
+}
+
+static Value string_cursor_to_index(Ctx &ctx, Value v, vint_t cur) {
+  const StringValue &str = v.AsStringValue();
+  check_cursor(str.Ref(), cur);
+  return (vint_t)str.CharIndex(cur);
+}
+
+static Value string_index_to_cursor(Ctx &ctx, Value v, vint_t idx) {
+  const StringValue &str = v.AsStringValue();
+  check_range(str.Length(), idx, idx);
+  return (vint_t)str.ByteOffset(idx);
+}
+
+static Value substring_cursors(Ctx &ctx, Value v, vint_t start, vint_t end) {
+  const StringValue &str = v.AsStringValue();
+  check_range(str.Size(), start, end);
+  check_cursor(str.Ref(), start);
+  check_cursor(str.Ref(), end);
+  return slice(str, start, end);
 }
 
 #define F(id, f) add_proc(vm, false, id, f);
 #define FV(id, f) add_proc_varg(vm, false, id, f);
 #define M(id, f) add_proc(vm, true, id, f);
 #define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
 
 void lib_string_init(VM &vm) {
-  F("string-length", string_length);
-  F("substring", substring);
-  FV("string-append", string_append);
+  P("string-length", string_length);
+  P("substring", substring);
+  PV("string-append", string_append);
 
+  P("string-ref", string_ref);
+  F("string-for-each", string_for_each);
   F("string->list", string_to_list);
-  F("list->string", list_to_string);
-  F("string->number", string_to_number);
-  F("number->string", number_to_string);
-  F("string->symbol", string_to_symbol);
-  F("symbol->string", symbol_to_string);
+  P("list->string", list_to_string);
+  P("string->number", string_to_number);
+  P("number->string", number_to_string_);
+  P("string->symbol", string_to_symbol);
+  P("symbol->string", symbol_to_string);
+
+  FV("string-index", string_index);
+  PV("string-contains", string_contains);
+  F("string-split", string_split);
+  PV("string-join", string_join);
+
+  F("make-string-builder", make_string_builder);
+  P("string-builder?", string_builder_p);
+  FV("sb-append!", sb_append_i);
+  F("sb-length", sb_length);
+  F("sb->string", sb_to_string);
+  F("sb-clear!", sb_clear_i);
+
+  P("string-cursor-start", string_cursor_start);
+  P("string-cursor-end", string_cursor_end);
+  P("string-cursor-next", string_cursor_next);
+  P("string-cursor-prev", string_cursor_prev);
+  P("string-cursor-ref", string_cursor_ref);
+  P("string-cursor->index", string_cursor_to_index);
+  P("string-index->cursor", string_index_to_cursor);
+  P("substring/cursors", substring_cursors);
 }
 
 } // namespace cxxlisp
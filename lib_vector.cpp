@@ -0,0 +1,132 @@
+#include "util.hpp"
+#include "vector.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+static VectorType type_arg(Ctx &ctx, Value v) {
+  return vector_type_from_name(ctx.vm->AtomToString(v.AsAtom()));
+}
+
+// (make-vector size [fill [type]])
+static Value make_vector(Ctx &ctx, Value args) {
+  vint_t size = car(args).AsNumber();
+  if (size < 0) {
+    throw LispException("Negative vector size.");
+  }
+  Value rest = cdr(args);
+  Value fill = 0;
+  VectorType type = VectorType::VALUE;
+  if (!rest.IsNil()) {
+    fill = car(rest);
+    if (!cdr(rest).IsNil()) {
+      type = type_arg(ctx, car(cdr(rest)));
+    }
+  }
+  return new Vector(type, size, fill);
+}
+
+// (list->vector list [type])
+static Value list_to_vector(Ctx &ctx, Value args) {
+  Value li = car(args);
+  VectorType type = VectorType::VALUE;
+  if (!cdr(args).IsNil()) {
+    type = type_arg(ctx, car(cdr(args)));
+  }
+
+  size_t size = 0;
+  for (Value p = li; !p.IsNil(); p = cdr(p)) {
+    size++;
+  }
+  auto v = new Vector(type, size, 0);
+  vint_t i = 0;
+  for (auto x : li) {
+    v->Set(i++, x);
+  }
+  return v;
+}
+
+static Value vector_(Ctx &ctx, Value args) {
+  return list_to_vector(ctx, list(args));
+}
+
+static Value vector_to_list(Ctx &ctx, Vector &v) {
+  Value r = NIL;
+  for (vint_t i = (vint_t)v.Size() - 1; i >= 0; i--) {
+    r = cons(v.Ref(i), r);
+  }
+  return r;
+}
+
+static Value vector_p(Ctx &ctx, Value v) { return v.IsVector(); }
+
+static Value vector_length(Ctx &ctx, Vector &v) { return (vint_t)v.Size(); }
+
+static Value vector_type(Ctx &ctx, Vector &v) {
+  return ctx.vm->Intern(vector_type_name(v.Type()));
+}
+
+static Value vector_ref(Ctx &ctx, Vector &v, vint_t idx) { return v.Ref(idx); }
+
+static Value vector_set_i(Ctx &ctx, Vector &v, vint_t idx, Value x) {
+  v.Set(idx, x);
+  return x;
+}
+
+static Value vector_fill_i(Ctx &ctx, Vector &v, Value x) {
+  for (size_t i = 0; i < v.Size(); i++) {
+    v.Set(i, x);
+  }
+  return NIL;
+}
+
+static Value vector_add_(Ctx &ctx, Vector &a, Vector &b) {
+  return vector_add(a, b);
+}
+
+static Value vector_sum_(Ctx &ctx, Vector &v) { return vector_sum(v); }
+
+static Value vector_dot_(Ctx &ctx, Vector &a, Vector &b) {
+  return vector_dot(a, b);
+}
+
+// (vector-map f vec) returns new vector of the same type.
+static Value vector_map(Ctx &ctx, Value f, Vector &v) {
+  auto r = new Vector(v.Type(), v.Size(), 0);
+  for (size_t i = 0; i < v.Size(); i++) {
+    Value x = Eval().Call(ctx, f, list(v.Ref(i)));
+    if (x.IsEscape()) {
+      return x;
+    }
+    r->Set(i, x);
+  }
+  return r;
+}
+
+#define F(id, f) add_proc(vm, false, id, f);
+#define FV(id, f) add_proc_varg(vm, false, id, f);
+#define M(id, f) add_proc(vm, true, id, f);
+#define MV(id, f) add_proc_varg(vm, true, id, f);
+#define P(id, f) add_proc(vm, false, id, f)->SetIsPure(true);
+#define PV(id, f) add_proc_varg(vm, false, id, f)->SetIsPure(true);
+
+void lib_vector_init(VM &vm) {
+  FV("make-vector", make_vector);
+  FV("vector", vector_);
+  FV("list->vector", list_to_vector);
+  F("vector->list", vector_to_list);
+  P("vector?", vector_p);
+  P("vector-length", vector_length);
+  P("vector-type", vector_type);
+  F("vector-ref", vector_ref);
+  F("vector-set!", vector_set_i);
+  F("vector-fill!", vector_fill_i);
+  F("vector-add", vector_add_);
+  F("vector-sum", vector_sum_);
+  F("vector-dot", vector_dot_);
+  F("vector-map", vector_map);
+}
+
+} // namespace cxxlisp
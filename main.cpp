@@ -2,20 +2,78 @@
 #include <iostream>
 
 #include "parser.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
+#ifdef CXXLISP_GC_ENABLED
+#include <gc.h>
+#endif
+
 using namespace cxxlisp;
 using namespace std;
 
+// Write statistics of this process as JSON, for perfcxxlisp.
+static void write_stats(const char *path) {
+  ofstream os(path);
+#ifdef CXXLISP_GC_ENABLED
+  os << "{\"gc_count\": " << GC_get_gc_no()
+     << ", \"heap_bytes\": " << GC_get_heap_size() << "}" << endl;
+#else
+  os << "{\"gc_count\": null, \"heap_bytes\": null}" << endl;
+#endif
+}
+
 int main(int argc, char **argv) {
-  VM vm;
+  // Set up before the VM, to trace and cache loading the prelude.
+  const char *trace_path = nullptr;
+  const char *module_cache_dir = "";
+  for (int i = 1; i + 1 < argc; i++) {
+    if ("--trace-events"s == argv[i]) {
+      trace_path = argv[i + 1];
+      Tracer::Instance().Start();
+    } else if ("--module-cache"s == argv[i]) {
+      module_cache_dir = argv[i + 1];
+    }
+  }
+
+  VM vm(true, true, module_cache_dir);
+  const char *stats_path = nullptr;
+  const char *profile_path = nullptr;
+  const char *coverage_path = nullptr;
+  bool call_stats = false;
+  bool alloc_stats = false;
 
   for (int i = 1; i < argc; i++) {
     if ("-t"s == argv[i]) {
       vm.EnableTrace = true;
       vm.EnableTraceMacroExpand = true;
       continue;
+    } else if ("--stats"s == argv[i] && i + 1 < argc) {
+      stats_path = argv[++i];
+      continue;
+    } else if ("--profile"s == argv[i] && i + 1 < argc) {
+      profile_path = argv[++i];
+      continue;
+    } else if ("--coverage"s == argv[i] && i + 1 < argc) {
+      coverage_path = argv[++i];
+      vm.EnableCoverage = true;
+      continue;
+    } else if (("--trace-events"s == argv[i] ||
+                "--module-cache"s == argv[i]) &&
+               i + 1 < argc) {
+      i++;
+      continue;
+    } else if ("--no-macro-cache"s == argv[i]) {
+      vm.EnableMacroCache = false;
+      continue;
+    } else if ("--call-stats"s == argv[i]) {
+      vm.EnableCallStats = call_stats = true;
+      continue;
+    } else if ("--alloc-stats"s == argv[i]) {
+      vm.Allocs().Start();
+      alloc_stats = true;
+      continue;
     }
     ifstream fs(argv[i]);
     if (!fs.is_open()) {
@@ -24,9 +82,43 @@ int main(int argc, char **argv) {
     }
     string src((istreambuf_iterator<char>(fs)), istreambuf_iterator<char>());
 
-    run(vm, src);
-    return 0;
+    if (profile_path) {
+      vm.Profile().Start();
+    }
+    {
+      TraceSpan span("lisp", "load");
+      if (span.IsActive()) {
+        span.Arg("path", argv[i]);
+      }
+      run(vm, src, argv[i]);
+    }
+    if (profile_path) {
+      vm.Profile().Stop();
+      ofstream os(profile_path);
+      vm.Profile().Write(os);
+    }
+    break;
   }
 
+  if (stats_path) {
+    write_stats(stats_path);
+  }
+  if (call_stats) {
+    vm.Stats().Write(cerr);
+  }
+  if (alloc_stats) {
+    vm.Allocs().Stop();
+    vm.Allocs().Write(cerr);
+  }
+  if (coverage_path) {
+    vm.EnableCoverage = false;
+    ofstream os(coverage_path);
+    vm.Cover().Write(os, vm);
+  }
+  if (trace_path) {
+    Tracer::Instance().Stop();
+    ofstream os(trace_path);
+    Tracer::Instance().Write(os);
+  }
   return 0;
 }
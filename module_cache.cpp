@@ -0,0 +1,610 @@
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "module_cache.hpp"
+#include "number.hpp"
+#include "trace.hpp"
+#include "utf8.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+// Bump when the format, or code generated by the compiler changes.
+static const uint32_t FORMAT_VERSION = 2;
+static const string_view MAGIC = "CXLM";
+
+static uint64_t fnv1a(string_view s) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+static bool read_file(const string &path, string &out) {
+  ifstream fs(path, ios::binary);
+  if (!fs.is_open()) {
+    return false;
+  }
+  out.assign(istreambuf_iterator<char>(fs), istreambuf_iterator<char>());
+  return true;
+}
+
+enum class Tag : uint8_t {
+  NIL,
+  TRUE,
+  FALSE,
+  UNDEF,
+  NUMBER,
+  FLONUM,
+  BIGNUM,
+  ATOM,
+  CHAR,
+  STRING,
+  INTERNED_STRING,
+  LIST, // Count of cells, cars, and the last cdr.
+  LOCATED_LIST,
+  GLOBAL, // Value bound to the name in the root environment.
+  OPAQUE, // Type of a value which can't be written, only for hashing.
+};
+
+struct ValueHash {
+  size_t operator()(const Value &v) const { return hash_eq(v); }
+};
+using Globals = unordered_map<Value, string, ValueHash>;
+
+// Thrown by Writer for a value which can't be written.
+struct Unwritable {};
+
+// Thrown by Reader for a truncated or broken file.
+struct Corrupt {};
+
+// Thrown for a global which isn't bound, or has changed since the form was
+// compiled.
+struct Stale {};
+
+class Writer {
+  VM &vm_;
+  uint32_t file_; // Locations in this file are written.
+  bool globals_;  // Or write OPAQUE instead of GLOBAL.
+  optional<Globals> names_;
+  string out_;
+
+  void opaque(Value v) {
+    if (!globals_) {
+      U8((uint8_t)Tag::OPAQUE);
+      U8((uint8_t)v.Type());
+      return;
+    }
+    if (!names_) {
+      names_.emplace();
+      vm_.RootEnv().EachBinding([&](Atom name, Value bound) {
+        if (bound.IsRecordType() || bound.IsProcedure()) {
+          names_->emplace(bound, vm_.AtomToString(name));
+        }
+      });
+    }
+    auto it = names_->find(v);
+    if (it == names_->end()) {
+      throw Unwritable();
+    }
+    U8((uint8_t)Tag::GLOBAL);
+    Str(it->second);
+  }
+
+public:
+  Writer(VM &vm, uint32_t file, bool globals)
+      : vm_(vm), file_(file), globals_(globals) {}
+
+  const string &Data() const { return out_; }
+
+  // Forget the global names, which are collected when first needed, after
+  // bindings changed.
+  void ClearNames() { names_.reset(); }
+
+  void U8(uint8_t v) { out_ += (char)v; }
+  void U32(uint32_t v) { out_.append((const char *)&v, sizeof(v)); }
+  void U64(uint64_t v) { out_.append((const char *)&v, sizeof(v)); }
+  void Str(string_view s) {
+    U32(s.size());
+    out_ += s;
+  }
+  void Raw(string_view s) { out_ += s; }
+
+  void Write(Value v) {
+    switch (v.Type()) {
+    case ValueType::NIL:
+      U8((uint8_t)Tag::NIL);
+      break;
+    case ValueType::SPECIAL:
+      if (v == BOOL_T) {
+        U8((uint8_t)Tag::TRUE);
+      } else if (v == BOOL_F) {
+        U8((uint8_t)Tag::FALSE);
+      } else if (v == UNDEF) {
+        U8((uint8_t)Tag::UNDEF);
+      } else {
+        opaque(v);
+      }
+      break;
+    case ValueType::NUMBER:
+      U8((uint8_t)Tag::NUMBER);
+      U64(v.AsNumber());
+      break;
+    case ValueType::FLONUM:
+      U8((uint8_t)Tag::FLONUM);
+      U64(bit_cast<uint64_t>(v.AsFlonum()));
+      break;
+    case ValueType::BIGNUM: {
+      const Bignum &big = v.AsBignum();
+      U8((uint8_t)Tag::BIGNUM);
+      U8(big.IsNegative());
+      U32(big.Limbs().size());
+      for (uint32_t limb : big.Limbs()) {
+        U32(limb);
+      }
+      break;
+    }
+    case ValueType::ATOM:
+      U8((uint8_t)Tag::ATOM);
+      Str(vm_.AtomToString(v.AsAtom()));
+      break;
+    case ValueType::CHAR:
+      U8((uint8_t)Tag::CHAR);
+      U32(v.AsChar().Code());
+      break;
+    case ValueType::STRING:
+      U8((uint8_t)(v.AsStringValue().IsInterned() ? Tag::INTERNED_STRING
+                                                  : Tag::STRING));
+      Str(v.AsString());
+      break;
+    case ValueType::CELL: {
+      SourceLocation loc = vm_.Sources().Find(v);
+      if (loc.IsKnown() && loc.File == file_) {
+        U8((uint8_t)Tag::LOCATED_LIST);
+        U32(loc.Line);
+        U32(loc.Column);
+      } else {
+        U8((uint8_t)Tag::LIST);
+      }
+      uint32_t n = 0;
+      Value p = v;
+      for (; p.IsCell(); p = cdr(p)) {
+        n++;
+      }
+      U32(n);
+      for (p = v; p.IsCell(); p = cdr(p)) {
+        Write(car(p));
+      }
+      Write(p);
+      break;
+    }
+    default:
+      opaque(v);
+    }
+  }
+};
+
+class Reader {
+  VM &vm_;
+  string_view data_;
+  size_t pos_ = 0;
+  uint32_t file_;
+  bool build_; // Only check the format if false.
+
+  const char *take(size_t n) {
+    if (n > data_.size() - pos_) {
+      throw Corrupt();
+    }
+    const char *p = data_.data() + pos_;
+    pos_ += n;
+    return p;
+  }
+
+public:
+  Reader(VM &vm, string_view data, uint32_t file, bool build)
+      : vm_(vm), data_(data), file_(file), build_(build) {}
+
+  size_t Pos() const { return pos_; }
+  void Seek(size_t pos) { pos_ = pos; }
+  bool AtEnd() const { return pos_ == data_.size(); }
+
+  uint8_t U8() { return *take(1); }
+  uint32_t U32() {
+    uint32_t v;
+    memcpy(&v, take(sizeof(v)), sizeof(v));
+    return v;
+  }
+  uint64_t U64() {
+    uint64_t v;
+    memcpy(&v, take(sizeof(v)), sizeof(v));
+    return v;
+  }
+  string_view Str() {
+    uint32_t n = U32();
+    return string_view(take(n), n);
+  }
+
+  Value Read() {
+    Tag tag = (Tag)U8();
+    switch (tag) {
+    case Tag::NIL:
+      return NIL;
+    case Tag::TRUE:
+      return BOOL_T;
+    case Tag::FALSE:
+      return BOOL_F;
+    case Tag::UNDEF:
+      return UNDEF;
+    case Tag::NUMBER:
+      return (vint_t)U64();
+    case Tag::FLONUM:
+      return bit_cast<double>(U64());
+    case Tag::BIGNUM: {
+      bool neg = U8();
+      uint32_t n = U32();
+      if (n > (data_.size() - pos_) / sizeof(uint32_t)) {
+        throw Corrupt();
+      }
+      Bignum::limbs_t limbs(n);
+      for (auto &limb : limbs) {
+        limb = U32();
+      }
+      return build_ ? Value(new Bignum(neg, std::move(limbs))) : NIL;
+    }
+    case Tag::ATOM: {
+      string_view name = Str();
+      return build_ ? Value(vm_.Intern(string(name))) : NIL;
+    }
+    case Tag::CHAR:
+      return Char(U32());
+    case Tag::STRING: {
+      string_view s = Str();
+      return build_ ? Value(string(s)) : NIL;
+    }
+    case Tag::INTERNED_STRING: {
+      string_view s = Str();
+      return build_ ? vm_.InternString(s) : NIL;
+    }
+    case Tag::LIST:
+    case Tag::LOCATED_LIST: {
+      SourceLocation loc;
+      if (tag == Tag::LOCATED_LIST) {
+        loc.Line = U32();
+        loc.Column = U32();
+        loc.File = file_;
+      }
+      uint32_t n = U32();
+      if (n == 0) {
+        throw Corrupt();
+      }
+      Value head = NIL;
+      Cell *tail = nullptr;
+      for (uint32_t i = 0; i < n; i++) {
+        Value v = Read();
+        if (build_) {
+          Cell *cell = new Cell(v, NIL);
+          (tail ? tail->Cdr : head) = cell;
+          tail = cell;
+        }
+      }
+      Value rest = Read();
+      if (build_) {
+        tail->Cdr = rest;
+        if (loc.IsKnown()) {
+          vm_.Sources().Add(&head.AsCell(), loc);
+        }
+      }
+      return head;
+    }
+    case Tag::GLOBAL: {
+      string name(Str());
+      Value v;
+      if (build_ && !vm_.RootEnv().Get(vm_.Intern(name), v)) {
+        throw Stale();
+      }
+      return v;
+    }
+    default:
+      throw Corrupt();
+    }
+  }
+};
+
+// Write `v` for hashing, with the code if it's a procedure.
+static void write_for_hash(Writer &w, Value v) {
+  if (v.IsProcedure() && !v.AsProcedure().IsNative()) {
+    Procedure &proc = v.AsProcedure();
+    w.U8(proc.IsMacro() | proc.IsStable() << 1 | proc.IsPure() << 2);
+    w.Write(proc.Params());
+    w.Write(proc.Body());
+  } else {
+    w.Write(v);
+  }
+}
+
+// Hashes of the code of procedures, which doesn't change.
+using CodeHashes = unordered_map<Value, uint64_t, ValueHash>;
+
+// Hash of the value bound to `name`, or 0 if unbound.
+static uint64_t global_hash(VM &vm, Atom name, CodeHashes &codes) {
+  Value v;
+  if (!vm.RootEnv().Get(name, v)) {
+    return 0;
+  }
+  Writer w(vm, 0, false);
+  if (!v.IsProcedure() || v.AsProcedure().IsNative()) {
+    w.Write(v);
+    return fnv1a(w.Data());
+  }
+  auto [it, added] = codes.try_emplace(v, 0);
+  if (added) {
+    w.Write(v.AsProcedure().Params());
+    w.Write(v.AsProcedure().Body());
+    it->second = fnv1a(w.Data());
+  }
+  Procedure &proc = v.AsProcedure();
+  return it->second * 31 + (proc.IsMacro() | proc.IsStable() << 1 |
+                            proc.IsPure() << 2);
+}
+
+// Globals looked up while compiling a form, with hashes of their values
+// when first looked up. Names defined by the compile before it looks them up
+// are left out, since executing the cached form doesn't run the compile.
+class CompileReads : public EnvObserver {
+  VM &vm_;
+  unordered_set<atom_id_t> seen_;
+  CodeHashes codes_;
+
+public:
+  vector<pair<atom_id_t, uint64_t>> Reads;
+
+  explicit CompileReads(VM &vm) : vm_(vm) {}
+
+  void OnRead(Atom id) override {
+    // Inserted first, because global_hash looks the name up again.
+    if (seen_.insert(id.Id()).second) {
+      Reads.push_back({id.Id(), global_hash(vm_, id, codes_)});
+    }
+  }
+  void OnWrite(Atom id) override { seen_.insert(id.Id()); }
+
+  void Clear() {
+    seen_.clear();
+    Reads.clear();
+  }
+};
+
+// Hash of the globals which decide the compiled code: macros, procedures
+// which the optimizer may inline or fold, and the globals which they refer
+// to, directly or through other procedures, since those run at compile time
+// too.
+static uint64_t environment_hash(VM &vm) {
+  Env &env = vm.RootEnv();
+  uint64_t h = 0;
+  unordered_set<uint32_t> seen; // Ids of hashed names.
+  unordered_set<const Procedure *> walked;
+  vector<Value> pending; // Code to find global names in.
+
+  auto add = [&](Atom name, Value v) {
+    if (!seen.insert(name.Id()).second) {
+      return;
+    }
+    Writer w(vm, 0, false);
+    w.Str(vm.AtomToString(name));
+    write_for_hash(w, v);
+    if (v.IsProcedure() && !v.AsProcedure().IsNative()) {
+      pending.push_back(v);
+    }
+    // Sum, because the order of bindings isn't stable.
+    h += fnv1a(w.Data());
+  };
+
+  env.EachBinding([&](Atom name, Value v) {
+    if (v.IsProcedure()) {
+      Procedure &proc = v.AsProcedure();
+      if (!proc.IsNative() &&
+          (proc.IsMacro() || proc.IsStable() || proc.IsPure())) {
+        add(name, v);
+      }
+    }
+  });
+  while (!pending.empty()) {
+    Value code = pending.back();
+    pending.pop_back();
+    Value v;
+    if (code.IsCell()) {
+      pending.push_back(car(code));
+      pending.push_back(cdr(code));
+    } else if (code.IsAtom()) {
+      if (env.Get(code.AsAtom(), v)) {
+        add(code.AsAtom(), v);
+      }
+    } else if (code.IsProcedure() && !code.AsProcedure().IsNative() &&
+               walked.insert(&code.AsProcedure()).second) {
+      pending.push_back(code.AsProcedure().Body());
+    }
+  }
+  return h * 31 + vm.EnableOptimize;
+}
+
+string ModuleCache::cachePath(string_view path) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.lmc",
+           (unsigned long long)fnv1a(filesystem::absolute(path).string()));
+  return dir_ + "/" + name;
+}
+
+bool ModuleCache::tryCached(VM &vm, string_view path, string_view src,
+                            const string &data, uint64_t src_hash,
+                            uint64_t env_hash, Value &result) {
+  Reader r(vm, data, 0, false);
+  size_t forms_pos;
+  uint32_t forms;
+  try {
+    if (string_view(r.Str()) != MAGIC || r.U32() != FORMAT_VERSION ||
+        r.U64() != src_hash || r.U64() != env_hash) {
+      return false;
+    }
+    for (uint32_t i = 0, n = r.U32(); i < n; i++) {
+      string dep(r.Str());
+      uint64_t hash = r.U64();
+      string src;
+      if (!read_file(dep, src) || fnv1a(src) != hash) {
+        return false;
+      }
+    }
+    forms = r.U32();
+    forms_pos = r.Pos();
+    for (uint32_t i = 0; i < forms; i++) {
+      for (uint32_t j = 0, n = r.U32(); j < n; j++) {
+        r.Str();
+        r.U64();
+      }
+      r.Read();
+    }
+    if (!r.AtEnd()) {
+      return false;
+    }
+  } catch (Corrupt &) {
+    return false;
+  }
+
+  // Check and read each form just before executing it, because globals in
+  // it may be defined by the previous ones.
+  Reader reader(vm, data, vm.Sources().AddFile(path), true);
+  reader.Seek(forms_pos);
+  CodeHashes codes;
+  result = UNDEF;
+  for (uint32_t i = 0; i < forms; i++) {
+    Value code;
+    try {
+      for (uint32_t j = 0, n = reader.U32(); j < n; j++) {
+        Atom name = vm.Intern(string(reader.Str()));
+        if (reader.U64() != global_hash(vm, name, codes)) {
+          throw Stale();
+        }
+      }
+      code = reader.Read();
+    } catch (Stale &) {
+      // A global isn't as when the form was compiled. Drop the cache and
+      // compile the rest of the file.
+      error_code ec;
+      filesystem::remove(cachePath(path), ec);
+      misses_++;
+      result = run(vm, src, path, nullptr, i);
+      return true;
+    }
+    TraceSpan span("lisp", "toplevel");
+    if (span.IsActive()) {
+      span.Arg("form", utf8_truncate(code.ToString(), 80));
+    }
+    TraceSpan exec_span("lisp", "execute");
+    result = Eval().Execute(vm, code);
+  }
+  hits_++;
+  return true;
+}
+
+Value ModuleCache::Load(VM &vm, string_view path, string_view src) {
+  uint64_t src_hash = fnv1a(src);
+  for (auto *deps : loading_) {
+    deps->push_back({string(path), src_hash});
+  }
+  uint64_t env_hash = environment_hash(vm);
+  string cache_path = cachePath(path);
+
+  string data;
+  Value result;
+  if (read_file(cache_path, data) &&
+      tryCached(vm, path, src, data, src_hash, env_hash, result)) {
+    return result;
+  }
+
+  misses_++;
+  vector<Dep> deps;
+  // Forms are written as they are compiled, with the globals looked up by
+  // compiling them and the global names bound before they are executed,
+  // which are the ones bound when a hit reads them.
+  Writer forms(vm, vm.Sources().AddFile(path), true);
+  uint32_t count = 0;
+  bool writable = true;
+  CompileReads reads(vm);
+  auto on_compile = [&](Value code) {
+    if (!writable) {
+      reads.Clear();
+      return;
+    }
+    forms.U32(reads.Reads.size());
+    for (auto [id, hash] : reads.Reads) {
+      forms.Str(vm.AtomToString(Atom(id)));
+      forms.U64(hash);
+    }
+    reads.Clear();
+    forms.ClearNames();
+    try {
+      forms.Write(code);
+      count++;
+    } catch (Unwritable &) {
+      writable = false;
+    }
+  };
+  auto *outer_observer = observer_;
+  observer_ = &reads;
+  loading_.push_back(&deps);
+  try {
+    result = run(vm, src, path, on_compile);
+  } catch (...) {
+    loading_.pop_back();
+    observer_ = outer_observer;
+    throw;
+  }
+  loading_.pop_back();
+  observer_ = outer_observer;
+  if (!writable) {
+    return result;
+  }
+
+  try {
+    Writer w(vm, 0, false);
+    w.Str(MAGIC);
+    w.U32(FORMAT_VERSION);
+    w.U64(src_hash);
+    w.U64(env_hash);
+    w.U32(deps.size());
+    for (auto &dep : deps) {
+      w.Str(dep.Path);
+      w.U64(dep.Hash);
+    }
+    w.U32(count);
+    w.Raw(forms.Data());
+
+    // Write to a temporary file and rename, so that a concurrent load never
+    // sees a partial file.
+    filesystem::create_directories(dir_);
+    string tmp = cache_path + "." + to_string(getpid());
+    ofstream os(tmp, ios::binary);
+    os << w.Data();
+    os.close();
+    if (os) {
+      filesystem::rename(tmp, cache_path);
+    } else {
+      filesystem::remove(tmp);
+    }
+  } catch (filesystem::filesystem_error &) {
+  }
+  return result;
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+class EnvObserver;
+
+/**
+ * On-disk cache of compiled files for load.
+ *
+ * A file is cached as its top-level forms after macro expansion and
+ * optimization, in a binary file in Dir(). The cache is used when the
+ * source, the files loaded while loading it, and the macros and stable
+ * procedures defined when the load starts, with the globals they refer to,
+ * are unchanged. Then the forms are executed without parsing and compiling.
+ *
+ * Values in compiled code which can't be written, such as record types
+ * inlined by the optimizer, are written as the global names bound to them
+ * when the form was compiled. A file with other values isn't cached.
+ *
+ * Each form is cached with the globals looked up while compiling it, such as
+ * ones read by macros defined in the file. If one of them has changed, or a
+ * name isn't bound, when the cached form is about to be executed, the rest
+ * of the file is compiled.
+ *
+ * Disabled unless the directory is set, by the VM constructor or SetDir().
+ */
+class ModuleCache : noncopyable {
+public:
+  struct Dep {
+    std::string Path;
+    uint64_t Hash;
+  };
+
+private:
+  std::string dir_;
+  std::vector<std::vector<Dep> *> loading_; // Deps of files being compiled.
+  EnvObserver *observer_ = nullptr; // Of the file being compiled.
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+
+  std::string cachePath(std::string_view path) const;
+  bool tryCached(VM &vm, std::string_view path, std::string_view src,
+                 const std::string &data, uint64_t src_hash,
+                 uint64_t env_hash, Value &result);
+
+public:
+  const std::string &Dir() const { return dir_; }
+  void SetDir(std::string_view dir) { dir_ = dir; }
+  bool IsEnabled() const { return !dir_.empty(); }
+
+  /**
+   * Execute file `path` of `src`, from the cache if it's valid. Otherwise
+   * run it, and cache the compiled forms.
+   */
+  Value Load(VM &vm, std::string_view path, std::string_view src);
+
+  /**
+   * Observer of the root environment for Compiler::Compile, while a file to
+   * cache is compiled, or null.
+   */
+  EnvObserver *CompileObserver() const { return observer_; }
+
+  size_t Hits() const { return hits_; }
+  size_t Misses() const { return misses_; }
+};
+
+} // namespace cxxlisp
@@ -0,0 +1,621 @@
+#include <charconv>
+#include <cmath>
+#include <sstream>
+
+#include "number.hpp"
+#include "util.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+using limbs_t = Bignum::limbs_t;
+
+// Operands shorter than this are multiplied by the schoolbook method.
+static const size_t KARATSUBA_THRESHOLD = 32;
+
+namespace {
+
+/**
+ * Signed magnitude for computation.
+ */
+struct BigInt {
+  bool neg = false;
+  limbs_t mag;
+};
+
+} // namespace
+
+//===================================================================
+// Magnitude
+//===================================================================
+
+static void trim(limbs_t &a) {
+  while (!a.empty() && a.back() == 0) {
+    a.pop_back();
+  }
+}
+
+static int cmp_mag(const limbs_t &a, const limbs_t &b) {
+  if (a.size() != b.size()) {
+    return a.size() < b.size() ? -1 : 1;
+  }
+  for (size_t i = a.size(); i-- > 0;) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+static limbs_t add_mag(const limbs_t &a, const limbs_t &b) {
+  const limbs_t &x = a.size() >= b.size() ? a : b;
+  const limbs_t &y = a.size() >= b.size() ? b : a;
+  limbs_t r(x.size() + 1);
+  uint64_t carry = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    uint64_t t = (uint64_t)x[i] + (i < y.size() ? y[i] : 0) + carry;
+    r[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+  r[x.size()] = (uint32_t)carry;
+  trim(r);
+  return r;
+}
+
+// Requires a >= b.
+static limbs_t sub_mag(const limbs_t &a, const limbs_t &b) {
+  limbs_t r(a.size());
+  int64_t borrow = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    int64_t t = (int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow;
+    borrow = t < 0 ? 1 : 0;
+    r[i] = (uint32_t)(t + (borrow << 32));
+  }
+  trim(r);
+  return r;
+}
+
+// r += x << (shift * 32)
+static void add_shifted(limbs_t &r, const limbs_t &x, size_t shift) {
+  uint64_t carry = 0;
+  size_t i = 0;
+  for (; i < x.size(); i++) {
+    uint64_t t = (uint64_t)r[i + shift] + x[i] + carry;
+    r[i + shift] = (uint32_t)t;
+    carry = t >> 32;
+  }
+  for (; carry; i++) {
+    uint64_t t = (uint64_t)r[i + shift] + carry;
+    r[i + shift] = (uint32_t)t;
+    carry = t >> 32;
+  }
+}
+
+static limbs_t mul_school(const limbs_t &a, const limbs_t &b) {
+  limbs_t r(a.size() + b.size());
+  for (size_t i = 0; i < a.size(); i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < b.size(); j++) {
+      uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+      r[i + j] = (uint32_t)t;
+      carry = t >> 32;
+    }
+    r[i + b.size()] = (uint32_t)carry;
+  }
+  trim(r);
+  return r;
+}
+
+static limbs_t mul_mag(const limbs_t &a, const limbs_t &b) {
+  if (a.empty() || b.empty()) {
+    return {};
+  } else if (a.size() < KARATSUBA_THRESHOLD || b.size() < KARATSUBA_THRESHOLD) {
+    return mul_school(a, b);
+  }
+
+  // Karatsuba: a = a1 * B^h + a0, b = b1 * B^h + b0
+  size_t h = max(a.size(), b.size()) / 2;
+  auto split = [h](const limbs_t &x, limbs_t &lo, limbs_t &hi) {
+    size_t n = min(h, x.size());
+    lo.assign(x.begin(), x.begin() + n);
+    hi.assign(x.begin() + n, x.end());
+    trim(lo);
+  };
+  limbs_t a0, a1, b0, b1;
+  split(a, a0, a1);
+  split(b, b0, b1);
+
+  limbs_t z0 = mul_mag(a0, b0);
+  limbs_t z2 = mul_mag(a1, b1);
+  limbs_t z1 =
+      sub_mag(sub_mag(mul_mag(add_mag(a0, a1), add_mag(b0, b1)), z0), z2);
+
+  limbs_t r(a.size() + b.size() + 1);
+  add_shifted(r, z0, 0);
+  add_shifted(r, z1, h);
+  add_shifted(r, z2, h * 2);
+  trim(r);
+  return r;
+}
+
+// a = a * m + c
+static void mul_small_add(limbs_t &a, uint32_t m, uint32_t c) {
+  uint64_t carry = c;
+  for (auto &limb : a) {
+    uint64_t t = (uint64_t)limb * m + carry;
+    limb = (uint32_t)t;
+    carry = t >> 32;
+  }
+  if (carry) {
+    a.push_back((uint32_t)carry);
+  }
+}
+
+// a = a / d, returns a % d.
+static uint32_t divmod_small(limbs_t &a, uint32_t d) {
+  uint64_t rem = 0;
+  for (size_t i = a.size(); i-- > 0;) {
+    uint64_t cur = (rem << 32) | a[i];
+    a[i] = (uint32_t)(cur / d);
+    rem = cur % d;
+  }
+  trim(a);
+  return (uint32_t)rem;
+}
+
+/**
+ * Knuth's algorithm D. See Hacker's Delight, divmnu.
+ */
+static void divmod_mag(const limbs_t &u, const limbs_t &v, limbs_t &q,
+                       limbs_t &r) {
+  if (cmp_mag(u, v) < 0) {
+    q.clear();
+    r = u;
+    return;
+  }
+
+  if (v.size() == 1) {
+    q = u;
+    uint32_t rem = divmod_small(q, v[0]);
+    r.clear();
+    if (rem) {
+      r.push_back(rem);
+    }
+    return;
+  }
+
+  // Normalize so that the top bit of the divisor is set.
+  size_t n = v.size();
+  size_t m = u.size() - n;
+  int s = __builtin_clz(v.back());
+  limbs_t vn(n), un(u.size() + 1);
+  for (size_t i = n - 1; i > 0; i--) {
+    vn[i] = (v[i] << s) | (s ? (uint32_t)((uint64_t)v[i - 1] >> (32 - s)) : 0);
+  }
+  vn[0] = v[0] << s;
+  un[u.size()] = s ? (uint32_t)((uint64_t)u.back() >> (32 - s)) : 0;
+  for (size_t i = u.size() - 1; i > 0; i--) {
+    un[i] = (u[i] << s) | (s ? (uint32_t)((uint64_t)u[i - 1] >> (32 - s)) : 0);
+  }
+  un[0] = u[0] << s;
+
+  const uint64_t B = 1ULL << 32;
+  q.assign(m + 1, 0);
+  for (size_t j = m + 1; j-- > 0;) {
+    uint64_t num = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+    uint64_t qhat = num / vn[n - 1];
+    uint64_t rhat = num % vn[n - 1];
+    while (qhat >= B ||
+           qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+      qhat--;
+      rhat += vn[n - 1];
+      if (rhat >= B) {
+        break;
+      }
+    }
+
+    // Multiply and subtract.
+    int64_t k = 0;
+    int64_t t;
+    for (size_t i = 0; i < n; i++) {
+      uint64_t p = qhat * vn[i];
+      t = (int64_t)un[i + j] - k - (int64_t)(p & 0xFFFFFFFF);
+      un[i + j] = (uint32_t)t;
+      k = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)un[j + n] - k;
+    un[j + n] = (uint32_t)t;
+
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      // Add back.
+      q[j]--;
+      uint64_t c = 0;
+      for (size_t i = 0; i < n; i++) {
+        uint64_t t2 = (uint64_t)un[i + j] + vn[i] + c;
+        un[i + j] = (uint32_t)t2;
+        c = t2 >> 32;
+      }
+      un[j + n] += (uint32_t)c;
+    }
+  }
+  trim(q);
+
+  // Unnormalize the remainder.
+  r.assign(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    r[i] = (un[i] >> s) |
+           (s ? (uint32_t)((uint64_t)un[i + 1] << (32 - s)) : 0);
+  }
+  trim(r);
+}
+
+//===================================================================
+// BigInt
+//===================================================================
+
+void check_number(Value v) {
+  if (!v.IsNumeric()) {
+    stringstream s;
+    s << "Value is not number, but " << v.Type() << ".";
+    throw LispException(s.str());
+  }
+}
+
+static BigInt to_big(Value v) {
+  if (v.IsBignum()) {
+    auto &b = v.AsBignum();
+    return BigInt{b.IsNegative(), b.Limbs()};
+  }
+
+  check_number(v);
+  vint_t n = v.AsNumber();
+  uint64_t m = n < 0 ? 0 - (uint64_t)n : (uint64_t)n;
+  BigInt r{n < 0, {}};
+  if (m) {
+    r.mag.push_back((uint32_t)m);
+  }
+  if (m >> 32) {
+    r.mag.push_back((uint32_t)(m >> 32));
+  }
+  return r;
+}
+
+// Returns fixnum if it fits in vint_t.
+static Value make_integer(BigInt &&b) {
+  trim(b.mag);
+  if (b.mag.size() <= 2) {
+    uint64_t m = 0;
+    for (size_t i = b.mag.size(); i-- > 0;) {
+      m = (m << 32) | b.mag[i];
+    }
+    if (!b.neg && m <= (uint64_t)INT64_MAX) {
+      return (vint_t)m;
+    } else if (b.neg && m <= (uint64_t)INT64_MAX + 1) {
+      return (vint_t)(0 - m);
+    }
+  }
+  return new Bignum(b.neg, std::move(b.mag));
+}
+
+static BigInt add_big(const BigInt &a, const BigInt &b) {
+  if (a.neg == b.neg) {
+    return BigInt{a.neg, add_mag(a.mag, b.mag)};
+  }
+  int c = cmp_mag(a.mag, b.mag);
+  if (c == 0) {
+    return BigInt{};
+  } else if (c > 0) {
+    return BigInt{a.neg, sub_mag(a.mag, b.mag)};
+  } else {
+    return BigInt{b.neg, sub_mag(b.mag, a.mag)};
+  }
+}
+
+static void divmod_big(const BigInt &a, const BigInt &b, BigInt &q,
+                       BigInt &r) {
+  if (b.mag.empty()) {
+    throw LispException("Divide by zero.");
+  }
+  divmod_mag(a.mag, b.mag, q.mag, r.mag);
+  q.neg = a.neg != b.neg;
+  r.neg = a.neg;
+}
+
+static double mag_to_double(const limbs_t &mag) {
+  double r = 0;
+  for (size_t i = mag.size(); i-- > 0;) {
+    r = r * 4294967296.0 + mag[i];
+  }
+  return r;
+}
+
+//===================================================================
+// Bignum
+//===================================================================
+
+string Bignum::ToString() const {
+  limbs_t a = limbs_;
+  vector<uint32_t> chunks;
+  while (!a.empty()) {
+    chunks.push_back(divmod_small(a, 1000000000));
+  }
+
+  string s = neg_ ? "-" : "";
+  s += to_string(chunks.back());
+  for (size_t i = chunks.size() - 1; i-- > 0;) {
+    string chunk = to_string(chunks[i]);
+    s.append(9 - chunk.size(), '0');
+    s += chunk;
+  }
+  return s;
+}
+
+double Bignum::ToDouble() const {
+  double r = mag_to_double(limbs_);
+  return neg_ ? -r : r;
+}
+
+//===================================================================
+// Arithmetic
+//===================================================================
+
+double to_double(Value v) {
+  switch (v.Type()) {
+  case ValueType::FLONUM:
+    return v.AsFlonum();
+  case ValueType::BIGNUM:
+    return v.AsBignum().ToDouble();
+  default:
+    check_number(v);
+    return (double)v.AsNumber();
+  }
+}
+
+Value num_add(Value a, Value b) {
+  if (a.IsFlonum() || b.IsFlonum()) {
+    return to_double(a) + to_double(b);
+  }
+  vint_t r;
+  if (a.IsNumber() && b.IsNumber() &&
+      !__builtin_add_overflow(a.AsNumber(), b.AsNumber(), &r)) {
+    return r;
+  }
+  return make_integer(add_big(to_big(a), to_big(b)));
+}
+
+Value num_sub(Value a, Value b) {
+  if (a.IsFlonum() || b.IsFlonum()) {
+    return to_double(a) - to_double(b);
+  }
+  vint_t r;
+  if (a.IsNumber() && b.IsNumber() &&
+      !__builtin_sub_overflow(a.AsNumber(), b.AsNumber(), &r)) {
+    return r;
+  }
+  BigInt nb = to_big(b);
+  nb.neg = !nb.neg;
+  return make_integer(add_big(to_big(a), nb));
+}
+
+Value num_mul(Value a, Value b) {
+  if (a.IsFlonum() || b.IsFlonum()) {
+    return to_double(a) * to_double(b);
+  }
+  vint_t r;
+  if (a.IsNumber() && b.IsNumber() &&
+      !__builtin_mul_overflow(a.AsNumber(), b.AsNumber(), &r)) {
+    return r;
+  }
+  BigInt x = to_big(a);
+  BigInt y = to_big(b);
+  return make_integer(BigInt{x.neg != y.neg, mul_mag(x.mag, y.mag)});
+}
+
+Value num_quotient(Value a, Value b) {
+  if (a.IsFlonum() || b.IsFlonum()) {
+    return trunc(to_double(a) / to_double(b));
+  }
+  BigInt q, r;
+  divmod_big(to_big(a), to_big(b), q, r);
+  return make_integer(std::move(q));
+}
+
+Value num_remainder(Value a, Value b) {
+  if (a.IsFlonum() || b.IsFlonum()) {
+    return fmod(to_double(a), to_double(b));
+  }
+  BigInt q, r;
+  divmod_big(to_big(a), to_big(b), q, r);
+  return make_integer(std::move(r));
+}
+
+Value num_modulo(Value a, Value b) {
+  if (a.IsFlonum() || b.IsFlonum()) {
+    double x = to_double(a);
+    double y = to_double(b);
+    return x - y * floor(x / y);
+  }
+  BigInt y = to_big(b);
+  BigInt q, r;
+  divmod_big(to_big(a), y, q, r);
+  if (!r.mag.empty() && r.neg != y.neg) {
+    r = add_big(r, y);
+  }
+  return make_integer(std::move(r));
+}
+
+Value num_expt(Value base, Value exp) {
+  if (base.IsExactInteger() && exp.IsNumber() && exp.AsNumber() >= 0) {
+    Value r = 1;
+    Value b = base;
+    for (vint_t e = exp.AsNumber(); e > 0; e >>= 1) {
+      if (e & 1) {
+        r = num_mul(r, b);
+      }
+      if (e > 1) {
+        b = num_mul(b, b);
+      }
+    }
+    return r;
+  }
+  return pow(to_double(base), to_double(exp));
+}
+
+int num_compare_exact(Value a, Value b) {
+  if (a.IsNumber() && b.IsNumber()) {
+    vint_t x = a.AsNumber();
+    vint_t y = b.AsNumber();
+    return x < y ? -1 : (x > y ? 1 : 0);
+  }
+
+  BigInt x = to_big(a);
+  BigInt y = to_big(b);
+  if (x.neg != y.neg) {
+    return x.neg ? -1 : 1;
+  }
+  int c = cmp_mag(x.mag, y.mag);
+  return x.neg ? -c : c;
+}
+
+int num_sign(Value v) {
+  switch (v.Type()) {
+  case ValueType::FLONUM: {
+    double d = v.AsFlonum();
+    return d < 0 ? -1 : (d > 0 ? 1 : 0);
+  }
+  case ValueType::BIGNUM:
+    return v.AsBignum().IsNegative() ? -1 : 1;
+  default: {
+    check_number(v);
+    vint_t n = v.AsNumber();
+    return n < 0 ? -1 : (n > 0 ? 1 : 0);
+  }
+  }
+}
+
+Value to_exact(Value v) {
+  if (!v.IsFlonum()) {
+    check_number(v);
+    return v;
+  }
+
+  double d = trunc(v.AsFlonum());
+  if (!isfinite(d)) {
+    throw LispException("Can't convert " + number_to_string(v) +
+                        " to exact integer.");
+  } else if (fabs(d) < 9223372036854775808.0) {
+    return (vint_t)d;
+  }
+
+  // d = mantissa * 2^exp, where mantissa has 53 bits.
+  int exp;
+  double f = frexp(fabs(d), &exp);
+  uint64_t mantissa = (uint64_t)ldexp(f, 53);
+  exp -= 53;
+  BigInt r{d < 0, {(uint32_t)mantissa, (uint32_t)(mantissa >> 32)}};
+  for (; exp >= 32; exp -= 32) {
+    r.mag.insert(r.mag.begin(), 0);
+  }
+  mul_small_add(r.mag, 1u << exp, 0);
+  return make_integer(std::move(r));
+}
+
+//===================================================================
+// Conversion
+//===================================================================
+
+bool parse_number(string_view str, Value &result) {
+  size_t i = 0;
+  size_t n = str.size();
+  auto is_digit = [&](size_t i) {
+    return i < n && '0' <= str[i] && str[i] <= '9';
+  };
+
+  bool neg = false;
+  if (i < n && (str[i] == '+' || str[i] == '-')) {
+    neg = str[i] == '-';
+    i++;
+  }
+
+  size_t start = i;
+  while (is_digit(i)) {
+    i++;
+  }
+  if (i == start) {
+    return false;
+  }
+  size_t end = i;
+
+  bool is_float = false;
+  if (i < n && str[i] == '.') {
+    size_t frac = ++i;
+    while (is_digit(i)) {
+      i++;
+    }
+    if (i == frac) {
+      return false;
+    }
+    is_float = true;
+  }
+  if (i < n && (str[i] == 'e' || str[i] == 'E')) {
+    i++;
+    if (i < n && (str[i] == '+' || str[i] == '-')) {
+      i++;
+    }
+    size_t e = i;
+    while (is_digit(i)) {
+      i++;
+    }
+    if (i == e) {
+      return false;
+    }
+    is_float = true;
+  }
+  if (i != n) {
+    return false;
+  }
+
+  if (is_float) {
+    result = strtod(string(str).c_str(), nullptr);
+    return true;
+  }
+
+  // Integer. Read 9 digits at once.
+  BigInt r{neg, {}};
+  size_t len = (end - start) % 9 == 0 ? 9 : (end - start) % 9;
+  for (size_t p = start; p < end; p += len, len = 9) {
+    uint32_t chunk = 0;
+    from_chars(str.data() + p, str.data() + p + len, chunk);
+    mul_small_add(r.mag, p == start ? 1 : 1000000000, chunk);
+  }
+  result = make_integer(std::move(r));
+  return true;
+}
+
+string number_to_string(Value v) {
+  switch (v.Type()) {
+  case ValueType::FLONUM: {
+    double d = v.AsFlonum();
+    if (isnan(d)) {
+      return "+nan.0";
+    } else if (isinf(d)) {
+      return d > 0 ? "+inf.0" : "-inf.0";
+    }
+    char buf[32];
+    auto [end, ec] = to_chars(buf, buf + sizeof(buf), d);
+    string s(buf, end);
+    if (s.find_first_of(".e") == string::npos) {
+      s += ".0";
+    }
+    return s;
+  }
+  case ValueType::BIGNUM:
+    return v.AsBignum().ToString();
+  default:
+    return to_string(v.AsNumber());
+  }
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Arbitrary precision integer.
+ *
+ * Magnitude is stored in 32-bit limbs, little endian, without leading zero
+ * limbs. Bignum is created only for integers which don't fit in vint_t, and
+ * the arithmetic functions below return NUMBER whenever the result fits.
+ */
+class Bignum final : public gc_cleanup, noncopyable {
+public:
+  using limbs_t = std::vector<uint32_t>;
+
+private:
+  bool neg_;
+  limbs_t limbs_;
+
+public:
+  Bignum(bool neg, limbs_t &&limbs) : neg_(neg), limbs_(std::move(limbs)) {}
+
+  bool IsNegative() const { return neg_; }
+  const limbs_t &Limbs() const { return limbs_; }
+
+  std::string ToString() const;
+  double ToDouble() const;
+
+  friend bool operator==(const Bignum &a, const Bignum &b) {
+    return a.neg_ == b.neg_ && a.limbs_ == b.limbs_;
+  }
+};
+
+// Generic arithmetic on NUMBER, BIGNUM and FLONUM.
+//
+// They are the slow paths. Callers should handle two fixnums themselves.
+Value num_add(Value a, Value b);
+Value num_sub(Value a, Value b);
+Value num_mul(Value a, Value b);
+Value num_quotient(Value a, Value b);
+Value num_remainder(Value a, Value b);
+Value num_modulo(Value a, Value b);
+Value num_expt(Value base, Value exp);
+
+/**
+ * Compare two exact integers. Returns negative, zero or positive.
+ */
+int num_compare_exact(Value a, Value b);
+
+/**
+ * Sign of number. Returns -1, 0 or 1 (0 for NaN).
+ */
+int num_sign(Value v);
+
+/**
+ * Throw LispException if `v` is not a number.
+ */
+void check_number(Value v);
+
+double to_double(Value v);
+
+/**
+ * Convert to exact integer. Flonum is truncated.
+ */
+Value to_exact(Value v);
+
+bool parse_number(std::string_view str, Value &result);
+std::string number_to_string(Value v);
+
+} // namespace cxxlisp
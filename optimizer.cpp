@@ -0,0 +1,504 @@
+#include <algorithm>
+
+#include "util.hpp"
+#include "vm.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+//===================================================================
+// Utilities
+//===================================================================
+
+// Constant is a self-evaluating value or a quoted form.
+static bool is_const(Value code) {
+  if (code.IsCell()) {
+    return car(code) == SYM_QUOTE;
+  } else {
+    return !code.IsAtom();
+  }
+}
+
+static Value const_value(Value code) {
+  if (code.IsCell()) {
+    return car(cdr(code));
+  } else {
+    return code;
+  }
+}
+
+static Value to_code(Value v) {
+  if (v.IsCell() || v.IsAtom()) {
+    return list(SYM_QUOTE, v);
+  } else {
+    return v;
+  }
+}
+
+static bool is_special_form(Value v) {
+  return v.IsAtom() && v.AsAtom().Id() < (atom_id_t)SpecialForm::MAX;
+}
+
+static Value reverse_list(Value li) {
+  Value head = NIL;
+  for (auto v : li) {
+    head = cons(v, head);
+  }
+  return head;
+}
+
+static Value make_begin(Value body) {
+  if (body.IsNil()) {
+    return UNDEF;
+  } else if (cdr(body).IsNil()) {
+    return car(body);
+  } else {
+    return cons(SYM_BEGIN, body);
+  }
+}
+
+static int list_length(Value li) {
+  int n = 0;
+  for (; li.IsCell(); li = cdr(li)) {
+    n++;
+  }
+  return n;
+}
+
+static int code_size(Value code) {
+  if (code.IsCell()) {
+    return 1 + code_size(car(code)) + code_size(cdr(code));
+  } else {
+    return 0;
+  }
+}
+
+// Quoted forms are not searched.
+static int count_atom(Value code, Value atom) {
+  if (code.IsCell()) {
+    if (car(code) == SYM_QUOTE) {
+      return 0;
+    }
+    return count_atom(car(code), atom) + count_atom(cdr(code), atom);
+  } else {
+    return code == atom ? 1 : 0;
+  }
+}
+
+static bool contains_atom(Value code, Value atom) {
+  return count_atom(code, atom) > 0;
+}
+
+static Value substitute(Value code, Value params, Value args) {
+  if (code.IsAtom()) {
+    for (Value p = params, a = args; !p.IsNil(); p = cdr(p), a = cdr(a)) {
+      if (car(p) == code) {
+        return car(a);
+      }
+    }
+    return code;
+  } else if (code.IsCell() && car(code) != SYM_QUOTE) {
+    return cons(substitute(car(code), params, args),
+                substitute(cdr(code), params, args));
+  } else {
+    return code;
+  }
+}
+
+// Copy the location of `site` to forms in `code` which have none.
+static void locate(SourceMap &sources, Value site, Value code) {
+  if (!code.IsCell() || car(code) == SYM_QUOTE) {
+    return;
+  }
+  sources.Inherit(site, code);
+  for (Value p = code; p.IsCell(); p = cdr(p)) {
+    locate(sources, site, car(p));
+  }
+}
+
+//===================================================================
+// Optimizer
+//===================================================================
+
+bool Optimizer::isLocal(Atom atom) const {
+  return find(locals_.begin(), locals_.end(), atom.Id()) != locals_.end();
+}
+
+void Optimizer::pushParams(Value params) {
+  Value p = params;
+  for (; p.IsCell(); p = cdr(p)) {
+    locals_.push_back(car(p).AsAtom().Id());
+  }
+  if (p.IsAtom()) {
+    locals_.push_back(p.AsAtom().Id());
+  }
+}
+
+bool Optimizer::findProcedure(Ctx &ctx, Value head,
+                              Procedure *&result) const {
+  if (!head.IsAtom() || is_special_form(head) || isLocal(head.AsAtom())) {
+    return false;
+  }
+
+  Value f;
+  if (ctx.vm->RootEnv().Get(head.AsAtom(), f) && f.IsProcedure() &&
+      f.AsProcedure().IsStable()) {
+    result = &f.AsProcedure();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+bool Optimizer::fold(Ctx &ctx, Value proc, Value args, Value &result) {
+  Value vals = NIL;
+  for (auto a : args) {
+    if (!is_const(a)) {
+      return false;
+    }
+    vals = cons(const_value(a), vals);
+  }
+  vals = reverse_list(vals);
+
+  try {
+    result = to_code(Eval().Call(ctx, proc, vals));
+    return true;
+  } catch (std::exception &) {
+    // Leave the error to runtime.
+    return false;
+  }
+}
+
+/**
+ * Check that `code` can be evaluated without calling lisp procedures, so
+ * substituting the parameters can't be observed from dynamic scope.
+ */
+bool Optimizer::isTransparent(Ctx &ctx, Value code, Value params) {
+  if (!code.IsCell()) {
+    return true;
+  }
+
+  Value head = car(code);
+  Value rest = cdr(code);
+  if (head == SYM_QUOTE) {
+    return true;
+  }
+
+  if (head.IsAtom()) {
+    switch ((SpecialForm)head.AsAtom().Id()) {
+    case SpecialForm::BEGIN:
+    case SpecialForm::IF:
+    case SpecialForm::RECORD_REF:
+      for (auto v : rest) {
+        if (!isTransparent(ctx, v, params)) {
+          return false;
+        }
+      }
+      return true;
+    case SpecialForm::COND:
+      for (auto clause : rest) {
+        for (auto v : clause) {
+          if (!isTransparent(ctx, v, params)) {
+            return false;
+          }
+        }
+      }
+      return true;
+    default:
+      break;
+    }
+  }
+
+  Procedure *proc;
+  if (contains_atom(params, head) || !findProcedure(ctx, head, proc) ||
+      !proc->IsPure()) {
+    return false;
+  }
+  for (auto v : rest) {
+    if (!isTransparent(ctx, v, params)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Replace a call of (lambda params body...) with args.
+ *
+ * The result is a `let` form. When the body calls only pure procedures and
+ * each argument is a constant, a symbol or a pure expression used once, the
+ * parameters are substituted and the body is optimized again.
+ */
+bool Optimizer::inlineBody(Ctx &ctx, Value params, Value body, Value args,
+                           Value &result) {
+  if (body.IsNil()) {
+    return false;
+  }
+
+  // Params must be a proper list of symbols matched with args.
+  for (Value p = params, a = args;; p = cdr(p), a = cdr(a)) {
+    if (p.IsNil()) {
+      if (!a.IsNil()) {
+        return false;
+      }
+      break;
+    } else if (!p.IsCell() || !a.IsCell() || !car(p).IsAtom() ||
+               is_special_form(car(p))) {
+      return false;
+    }
+  }
+
+  if (params.IsNil()) {
+    result = make_begin(body);
+    return true;
+  }
+
+  bool substitutable = inlineDepth_ < INLINE_MAX_DEPTH;
+  for (Value p = params, a = args; substitutable && !p.IsNil();
+       p = cdr(p), a = cdr(a)) {
+    Value arg = car(a);
+    int used = count_atom(body, car(p));
+    if (is_const(arg)) {
+      continue;
+    } else if (arg.IsAtom()) {
+      // Symbol must be evaluated at least once to keep unbound errors.
+      substitutable = !is_special_form(arg) && used > 0;
+    } else {
+      substitutable = used == 1 && isTransparent(ctx, arg, NIL);
+    }
+  }
+  for (Value b = body; substitutable && !b.IsNil(); b = cdr(b)) {
+    substitutable = isTransparent(ctx, car(b), params);
+  }
+
+  if (substitutable) {
+    inlineDepth_++;
+    result = make_begin(doBody(ctx, substitute(body, params, args)));
+    inlineDepth_--;
+  } else {
+    Value decls = NIL;
+    for (Value p = params, a = args; !p.IsNil(); p = cdr(p), a = cdr(a)) {
+      decls = cons(list(car(p), car(a)), decls);
+    }
+    result = cons(SYM_LET, reverse_list(decls), body);
+  }
+  return true;
+}
+
+// Optimize forms in body. Constants except the last one are removed.
+Value Optimizer::doBody(Ctx &ctx, Value body) {
+  if (body.IsNil()) {
+    return NIL;
+  }
+
+  Value v = doValue(ctx, car(body));
+  Value rest = doBody(ctx, cdr(body));
+  if (!rest.IsNil() && is_const(v)) {
+    return rest;
+  } else {
+    return cons(v, rest);
+  }
+}
+
+Value Optimizer::doBegin(Ctx &ctx, Value code) {
+  if (cdr(code).IsNil()) {
+    return code;
+  } else {
+    return make_begin(doBody(ctx, cdr(code)));
+  }
+}
+
+Value Optimizer::doIf(Ctx &ctx, Value code) {
+  auto [head, cond, then, else_] =
+      uncons_rest<Value, Value, Value, Value>(code);
+  cond = doValue(ctx, cond);
+  if (is_const(cond)) {
+    if (const_value(cond).Truthy()) {
+      return doValue(ctx, then);
+    } else {
+      return make_begin(doBody(ctx, else_));
+    }
+  }
+  return cons(head, cond, doValue(ctx, then), doBody(ctx, else_));
+}
+
+Value Optimizer::doLambda(Ctx &ctx, Value code) {
+  auto [head, params, body] = uncons_rest<Value, Value, Value>(code);
+  size_t n = locals_.size();
+  pushParams(params);
+  body = doBody(ctx, body);
+  locals_.resize(n);
+  return cons(head, params, body);
+}
+
+Value Optimizer::doLet(Ctx &ctx, Value code) {
+  auto [head, decls, body] = uncons_rest<Value, Value, Value>(code);
+  if (decls.IsNil() && !body.IsNil()) {
+    return make_begin(doBody(ctx, body));
+  }
+
+  Value new_decls = NIL;
+  size_t n = locals_.size();
+  for (auto decl : decls) {
+    auto [name, expr] = uncons<Value, Value>(decl);
+    new_decls = cons(list(name, doValue(ctx, expr)), new_decls);
+  }
+  for (auto decl : decls) {
+    locals_.push_back(car(decl).AsAtom().Id());
+  }
+  body = doBody(ctx, body);
+  locals_.resize(n);
+
+  return cons(head, reverse_list(new_decls), body);
+}
+
+Value Optimizer::doCondClause(Ctx &ctx, Value rest) {
+  if (rest.IsNil()) {
+    return NIL;
+  }
+
+  Value clause = car(rest);
+  Value test = car(clause);
+  if (test == SYM_ELSE) {
+    return list(cons(test, doBody(ctx, cdr(clause))));
+  }
+
+  test = doValue(ctx, test);
+  if (is_const(test)) {
+    if (const_value(test).Falsy()) {
+      // Unreachable clause.
+      return doCondClause(ctx, cdr(rest));
+    } else if (!cdr(clause).IsNil()) {
+      // Following clauses are unreachable.
+      return list(cons(SYM_ELSE, doBody(ctx, cdr(clause))));
+    }
+  }
+  return cons(cons(test, doBody(ctx, cdr(clause))),
+              doCondClause(ctx, cdr(rest)));
+}
+
+Value Optimizer::doCond(Ctx &ctx, Value code) {
+  Value clauses = doCondClause(ctx, cdr(code));
+  if (clauses.IsNil()) {
+    return UNDEF;
+  }
+
+  Value first = car(clauses);
+  if (car(first) == SYM_ELSE && !cdr(first).IsNil()) {
+    return make_begin(cdr(first));
+  } else {
+    return cons(car(code), clauses);
+  }
+}
+
+Value Optimizer::doCall(Ctx &ctx, Value code) {
+  Value head = car(code);
+  Value args = doList(ctx, cdr(code));
+  Value result;
+
+  // Beta reduction.
+  if (head.IsCell() && car(head) == SYM_LAMBDA) {
+    head = doLambda(ctx, head);
+    if (inlineBody(ctx, car(cdr(head)), cdr(cdr(head)), args, result)) {
+      return result;
+    } else {
+      return cons(head, args);
+    }
+  }
+
+  Procedure *proc;
+  if (findProcedure(ctx, head, proc)) {
+    if (proc->IsPure() && fold(ctx, proc, args, result)) {
+      return result;
+    }
+
+    // Replace with intrinsic form. Calls with wrong number of arguments are
+    // left to report the error at runtime.
+    if (!proc->Intrinsic().IsNil() && list_length(args) == proc->Arity()) {
+      result = args;
+      for (auto v : reverse_list(proc->Intrinsic())) {
+        result = cons(v, result);
+      }
+      return result;
+    }
+
+    // Inline small non-recursive procedure. The body is copied, and the
+    // inlined forms are located at the call, not in the procedure.
+    if (!proc->IsNative() && !proc->IsMacro() &&
+        code_size(proc->Body()) <= INLINE_MAX_SIZE &&
+        !contains_atom(proc->Body(), head) &&
+        (proc->Name().empty() ||
+         !contains_atom(proc->Body(), ctx.vm->Intern(proc->Name()))) &&
+        inlineBody(ctx, proc->Params(), substitute(proc->Body(), NIL, NIL),
+                   args, result)) {
+      locate(ctx.vm->Sources(), code, result);
+      return result;
+    }
+  }
+
+  return cons(doValue(ctx, head), args);
+}
+
+Value Optimizer::doValue(Ctx &ctx, Value code) {
+  switch (code.Type()) {
+  case ValueType::CELL: {
+    Value result = doForm(ctx, code);
+    ctx.vm->Sources().Inherit(code, result);
+    return result;
+  }
+  default:
+    return code;
+  }
+}
+
+Value Optimizer::doList(Ctx &ctx, Value code) {
+  if (code.IsCell()) {
+    return cons(doValue(ctx, car(code)), doList(ctx, cdr(code)));
+  } else {
+    return code;
+  }
+}
+
+Value Optimizer::doForm(Ctx &ctx, Value code) {
+  Value head = car(code);
+  if (head.IsAtom()) {
+    switch ((SpecialForm)head.AsAtom().Id()) {
+    case SpecialForm::BEGIN:
+      return doBegin(ctx, code);
+    case SpecialForm::DEFINE:
+    case SpecialForm::SET_EX: {
+      auto [name, value] = uncons<Value, Value>(cdr(code));
+      return list(head, name, doValue(ctx, value));
+    }
+    case SpecialForm::IF:
+      return doIf(ctx, code);
+    case SpecialForm::LAMBDA:
+      return doLambda(ctx, code);
+    case SpecialForm::QUOTE:
+      return code;
+    case SpecialForm::LOOP:
+      return cons(head, doBody(ctx, cdr(code)));
+    case SpecialForm::BLOCK:
+      return cons(head, car(cdr(code)), doBody(ctx, cdr(cdr(code))));
+    case SpecialForm::RETURN_FROM:
+      return cons(head, car(cdr(code)), doList(ctx, cdr(cdr(code))));
+    case SpecialForm::RECORD_REF:
+    case SpecialForm::RECORD_SET: {
+      auto [type, idx, args] = uncons_rest<Value, Value, Value>(cdr(code));
+      return cons(head, type, idx, doList(ctx, args));
+    }
+    case SpecialForm::LET:
+      return doLet(ctx, code);
+    case SpecialForm::COND:
+      return doCond(ctx, code);
+    default:
+      break;
+    }
+  }
+  return doCall(ctx, code);
+}
+
+Value Optimizer::Optimize(Ctx &ctx, Value code) { return doValue(ctx, code); }
+
+} // namespace cxxlisp
@@ -1,6 +1,9 @@
+#include <charconv>
 #include <regex>
 
+#include "number.hpp"
 #include "parser.hpp"
+#include "utf8.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
@@ -8,9 +11,10 @@ namespace cxxlisp {
 
 using namespace std;
 
-const static regex RE_NUMBER(R"(^[-+]?[0-9]+)");
+const static regex RE_NUMBER(R"(^[-+]?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?)");
 const static regex RE_IDENT(R"(^[a-zA-Z_\-+*/<>=!?][a-zA-Z_\-+*/<>=!?.1-9]*)");
 const static regex RE_STRING(R"(^"([^"]*)\")");
+const static regex RE_CHAR(R"(^#\\(.[a-zA-Z0-9]*))");
 const static regex RE_SYMBOL(R"(^[()\[\]{}.#\\'`,@;])");
 const static regex RE_SPACES(R"(^[\s]+)");
 const static regex RE_LINE_COMMENT(R"(^;[^\n]*\n)");
@@ -65,18 +69,59 @@ string escape_str(string_view str) {
   return buf;
 }
 
+static const pair<const char *, char32_t> CHAR_NAMES[] = {
+    {"space", ' '},   {"newline", '\n'}, {"tab", '\t'},
+    {"return", '\r'}, {"null", '\0'},    {"delete", 0x7f},
+};
+
+string escape_char(Char c) {
+  for (auto [name, code] : CHAR_NAMES) {
+    if (c.Code() == code) {
+      return name;
+    }
+  }
+  if (c.Code() < 0x20 || c.Code() >= 0x7f) {
+    stringstream s;
+    s << 'x' << hex << (uint32_t)c.Code();
+    return s.str();
+  }
+  return string(1, (char)c.Code());
+}
+
+Char unescape_char(string_view name) {
+  if (utf8_next(name, 0) == name.size()) {
+    return utf8_decode(name, 0);
+  }
+  for (auto [n, code] : CHAR_NAMES) {
+    if (name == n) {
+      return Char(code);
+    }
+  }
+  if (name[0] == 'x') {
+    const char *end = name.data() + name.size();
+    uint32_t code;
+    auto [p, ec] = from_chars(name.data() + 1, end, code, 16);
+    if (ec == errc() && p == end && code <= 0x10ffff) {
+      return Char(code);
+    }
+  }
+  throw LispException("Invalid character #\\" + string(name) + ".");
+}
+
 Token::operator string() const {
   switch (Type) {
   case TokenType::EOS:
     return std::string("#EOS");
   case TokenType::NUMBER:
-    return std::to_string(Number);
+    return Str;
   case TokenType::SYMBOL:
     return std::string{Char};
   case TokenType::IDENT:
     return Str;
   case TokenType::STRING:
     return '"' + escape_str(Str) + '"';
+  case TokenType::CHAR:
+    return "#\\" + Str;
   default:
     throw BUG();
   }
@@ -86,6 +131,32 @@ Token::operator string() const {
 // Parser
 //==============================================================================
 
+Parser::Parser(VM &vm, string_view s, string_view file) : vm_(vm), s_(s) {
+  if (!file.empty()) {
+    file_ = vm.Sources().AddFile(file);
+  }
+}
+
+SourceLocation Parser::location(int pos) {
+  if (pos < scanned_) {
+    scanned_ = line_ = lineStart_ = 0;
+  }
+  for (; scanned_ < pos; scanned_++) {
+    if (s_[scanned_] == '\n') {
+      line_++;
+      lineStart_ = scanned_ + 1;
+    }
+  }
+  return {file_, (uint32_t)line_ + 1, (uint32_t)(pos - lineStart_) + 1};
+}
+
+Value Parser::located(Value v, SourceLocation loc) {
+  if (file_ && v.IsCell()) {
+    vm_.Sources().Add(&v.AsCell(), loc);
+  }
+  return v;
+}
+
 Token Parser::next() {
 
   if (unreaded_) {
@@ -106,27 +177,25 @@ Token Parser::next() {
 
   // Skip spaces.
   for (;;) {
-
-    // Skip and advance position and line.
-    auto skip = [](smatch &mr, int &pos, int &line) {
-      auto s = mr.str();
-      line += count_if(s.begin(), s.end(), [](char c) { return c == '\n'; });
-    };
-
-    if (search(mr, RE_SPACES)) {
-      skip(mr, pos_, line_);
-    } else if (search(mr, RE_LINE_COMMENT)) {
-      skip(mr, pos_, line_);
+    if (search(mr, RE_SPACES) || search(mr, RE_LINE_COMMENT)) {
+      continue;
     } else if (search(mr, RE_SEXP_COMMENT)) {
-      skip(mr, pos_, line_);
       Read(); // Discard SEXP.
     } else {
       break;
     }
   }
+  tokenStart_ = pos_;
 
-  if (search(mr, RE_NUMBER)) {
-    cur_ = Token((int)stoi(mr[0]));
+  if (search(mr, RE_CHAR)) {
+    string name = mr[1];
+    // Take the rest of a multibyte character.
+    while (pos_ < (int)s_.size() && utf8_is_cont(s_[pos_])) {
+      name.push_back(s_[pos_++]);
+    }
+    cur_ = Token(TokenType::CHAR, name);
+  } else if (search(mr, RE_NUMBER)) {
+    cur_ = Token(TokenType::NUMBER, string(mr[0]));
   } else if (search(mr, RE_IDENT)) {
     cur_ = Token(string(mr[0]));
   } else if (search(mr, RE_STRING)) {
@@ -156,26 +225,35 @@ Value Parser::Read() {
   case TokenType::EOS:
     throw EndOfSourceException();
 
-  case TokenType::NUMBER:
-    return Value(t.Number);
+  case TokenType::NUMBER: {
+    Value v;
+    if (!parse_number(t.Str, v)) {
+      throw LispException("Invalid number '" + t.Str + "'.");
+    }
+    return v;
+  }
 
   case TokenType::SYMBOL: {
+    SourceLocation loc;
+    if (file_) {
+      loc = location(tokenStart_);
+    }
     switch (t.Char) {
     case '(':
-      return parseList();
+      return located(parseList(), loc);
     case '#':
       return parseReadMacro();
     case '\'':
-      return list(SYM_QUOTE, Read());
+      return located(list(SYM_QUOTE, Read()), loc);
     case '`':
-      return list(SYM_QUASIQUOTE, Read());
+      return located(list(SYM_QUASIQUOTE, Read()), loc);
     case ',': {
       t = next();
       if (t.Type == TokenType::SYMBOL && t.Char == '@') {
-        return list(SYM_UNQUOTE_SPLICING, Read());
+        return located(list(SYM_UNQUOTE_SPLICING, Read()), loc);
       } else {
         unread();
-        return list(SYM_UNQUOTE, Read());
+        return located(list(SYM_UNQUOTE, Read()), loc);
       }
     }
     case ')':
@@ -188,7 +266,9 @@ Value Parser::Read() {
   case TokenType::IDENT:
     return Value(vm_.Intern(t.Str));
   case TokenType::STRING:
-    return Value(t.Str);
+    return vm_.InternString(t.Str);
+  case TokenType::CHAR:
+    return unescape_char(t.Str);
   default:
     throw BUG();
   }
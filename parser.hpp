@@ -4,6 +4,7 @@
 #include <optional>
 #include <string>
 
+#include "source_map.hpp"
 #include "value.hpp"
 
 namespace cxxlisp {
@@ -16,17 +17,16 @@ enum class TokenType {
   SYMBOL,
   IDENT,
   STRING,
+  CHAR,
 };
 
 class Token {
 public:
   TokenType Type;
-  int Number = 0;
   char Char = '\0';
   std::string Str;
 
   Token() : Type(TokenType::EOS), Char('\0') {}
-  Token(int v) : Type(TokenType::NUMBER), Number(v) {}
   Token(char v) : Type(TokenType::SYMBOL), Char(v) {}
   Token(const std::string_view v) : Type(TokenType::IDENT), Str(v) {}
   Token(TokenType tt, const std::string_view v) : Type(tt), Str(v) {}
@@ -46,8 +46,16 @@ class Parser {
   std::string s_;
   Token cur_;
   bool unreaded_ = false;
-  int line_ = 0;
   int pos_ = 0;
+  int tokenStart_ = 0;
+
+  // Source file in VM::Sources(), or 0 if locations aren't recorded.
+  uint32_t file_ = 0;
+
+  // Lines are counted up to `scanned_` on demand.
+  int scanned_ = 0;
+  int line_ = 0;
+  int lineStart_ = 0;
 
   Token next();
   void unread();
@@ -55,15 +63,27 @@ class Parser {
   Value parseList();
   Value parseReadMacro();
 
+  SourceLocation location(int pos);
+  Value located(Value v, SourceLocation loc);
+
 public:
-  int Line() const { return line_; }
+  // Line from 1, of the current position.
+  int Line() { return location(pos_).Line; }
   int Pos() const { return pos_; }
 
-  Parser(VM &vm, std::string_view s) : vm_(vm), s_(s) {}
+  /**
+   * Parser of `s`. If `file` is given, source locations of lists are
+   * recorded in VM::Sources().
+   */
+  Parser(VM &vm, std::string_view s, std::string_view file = "");
   Value Read();
 };
 
 std::string escape_str(const std::string_view str);
 std::string unescape_str(const std::string_view str);
 
+// Name of character in #\ syntax, such as "a", "space" or "x7f".
+std::string escape_char(Char c);
+Char unescape_char(const std::string_view name);
+
 } // namespace cxxlisp
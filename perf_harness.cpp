@@ -0,0 +1,404 @@
+/**
+ * perfcxxlisp: performance regression harness.
+ *
+ * Runs each benchmark script under cxxlisp, and records wall time,
+ * instructions (by perf_event, where available), peak RSS and GC count.
+ * Results are written as JSON, and compared against a baseline in the same
+ * format. Exits with 1 if any metric exceeds its baseline by more than the
+ * tolerance.
+ *
+ * Usage:
+ *   perfcxxlisp [--cxxlisp PATH] [--repeat N] [--output FILE]
+ *               [--baseline FILE [--update-baseline]]
+ *               [--tolerance METRIC=PERCENT]... SCRIPT...
+ *
+ * Baselines depend on the machine, so none is checked in. Write one with
+ * --update-baseline, which writes the results to the baseline file instead
+ * of comparing. A missing baseline is an error, so that a regression check
+ * never passes without comparing.
+ *
+ * Metrics are measured `repeat` times and the minimum is taken, to reduce
+ * noise. A metric which is null in either result isn't compared.
+ */
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+using Metrics = map<string, optional<double>>;
+using Results = map<string, Metrics>;
+
+static const char *METRICS[] = {"wall_ms", "instructions", "peak_rss_kb",
+                                "gc_count"};
+
+// Default tolerances in percent.
+static map<string, double> tolerances = {
+    {"wall_ms", 10},
+    {"instructions", 2},
+    {"peak_rss_kb", 10},
+    {"gc_count", 20},
+};
+
+[[noreturn]] static void fail(const string &msg) {
+  cerr << "perfcxxlisp: " << msg << endl;
+  exit(2);
+}
+
+//===================================================================
+// JSON
+//
+// Only what the result file needs: nested objects, numbers and null.
+//===================================================================
+
+class JsonReader {
+  string s_;
+  size_t pos_ = 0;
+
+  void skipSpaces() {
+    while (pos_ < s_.size() && isspace((unsigned char)s_[pos_])) {
+      pos_++;
+    }
+  }
+
+  bool consume(char c) {
+    skipSpaces();
+    if (pos_ < s_.size() && s_[pos_] == c) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(char c) {
+    if (!consume(c)) {
+      fail("Invalid JSON: expect '"s + c + "' at " + to_string(pos_) + ".");
+    }
+  }
+
+public:
+  explicit JsonReader(string s) : s_(std::move(s)) {}
+
+  string ReadString() {
+    expect('"');
+    size_t end = s_.find('"', pos_);
+    if (end == string::npos) {
+      fail("Invalid JSON: unterminated string.");
+    }
+    string r = s_.substr(pos_, end - pos_);
+    pos_ = end + 1;
+    return r;
+  }
+
+  optional<double> ReadNumber() {
+    skipSpaces();
+    if (s_.compare(pos_, 4, "null") == 0) {
+      pos_ += 4;
+      return nullopt;
+    }
+    size_t len;
+    double v = stod(s_.substr(pos_), &len);
+    pos_ += len;
+    return v;
+  }
+
+  // Calls `f(key)` for each member, which must read the value.
+  template <typename F> void ReadObject(F f) {
+    expect('{');
+    if (consume('}')) {
+      return;
+    }
+    do {
+      string key = ReadString();
+      expect(':');
+      f(key);
+    } while (consume(','));
+    expect('}');
+  }
+};
+
+static string read_file(const string &path) {
+  ifstream fs(path);
+  if (!fs.is_open()) {
+    fail("Can't open '" + path + "'.");
+  }
+  return string(istreambuf_iterator<char>(fs), istreambuf_iterator<char>());
+}
+
+static Metrics read_metrics(JsonReader &r) {
+  Metrics m;
+  r.ReadObject([&](const string &key) { m[key] = r.ReadNumber(); });
+  return m;
+}
+
+static Results read_results(const string &path) {
+  JsonReader r(read_file(path));
+  Results results;
+  r.ReadObject([&](const string &key) {
+    if (key != "benchmarks") {
+      fail("Unknown key '" + key + "' in " + path + ".");
+    }
+    r.ReadObject([&](const string &name) { results[name] = read_metrics(r); });
+  });
+  return results;
+}
+
+static string to_json(optional<double> v) {
+  if (!v) {
+    return "null";
+  }
+  stringstream s;
+  s << setprecision(15) << *v;
+  return s.str();
+}
+
+static void write_results(ostream &os, const Results &results) {
+  os << "{\n  \"benchmarks\": {";
+  const char *sep = "\n";
+  for (auto &[name, metrics] : results) {
+    os << sep << "    \"" << name << "\": {";
+    const char *msep = "";
+    for (auto &[key, v] : metrics) {
+      os << msep << "\"" << key << "\": " << to_json(v);
+      msep = ", ";
+    }
+    os << "}";
+    sep = ",\n";
+  }
+  os << "\n  }\n}\n";
+}
+
+//===================================================================
+// Measurement
+//===================================================================
+
+#ifdef __linux__
+// Counter of user-space instructions of `pid` and its children, which
+// starts when `pid` calls exec. Returns -1 if unavailable.
+static int open_instruction_counter(pid_t pid) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+#else
+static int open_instruction_counter(pid_t pid) { return -1; }
+#endif
+
+// Runs `cxxlisp script` once.
+static Metrics run_once(const string &cxxlisp, const string &script) {
+  string stats_path = "/tmp/perfcxxlisp." + to_string(getpid()) + ".json";
+
+  // The child waits until the counter is attached.
+  int go[2];
+  if (pipe(go) != 0) {
+    fail("pipe() failed.");
+  }
+
+  auto start = chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fail("fork() failed.");
+  } else if (pid == 0) {
+    close(go[1]);
+    char c;
+    (void)!read(go[0], &c, 1);
+    close(go[0]);
+    execl(cxxlisp.c_str(), cxxlisp.c_str(), "--stats", stats_path.c_str(),
+          script.c_str(), (char *)nullptr);
+    _exit(127);
+  }
+
+  close(go[0]);
+  int counter = open_instruction_counter(pid);
+  close(go[1]);
+
+  int status;
+  rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    fail("wait4() failed.");
+  }
+  auto end = chrono::steady_clock::now();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fail("'" + script + "' failed.");
+  }
+
+  Metrics m;
+  m["wall_ms"] = chrono::duration<double, milli>(end - start).count();
+  m["peak_rss_kb"] = (double)usage.ru_maxrss;
+  m["instructions"] = nullopt;
+  if (counter >= 0) {
+    uint64_t n;
+    if (read(counter, &n, sizeof(n)) == sizeof(n)) {
+      m["instructions"] = (double)n;
+    }
+    close(counter);
+  }
+
+  JsonReader r(read_file(stats_path));
+  unlink(stats_path.c_str());
+  r.ReadObject([&](const string &key) {
+    auto v = r.ReadNumber();
+    if (key == "gc_count") {
+      m[key] = v;
+    }
+  });
+  return m;
+}
+
+static Metrics measure(const string &cxxlisp, const string &script,
+                       int repeat) {
+  Metrics best;
+  for (int i = 0; i < repeat; i++) {
+    Metrics m = run_once(cxxlisp, script);
+    for (auto &[key, v] : m) {
+      if (i == 0 || !best[key] || (v && *v < *best[key])) {
+        best[key] = v;
+      }
+    }
+  }
+  return best;
+}
+
+// "bench/fib.lisp" => "fib"
+static string benchmark_name(const string &script) {
+  size_t slash = script.rfind('/');
+  string name = script.substr(slash == string::npos ? 0 : slash + 1);
+  size_t dot = name.rfind('.');
+  return dot == string::npos ? name : name.substr(0, dot);
+}
+
+//===================================================================
+// Comparison
+//===================================================================
+
+// Prints the comparison and returns the number of regressions.
+static int compare(const Results &base, const Results &current) {
+  int regressions = 0;
+  cout << left << setw(12) << "benchmark" << setw(14) << "metric" << right
+       << setw(16) << "baseline" << setw(16) << "current" << setw(10)
+       << "change" << endl;
+  for (auto &[name, metrics] : current) {
+    auto it = base.find(name);
+    if (it == base.end()) {
+      cout << left << setw(12) << name << "(not in baseline)" << endl;
+      continue;
+    }
+    for (const char *key : METRICS) {
+      auto b = it->second.find(key);
+      auto c = metrics.find(key);
+      if (b == it->second.end() || !b->second || c == metrics.end() ||
+          !c->second) {
+        continue;
+      }
+      double base_v = *b->second;
+      double cur_v = *c->second;
+      double change = base_v == 0 ? (cur_v == 0 ? 0 : INFINITY)
+                                  : (cur_v - base_v) / base_v * 100;
+      bool regressed = change > tolerances[key];
+      regressions += regressed;
+      cout << left << setw(12) << name << setw(14) << key << right << fixed
+           << setprecision(1) << setw(16) << base_v << setw(16) << cur_v
+           << setw(9) << showpos << change << "%" << noshowpos
+           << (regressed ? "  REGRESSION" : "") << endl;
+    }
+  }
+  return regressions;
+}
+
+int main(int argc, char **argv) {
+  string cxxlisp = "./cxxlisp";
+  string output;
+  string baseline;
+  bool update_baseline = false;
+  int repeat = 3;
+  vector<string> scripts;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool has_next = i + 1 < argc;
+    if (arg == "--cxxlisp" && has_next) {
+      cxxlisp = argv[++i];
+    } else if (arg == "--output" && has_next) {
+      output = argv[++i];
+    } else if (arg == "--baseline" && has_next) {
+      baseline = argv[++i];
+    } else if (arg == "--update-baseline") {
+      update_baseline = true;
+    } else if (arg == "--repeat" && has_next) {
+      repeat = max(1, atoi(argv[++i]));
+    } else if (arg == "--tolerance" && has_next) {
+      string t = argv[++i];
+      size_t eq = t.find('=');
+      if (eq == string::npos || !tolerances.count(t.substr(0, eq))) {
+        fail("Invalid tolerance '" + t + "'.");
+      }
+      tolerances[t.substr(0, eq)] = stod(t.substr(eq + 1));
+    } else if (arg.starts_with("--")) {
+      fail("Unknown option '" + arg + "'.");
+    } else {
+      scripts.push_back(arg);
+    }
+  }
+
+  if (update_baseline && baseline.empty()) {
+    fail("--update-baseline needs --baseline.");
+  }
+  if (!baseline.empty() && !update_baseline &&
+      !ifstream(baseline).is_open()) {
+    fail("Baseline '" + baseline +
+         "' doesn't exist. Write it with --update-baseline.");
+  }
+
+  Results results;
+  for (auto &script : scripts) {
+    results[benchmark_name(script)] = measure(cxxlisp, script, repeat);
+  }
+
+  if (!output.empty()) {
+    ofstream os(output);
+    write_results(os, results);
+  } else if (baseline.empty()) {
+    write_results(cout, results);
+  }
+
+  if (update_baseline) {
+    ofstream os(baseline);
+    if (!os.is_open()) {
+      fail("Can't open '" + baseline + "'.");
+    }
+    write_results(os, results);
+    cout << "Wrote baseline " << baseline << "." << endl;
+  } else if (!baseline.empty()) {
+    int regressions = compare(read_results(baseline), results);
+    if (regressions > 0) {
+      cout << regressions << " regression(s)." << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
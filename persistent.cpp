@@ -0,0 +1,487 @@
+#include <atomic>
+#include <bit>
+
+#include "persistent.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+// Bits of hash or index consumed by one level of trie.
+static const int BITS = 5;
+static const size_t WIDTH = 1 << BITS;
+static const uint64_t MASK = WIDTH - 1;
+
+// HAMT nodes at this shift or deeper are collision nodes.
+static const int MAX_SHIFT = 64;
+
+edit_t new_edit() {
+  static atomic<edit_t> last{0};
+  return ++last;
+}
+
+//===================================================================
+// PMap
+//===================================================================
+
+static uint64_t key_hash(Value key) { return hash_equal(key); }
+
+static uint32_t bit_at(uint64_t h, int shift) {
+  return 1u << ((h >> shift) & MASK);
+}
+
+static int index_of(uint32_t map, uint32_t bit) {
+  return popcount(map & (bit - 1));
+}
+
+static HamtNode *editable(HamtNode *node, edit_t edit) {
+  if (edit != 0 && node->Edit == edit) {
+    return node;
+  }
+  auto r = new HamtNode(edit);
+  r->DataMap = node->DataMap;
+  r->NodeMap = node->NodeMap;
+  r->Entries = node->Entries;
+  r->Nodes = node->Nodes;
+  return r;
+}
+
+static const Value *find(const HamtNode *node, Value key, uint64_t h) {
+  for (int shift = 0;; shift += BITS) {
+    if (shift >= MAX_SHIFT) {
+      for (size_t i = 0; i < node->Entries.size(); i += 2) {
+        if (is_equal(node->Entries[i], key)) {
+          return &node->Entries[i + 1];
+        }
+      }
+      return nullptr;
+    }
+
+    uint32_t bit = bit_at(h, shift);
+    if (node->DataMap & bit) {
+      int i = index_of(node->DataMap, bit) * 2;
+      return is_equal(node->Entries[i], key) ? &node->Entries[i + 1] : nullptr;
+    } else if (node->NodeMap & bit) {
+      node = node->Nodes[index_of(node->NodeMap, bit)];
+    } else {
+      return nullptr;
+    }
+  }
+}
+
+// Make a node which has two entries of different keys.
+static HamtNode *merge_two(edit_t edit, Value k1, Value v1, uint64_t h1,
+                           Value k2, Value v2, uint64_t h2, int shift) {
+  auto node = new HamtNode(edit);
+  if (shift >= MAX_SHIFT) {
+    node->Entries = {k1, v1, k2, v2};
+    return node;
+  }
+
+  uint32_t b1 = bit_at(h1, shift);
+  uint32_t b2 = bit_at(h2, shift);
+  if (b1 == b2) {
+    node->NodeMap = b1;
+    node->Nodes.push_back(
+        merge_two(edit, k1, v1, h1, k2, v2, h2, shift + BITS));
+  } else {
+    node->DataMap = b1 | b2;
+    if (b1 < b2) {
+      node->Entries = {k1, v1, k2, v2};
+    } else {
+      node->Entries = {k2, v2, k1, v1};
+    }
+  }
+  return node;
+}
+
+// Returns the updated node. `added` is set if the key is new.
+static HamtNode *assoc(HamtNode *node, edit_t edit, Value key, Value val,
+                       uint64_t h, int shift, bool &added) {
+  if (shift >= MAX_SHIFT) {
+    HamtNode *r = editable(node, edit);
+    for (size_t i = 0; i < r->Entries.size(); i += 2) {
+      if (is_equal(r->Entries[i], key)) {
+        r->Entries[i + 1] = val;
+        return r;
+      }
+    }
+    r->Entries.push_back(key);
+    r->Entries.push_back(val);
+    added = true;
+    return r;
+  }
+
+  uint32_t bit = bit_at(h, shift);
+  if (node->DataMap & bit) {
+    int i = index_of(node->DataMap, bit) * 2;
+    Value k = node->Entries[i];
+    HamtNode *r = editable(node, edit);
+    if (is_equal(k, key)) {
+      r->Entries[i + 1] = val;
+      return r;
+    }
+
+    // Move the existing entry and the new one into a subnode.
+    HamtNode *sub = merge_two(edit, k, node->Entries[i + 1], key_hash(k), key,
+                              val, h, shift + BITS);
+    r->Entries.erase(r->Entries.begin() + i, r->Entries.begin() + i + 2);
+    r->DataMap ^= bit;
+    r->NodeMap |= bit;
+    r->Nodes.insert(r->Nodes.begin() + index_of(r->NodeMap, bit), sub);
+    added = true;
+    return r;
+  } else if (node->NodeMap & bit) {
+    int i = index_of(node->NodeMap, bit);
+    HamtNode *child =
+        assoc(node->Nodes[i], edit, key, val, h, shift + BITS, added);
+    if (child == node->Nodes[i]) {
+      // Updated in place by transient.
+      return node;
+    }
+    HamtNode *r = editable(node, edit);
+    r->Nodes[i] = child;
+    return r;
+  } else {
+    HamtNode *r = editable(node, edit);
+    int i = index_of(node->DataMap, bit) * 2;
+    r->Entries.insert(r->Entries.begin() + i, {key, val});
+    r->DataMap |= bit;
+    added = true;
+    return r;
+  }
+}
+
+// Returns the updated node. `removed` is set if the key is found.
+static HamtNode *dissoc(HamtNode *node, edit_t edit, Value key, uint64_t h,
+                        int shift, bool &removed) {
+  if (shift >= MAX_SHIFT) {
+    for (size_t i = 0; i < node->Entries.size(); i += 2) {
+      if (is_equal(node->Entries[i], key)) {
+        HamtNode *r = editable(node, edit);
+        r->Entries.erase(r->Entries.begin() + i, r->Entries.begin() + i + 2);
+        removed = true;
+        return r;
+      }
+    }
+    return node;
+  }
+
+  uint32_t bit = bit_at(h, shift);
+  if (node->DataMap & bit) {
+    int i = index_of(node->DataMap, bit) * 2;
+    if (!is_equal(node->Entries[i], key)) {
+      return node;
+    }
+    HamtNode *r = editable(node, edit);
+    r->Entries.erase(r->Entries.begin() + i, r->Entries.begin() + i + 2);
+    r->DataMap ^= bit;
+    removed = true;
+    return r;
+  } else if (node->NodeMap & bit) {
+    int i = index_of(node->NodeMap, bit);
+    HamtNode *child =
+        dissoc(node->Nodes[i], edit, key, h, shift + BITS, removed);
+    if (!removed) {
+      return node;
+    }
+
+    HamtNode *r = editable(node, edit);
+    if (child->Nodes.empty() && child->Entries.size() <= 2) {
+      // Pull up the last entry of the subnode to keep the trie compact.
+      r->Nodes.erase(r->Nodes.begin() + i);
+      r->NodeMap ^= bit;
+      if (!child->Entries.empty()) {
+        r->DataMap |= bit;
+        int j = index_of(r->DataMap, bit) * 2;
+        r->Entries.insert(r->Entries.begin() + j, child->Entries.begin(),
+                          child->Entries.end());
+      }
+    } else {
+      r->Nodes[i] = child;
+    }
+    return r;
+  } else {
+    return node;
+  }
+}
+
+PMap *PMap::Empty() { return new PMap(new HamtNode(0), 0, 0); }
+
+const Value *PMap::Find(Value key) const {
+  return find(root_, key, key_hash(key));
+}
+
+PMap *PMap::Set(Value key, Value val) const {
+  if (IsTransient()) {
+    throw LispException("Use pmap-set! to update transient.");
+  }
+  bool added = false;
+  HamtNode *root = assoc(root_, 0, key, val, key_hash(key), 0, added);
+  return new PMap(root, size_ + added, 0);
+}
+
+PMap *PMap::Delete(Value key) const {
+  if (IsTransient()) {
+    throw LispException("Use pmap-delete! to update transient.");
+  }
+  bool removed = false;
+  HamtNode *root = dissoc(root_, 0, key, key_hash(key), 0, removed);
+  if (!removed) {
+    return const_cast<PMap *>(this);
+  }
+  return new PMap(root, size_ - 1, 0);
+}
+
+void PMap::SetInPlace(Value key, Value val) {
+  if (!IsTransient()) {
+    throw LispException("Map is not transient.");
+  }
+  bool added = false;
+  root_ = assoc(root_, edit_, key, val, key_hash(key), 0, added);
+  size_ += added;
+}
+
+void PMap::DeleteInPlace(Value key) {
+  if (!IsTransient()) {
+    throw LispException("Map is not transient.");
+  }
+  bool removed = false;
+  root_ = dissoc(root_, edit_, key, key_hash(key), 0, removed);
+  size_ -= removed;
+}
+
+PMap *PMap::Transient() const { return new PMap(root_, size_, new_edit()); }
+
+//===================================================================
+// PVector
+//===================================================================
+
+class PVecNode final : public gc_cleanup, noncopyable {
+public:
+  edit_t Edit;
+  std::vector<Value> Values;       // Leaf.
+  std::vector<PVecNode *> Children; // Branch.
+
+  explicit PVecNode(edit_t edit) : Edit(edit) {}
+};
+
+static PVecNode *editable(PVecNode *node, edit_t edit) {
+  if (edit != 0 && node->Edit == edit) {
+    return node;
+  }
+  auto r = new PVecNode(edit);
+  r->Values = node->Values;
+  r->Children = node->Children;
+  return r;
+}
+
+static PVecNode *new_path(edit_t edit, int level, PVecNode *node) {
+  if (level == 0) {
+    return node;
+  }
+  auto r = new PVecNode(edit);
+  r->Children.push_back(new_path(edit, level - BITS, node));
+  return r;
+}
+
+PVector *PVector::Empty() {
+  return new PVector(0, BITS, new PVecNode(0), {}, 0);
+}
+
+size_t PVector::tailOffset() const {
+  return size_ < WIDTH ? 0 : ((size_ - 1) >> BITS) << BITS;
+}
+
+void PVector::checkIndex(vint_t idx) const {
+  if (idx < 0 || (size_t)idx >= size_) {
+    throw LispException("Index " + to_string(idx) + " out of range, size " +
+                        to_string(size_) + ".");
+  }
+}
+
+const vector<Value> &PVector::leafFor(size_t idx) const {
+  if (idx >= tailOffset()) {
+    return tail_;
+  }
+  PVecNode *node = root_;
+  for (int level = shift_; level > 0; level -= BITS) {
+    node = node->Children[(idx >> level) & MASK];
+  }
+  return node->Values;
+}
+
+Value PVector::Ref(vint_t idx) const {
+  checkIndex(idx);
+  return leafFor(idx)[idx & MASK];
+}
+
+PVecNode *PVector::pushTail(edit_t edit, int level, PVecNode *parent,
+                            PVecNode *tail) const {
+  PVecNode *r = editable(parent, edit);
+  size_t sub = ((size_ - 1) >> level) & MASK;
+  PVecNode *child;
+  if (level == BITS) {
+    child = tail;
+  } else if (sub < parent->Children.size()) {
+    child = pushTail(edit, level - BITS, parent->Children[sub], tail);
+  } else {
+    child = new_path(edit, level - BITS, tail);
+  }
+
+  if (sub < r->Children.size()) {
+    r->Children[sub] = child;
+  } else {
+    r->Children.push_back(child);
+  }
+  return r;
+}
+
+void PVector::push(edit_t edit, Value val) {
+  if (size_ - tailOffset() < WIDTH) {
+    tail_.push_back(val);
+    size_++;
+    return;
+  }
+
+  // Tail is full, so move it into the trie.
+  auto tail = new PVecNode(edit);
+  tail->Values = std::move(tail_);
+  if ((size_ >> BITS) > ((size_t)1 << shift_)) {
+    // Root overflow.
+    auto root = new PVecNode(edit);
+    root->Children = {root_, new_path(edit, shift_, tail)};
+    root_ = root;
+    shift_ += BITS;
+  } else {
+    root_ = pushTail(edit, shift_, root_, tail);
+  }
+  tail_ = {val};
+  size_++;
+}
+
+PVecNode *PVector::popTail(edit_t edit, int level, PVecNode *node) const {
+  size_t sub = ((size_ - 2) >> level) & MASK;
+  if (level > BITS) {
+    PVecNode *child = popTail(edit, level - BITS, node->Children[sub]);
+    if (!child && sub == 0) {
+      return nullptr;
+    }
+    PVecNode *r = editable(node, edit);
+    if (child) {
+      r->Children[sub] = child;
+    } else {
+      r->Children.pop_back();
+    }
+    return r;
+  } else if (sub == 0) {
+    return nullptr;
+  } else {
+    PVecNode *r = editable(node, edit);
+    r->Children.pop_back();
+    return r;
+  }
+}
+
+void PVector::pop(edit_t edit) {
+  if (size_ == 0) {
+    throw LispException("Can't pop empty vector.");
+  } else if (size_ - tailOffset() > 1) {
+    tail_.pop_back();
+    size_--;
+    return;
+  } else if (size_ == 1) {
+    tail_.clear();
+    size_ = 0;
+    return;
+  }
+
+  // Tail becomes empty, so take the last leaf from the trie.
+  vector<Value> tail = leafFor(size_ - 2);
+  PVecNode *root = popTail(edit, shift_, root_);
+  if (!root) {
+    root = new PVecNode(edit);
+  }
+  if (shift_ > BITS && root->Children.size() == 1) {
+    root = root->Children[0];
+    shift_ -= BITS;
+  }
+  root_ = root;
+  tail_ = std::move(tail);
+  size_--;
+}
+
+PVecNode *PVector::doSet(edit_t edit, int level, PVecNode *node, size_t idx,
+                         Value val) const {
+  PVecNode *r = editable(node, edit);
+  if (level == 0) {
+    r->Values[idx & MASK] = val;
+  } else {
+    size_t sub = (idx >> level) & MASK;
+    r->Children[sub] = doSet(edit, level - BITS, node->Children[sub], idx, val);
+  }
+  return r;
+}
+
+void PVector::set(edit_t edit, vint_t idx, Value val) {
+  checkIndex(idx);
+  if ((size_t)idx >= tailOffset()) {
+    tail_[idx & MASK] = val;
+  } else {
+    root_ = doSet(edit, shift_, root_, idx, val);
+  }
+}
+
+PVector *PVector::Set(vint_t idx, Value val) const {
+  if (IsTransient()) {
+    throw LispException("Use pvector-set! to update transient.");
+  }
+  auto r = new PVector(size_, shift_, root_, tail_, 0);
+  r->set(0, idx, val);
+  return r;
+}
+
+PVector *PVector::Push(Value val) const {
+  if (IsTransient()) {
+    throw LispException("Use pvector-push! to update transient.");
+  }
+  auto r = new PVector(size_, shift_, root_, tail_, 0);
+  r->push(0, val);
+  return r;
+}
+
+PVector *PVector::Pop() const {
+  if (IsTransient()) {
+    throw LispException("Use pvector-pop! to update transient.");
+  }
+  auto r = new PVector(size_, shift_, root_, tail_, 0);
+  r->pop(0);
+  return r;
+}
+
+void PVector::SetInPlace(vint_t idx, Value val) {
+  if (!IsTransient()) {
+    throw LispException("Vector is not transient.");
+  }
+  set(edit_, idx, val);
+}
+
+void PVector::PushInPlace(Value val) {
+  if (!IsTransient()) {
+    throw LispException("Vector is not transient.");
+  }
+  push(edit_, val);
+}
+
+void PVector::PopInPlace() {
+  if (!IsTransient()) {
+    throw LispException("Vector is not transient.");
+  }
+  pop(edit_);
+}
+
+PVector *PVector::Transient() const {
+  return new PVector(size_, shift_, root_, tail_, new_edit());
+}
+
+} // namespace cxxlisp
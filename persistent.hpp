@@ -0,0 +1,139 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Owner of nodes which a transient may update in place.
+ *
+ * Nodes of persistent collections have edit id 0. A transient gets a fresh
+ * id, and only nodes created with that id are mutated; others are copied
+ * first. persistent! resets the collection's id to 0, so the nodes it
+ * created become immutable.
+ */
+using edit_t = uint64_t;
+edit_t new_edit();
+
+class HamtNode;
+class PVecNode;
+
+/**
+ * Persistent hash map (hash array mapped trie).
+ *
+ * Each node has a bitmap of 32 branches for 5 bits of the key's hash.
+ * Entries and subnodes are stored compactly in separate arrays. Updates
+ * copy only the path from the root, so O(log32 n) nodes.
+ *
+ * Keys are compared by equal?.
+ */
+class PMap final : public gc_cleanup, noncopyable {
+  HamtNode *root_;
+  size_t size_;
+  edit_t edit_;
+
+public:
+  PMap(HamtNode *root, size_t size, edit_t edit)
+      : root_(root), size_(size), edit_(edit) {}
+  static PMap *Empty();
+
+  size_t Size() const { return size_; }
+  bool IsTransient() const { return edit_ != 0; }
+
+  const Value *Find(Value key) const;
+  PMap *Set(Value key, Value val) const;
+  PMap *Delete(Value key) const;
+
+  // Operations of transient. They update this map in place.
+  void SetInPlace(Value key, Value val);
+  void DeleteInPlace(Value key);
+
+  PMap *Transient() const;
+  void Persistent() { edit_ = 0; }
+
+  template <typename F> void Each(F f) const;
+};
+
+/**
+ * Persistent vector.
+ *
+ * Elements are stored in a 32-way trie indexed by bits of the index, and
+ * the last (up to) 32 elements are kept in a separate tail, so push is
+ * amortized O(1).
+ */
+class PVector final : public gc_cleanup, noncopyable {
+  size_t size_;
+  int shift_;
+  PVecNode *root_;
+  std::vector<Value> tail_;
+  edit_t edit_;
+
+  size_t tailOffset() const;
+  const std::vector<Value> &leafFor(size_t idx) const;
+  PVecNode *pushTail(edit_t edit, int level, PVecNode *parent,
+                     PVecNode *tail) const;
+  PVecNode *popTail(edit_t edit, int level, PVecNode *node) const;
+  PVecNode *doSet(edit_t edit, int level, PVecNode *node, size_t idx,
+                  Value val) const;
+  void checkIndex(vint_t idx) const;
+
+  // Implementations of both persistent and transient operations.
+  void push(edit_t edit, Value val);
+  void pop(edit_t edit);
+  void set(edit_t edit, vint_t idx, Value val);
+
+public:
+  PVector(size_t size, int shift, PVecNode *root, std::vector<Value> tail,
+          edit_t edit)
+      : size_(size), shift_(shift), root_(root), tail_(std::move(tail)),
+        edit_(edit) {}
+  static PVector *Empty();
+
+  size_t Size() const { return size_; }
+  bool IsTransient() const { return edit_ != 0; }
+
+  Value Ref(vint_t idx) const;
+  PVector *Set(vint_t idx, Value val) const;
+  PVector *Push(Value val) const;
+  PVector *Pop() const;
+
+  // Operations of transient. They update this vector in place.
+  void SetInPlace(vint_t idx, Value val);
+  void PushInPlace(Value val);
+  void PopInPlace();
+
+  PVector *Transient() const;
+  void Persistent() { edit_ = 0; }
+};
+
+/**
+ * HAMT node.
+ *
+ * Below the last level of hash bits, a node is a collision node which has
+ * only entries and is searched linearly.
+ */
+class HamtNode final : public gc_cleanup, noncopyable {
+public:
+  edit_t Edit;
+  uint32_t DataMap = 0;
+  uint32_t NodeMap = 0;
+  std::vector<Value> Entries; // key0, val0, key1, val1, ...
+  std::vector<HamtNode *> Nodes;
+
+  explicit HamtNode(edit_t edit) : Edit(edit) {}
+
+  template <typename F> void Each(F f) const {
+    for (size_t i = 0; i < Entries.size(); i += 2) {
+      f(Entries[i], Entries[i + 1]);
+    }
+    for (auto node : Nodes) {
+      node->Each(f);
+    }
+  }
+};
+
+template <typename F> void PMap::Each(F f) const { root_->Each(f); }
+
+} // namespace cxxlisp
@@ -1,6 +1,12 @@
+#include "hash_table.hpp"
+#include "number.hpp"
 #include "parser.hpp"
+#include "persistent.hpp"
+#include "record.hpp"
+#include "string_builder.hpp"
 #include "util.hpp"
 #include "value.hpp"
+#include "vector.hpp"
 #include "vm.hpp"
 
 namespace cxxlisp {
@@ -27,14 +33,21 @@ static bool pp_(ostream &os, Ctx &ctx, Value v, int &len) {
     auto &str = v.AsSpecial();
     return p(str);
   }
-  case ValueType::NUMBER: {
-    string str = to_string(v.AsNumber());
-    return p(str);
+  case ValueType::NUMBER:
+  case ValueType::FLONUM:
+  case ValueType::BIGNUM: {
+    // A number is never truncated, only the rest of the output.
+    string str = number_to_string(v);
+    os << str;
+    len -= (int)str.length();
+    return true;
   }
   case ValueType::ATOM: {
     auto &str = ctx.vm->AtomToString(v.AsAtom());
     return p(str);
   }
+  case ValueType::CHAR:
+    return p("#\\" + escape_char(v.AsChar()));
   case ValueType::STRING: {
     auto str = escape_str(v.AsString());
     if (len >= (int)str.length() + 2) {
@@ -44,6 +57,76 @@ static bool pp_(ostream &os, Ctx &ctx, Value v, int &len) {
       return 0;
     }
   }
+  case ValueType::VECTOR: {
+    Vector &vec = v.AsVector();
+    if (vec.Type() == VectorType::VALUE) {
+      if (!p("#(")) {
+        return false;
+      }
+    } else if (!p("#"s + vector_type_name(vec.Type()) + "(")) {
+      return false;
+    }
+    for (size_t i = 0; i < vec.Size(); i++) {
+      if (i > 0 && !p(" ")) {
+        return false;
+      }
+      if (!pp_(os, ctx, vec.Ref(i), len)) {
+        return false;
+      }
+    }
+    return p(")");
+  }
+  case ValueType::STRING_BUILDER:
+    return p("#<string-builder " + to_string(v.AsStringBuilder().Size()) +
+             ">");
+  case ValueType::HASH_TABLE:
+    return p("#<hash-table " + to_string(v.AsHashTable().Size()) + ">");
+  case ValueType::RECORD_TYPE:
+    return p("#<record-type " + v.AsRecordType().Name() + ">");
+  case ValueType::RECORD: {
+    Record &rec = v.AsRecord();
+    if (!p("#<" + rec.Type().Name())) {
+      return false;
+    }
+    for (size_t i = 0; i < rec.Size(); i++) {
+      if (!p(" ") || !pp_(os, ctx, rec.Slot((int)i), len)) {
+        return false;
+      }
+    }
+    return p(">");
+  }
+  case ValueType::PMAP: {
+    PMap &m = v.AsPMap();
+    if (m.IsTransient()) {
+      return p("#<transient pmap " + to_string(m.Size()) + ">");
+    }
+    if (!p("#pmap(")) {
+      return false;
+    }
+    bool ok = true;
+    bool first = true;
+    m.Each([&](Value key, Value val) {
+      ok = ok && (first || p(" ")) && pp_(os, ctx, key, len) && p(" ") &&
+           pp_(os, ctx, val, len);
+      first = false;
+    });
+    return ok && p(")");
+  }
+  case ValueType::PVECTOR: {
+    PVector &vec = v.AsPVector();
+    if (vec.IsTransient()) {
+      return p("#<transient pvector " + to_string(vec.Size()) + ">");
+    }
+    if (!p("#pvector(")) {
+      return false;
+    }
+    for (size_t i = 0; i < vec.Size(); i++) {
+      if ((i > 0 && !p(" ")) || !pp_(os, ctx, vec.Ref(i), len)) {
+        return false;
+      }
+    }
+    return p(")");
+  }
   case ValueType::PROCEDURE: {
     Procedure &proc = v.AsProcedure();
     if (proc.Name().empty()) {
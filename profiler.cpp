@@ -0,0 +1,532 @@
+#include <algorithm>
+#include <iomanip>
+#include <sys/time.h>
+#include <unordered_set>
+
+#include "hash_table.hpp"
+#include "number.hpp"
+#include "persistent.hpp"
+#include "profiler.hpp"
+#include "record.hpp"
+#include "string_builder.hpp"
+#include "util.hpp"
+#include "vector.hpp"
+#include "vm.hpp"
+
+#ifdef CXXLISP_GC_ENABLED
+#include <gc.h>
+#endif
+
+namespace cxxlisp {
+
+using namespace std;
+
+volatile sig_atomic_t profile_pending = 0;
+
+static Profiler *running_profiler = nullptr;
+static struct sigaction old_action;
+
+static void on_sigprof(int) { profile_pending = 1; }
+
+static void set_timer(int interval_us) {
+  itimerval timer{};
+  timer.it_interval.tv_sec = interval_us / 1000000;
+  timer.it_interval.tv_usec = interval_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+Profiler::~Profiler() {
+  if (running_) {
+    Stop();
+  }
+}
+
+void Profiler::Start(int interval_us) {
+  if (running_profiler) {
+    throw LispException("Profiler is already running.");
+  }
+  if (interval_us <= 0) {
+    throw LispException("Invalid profiling interval " +
+                        to_string(interval_us) + ".");
+  }
+
+  struct sigaction action {};
+  action.sa_handler = on_sigprof;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &old_action);
+  set_timer(interval_us);
+
+  running_profiler = this;
+  running_ = true;
+}
+
+void Profiler::Stop() {
+  if (!running_) {
+    throw LispException("Profiler isn't running.");
+  }
+  set_timer(0);
+  sigaction(SIGPROF, &old_action, nullptr);
+  profile_pending = 0;
+
+  running_profiler = nullptr;
+  running_ = false;
+}
+
+static void append_name(string &s, const Procedure &proc) {
+  if (!s.empty()) {
+    s += ';';
+  }
+  s += profile_name(proc);
+}
+
+void Profiler::Sample(const VM &vm, const Procedure *leaf) {
+  profile_pending = 0;
+  if (!running_) {
+    return;
+  }
+
+  // Forms on the stack are skipped. Lisp procedures are pushed when called.
+  string stack;
+  for (Value frame : vm.Stack()) {
+    if (frame.IsProcedure()) {
+      append_name(stack, frame.AsProcedure());
+    }
+  }
+  if (leaf) {
+    append_name(stack, *leaf);
+  }
+  if (stack.empty()) {
+    stack = "<toplevel>";
+  }
+  counts_[stack]++;
+  samples_++;
+}
+
+void Profiler::Clear() {
+  counts_.clear();
+  samples_ = 0;
+}
+
+void Profiler::Write(ostream &os) const {
+  vector<pair<string, size_t>> lines(counts_.begin(), counts_.end());
+  sort(lines.begin(), lines.end());
+  for (auto &[stack, count] : lines) {
+    os << stack << ' ' << count << '\n';
+  }
+  os.flush();
+}
+
+//===================================================================
+// CallStats
+//===================================================================
+
+void CallStats::Enter(const Procedure &proc) {
+  Entry &entry = entries_[&proc];
+  entry.Calls++;
+  entry.Active++;
+  frames_.push_back({&entry, clock::now(), 0});
+}
+
+void CallStats::Leave() {
+  Frame frame = frames_.back();
+  frames_.pop_back();
+  int64_t total = chrono::duration_cast<chrono::nanoseconds>(clock::now() -
+                                                             frame.start)
+                      .count();
+  frame.entry->SelfNs += total - frame.childNs;
+  if (--frame.entry->Active == 0) {
+    frame.entry->TotalNs += total;
+  }
+  if (!frames_.empty()) {
+    frames_.back().childNs += total;
+  }
+}
+
+void CallStats::Clear() {
+  for (auto &[proc, entry] : entries_) {
+    entry.Calls = 0;
+    entry.SelfNs = 0;
+    entry.TotalNs = 0;
+  }
+}
+
+vector<pair<const Procedure *, CallStats::Entry>> CallStats::Sorted() const {
+  vector<pair<const Procedure *, Entry>> r;
+  for (auto &[proc, entry] : entries_) {
+    if (entry.Calls > 0) {
+      r.emplace_back(proc, entry);
+    }
+  }
+  sort(r.begin(), r.end(), [](auto &a, auto &b) {
+    return a.second.SelfNs > b.second.SelfNs;
+  });
+  return r;
+}
+
+void CallStats::Write(ostream &os) const {
+  os << left << setw(24) << "procedure" << right << setw(12) << "calls"
+     << setw(12) << "self ms" << setw(12) << "total ms" << '\n';
+  os << fixed << setprecision(3);
+  for (auto &[proc, entry] : Sorted()) {
+    os << left << setw(24) << profile_name(*proc) << right << setw(12)
+       << entry.Calls << setw(12) << entry.SelfNs / 1e6 << setw(12)
+       << entry.TotalNs / 1e6 << '\n';
+  }
+  os << defaultfloat;
+  os.flush();
+}
+
+//===================================================================
+// AllocStats
+//===================================================================
+
+bool alloc_profiling = false;
+
+void record_alloc(AllocKind kind, size_t bytes) {
+  if (VM::Default) {
+    VM::Default->Allocs().Record(*VM::Default, kind, bytes);
+  }
+}
+
+const char *alloc_kind_name(AllocKind kind) {
+  static const char *NAMES[] = {"cell", "string", "procedure", "env"};
+  return NAMES[(size_t)kind];
+}
+
+void AllocStats::Start() {
+  Clear();
+  alloc_profiling = true;
+}
+
+void AllocStats::Stop() { alloc_profiling = false; }
+
+void AllocStats::Record(const VM &vm, AllocKind kind, size_t bytes) {
+  Entry &total = kinds_[(size_t)kind];
+  total.Count++;
+  total.Bytes += bytes;
+
+  // Innermost form, and the procedure which runs it.
+  const Procedure *proc = nullptr;
+  Cell *form = nullptr;
+  auto &stack = vm.Stack();
+  for (size_t i = stack.size(); i > 0 && !proc; i--) {
+    Value frame = stack[i - 1];
+    if (frame.IsProcedure()) {
+      proc = &frame.AsProcedure();
+    } else if (!form && frame.IsCell()) {
+      form = &frame.AsCell();
+    }
+  }
+  Entry &site = sites_[{proc, form}];
+  site.Count++;
+  site.Bytes += bytes;
+}
+
+void AllocStats::Clear() {
+  kinds_ = {};
+  sites_.clear();
+}
+
+vector<AllocStats::Site> AllocStats::Sites() const {
+  vector<Site> r;
+  for (auto &[key, entry] : sites_) {
+    r.push_back({key.first, key.second, entry});
+  }
+  sort(r.begin(), r.end(),
+       [](auto &a, auto &b) { return a.Total.Bytes > b.Total.Bytes; });
+  return r;
+}
+
+static string abbrev(string s, size_t len) {
+  return s.size() <= len ? s : s.substr(0, len - 3) + "...";
+}
+
+void AllocStats::Write(ostream &os, size_t limit) const {
+  os << left << setw(24) << "kind" << right << setw(12) << "objects"
+     << setw(14) << "bytes" << '\n';
+  for (size_t i = 0; i < kinds_.size(); i++) {
+    os << left << setw(24) << alloc_kind_name((AllocKind)i) << right
+       << setw(12) << kinds_[i].Count << setw(14) << kinds_[i].Bytes << '\n';
+  }
+
+  os << '\n'
+     << left << setw(24) << "procedure" << setw(40) << "form" << right
+     << setw(12) << "objects" << setw(14) << "bytes" << '\n';
+  auto sites = Sites();
+  for (size_t i = 0; i < sites.size() && i < limit; i++) {
+    auto &site = sites[i];
+    os << left << setw(24)
+       << (site.Proc ? profile_name(*site.Proc) : "<toplevel>") << setw(40)
+       << (site.Form ? abbrev(Value(site.Form).ToString(), 38) : "-")
+       << right << setw(12) << site.Total.Count << setw(14)
+       << site.Total.Bytes << '\n';
+  }
+  os.flush();
+}
+
+//===================================================================
+// Heap census
+//===================================================================
+
+// Address of the object of `v`, or nullptr if `v` is immediate.
+static const void *heap_object(Value v) {
+  switch (v.Type()) {
+  case ValueType::BIGNUM:
+    return &v.AsBignum();
+  case ValueType::CELL:
+    return &v.AsCell();
+  case ValueType::STRING:
+    return &v.AsStringValue();
+  case ValueType::STRING_BUILDER:
+    return &v.AsStringBuilder();
+  case ValueType::VECTOR:
+    return &v.AsVector();
+  case ValueType::HASH_TABLE:
+    return &v.AsHashTable();
+  case ValueType::RECORD_TYPE:
+    return &v.AsRecordType();
+  case ValueType::RECORD:
+    return &v.AsRecord();
+  case ValueType::PMAP:
+    return &v.AsPMap();
+  case ValueType::PVECTOR:
+    return &v.AsPVector();
+  case ValueType::PROCEDURE:
+    return &v.AsProcedure();
+  case ValueType::CUSTOM_OBJECT:
+    return &v.AsCustomObject();
+  default:
+    return nullptr;
+  }
+}
+
+// Bytes of the object of `v`. Pushes the values it refers to into `todo`.
+static size_t scan_object(Value v, vector<Value> &todo) {
+  switch (v.Type()) {
+  case ValueType::BIGNUM:
+    return sizeof(Bignum) + v.AsBignum().Limbs().size() * sizeof(uint32_t);
+  case ValueType::CELL:
+    todo.push_back(v.AsCell().Car);
+    todo.push_back(v.AsCell().Cdr);
+    return sizeof(Cell);
+  case ValueType::STRING: {
+    auto &s = v.AsStringValue();
+    for (auto ref : {s.Base(), s.Left(), s.Right()}) {
+      if (ref) {
+        todo.push_back(ref);
+      }
+    }
+    bool owns = !s.IsSlice() && !s.IsRope();
+    return sizeof(StringValue) + (owns ? s.Size() : 0);
+  }
+  case ValueType::STRING_BUILDER:
+    return sizeof(StringBuilder) + v.AsStringBuilder().Size();
+  case ValueType::VECTOR: {
+    Vector &vec = v.AsVector();
+    size_t bytes = sizeof(Vector);
+    visit([&](auto &elems) { bytes += elems.size() * sizeof(elems[0]); },
+          vec.Storage());
+    if (vec.Type() == VectorType::VALUE) {
+      for (size_t i = 0; i < vec.Size(); i++) {
+        todo.push_back(vec.Ref(i));
+      }
+    }
+    return bytes;
+  }
+  case ValueType::HASH_TABLE: {
+    auto &slots = v.AsHashTable().Slots();
+    for (auto &slot : slots) {
+      if (slot.IsLive()) {
+        todo.push_back(slot.Key);
+        todo.push_back(slot.Val);
+      }
+    }
+    return sizeof(HashTable) + slots.size() * sizeof(HashTable::Slot);
+  }
+  case ValueType::RECORD_TYPE: {
+    auto &type = v.AsRecordType();
+    return sizeof(RecordType) + type.Name().size() +
+           type.Fields().size() * sizeof(Value);
+  }
+  case ValueType::RECORD: {
+    Record &rec = v.AsRecord();
+    for (size_t i = 0; i < rec.Size(); i++) {
+      todo.push_back(rec.Slot(i));
+    }
+    return sizeof(Record) + rec.Size() * sizeof(Value);
+  }
+  case ValueType::PMAP: {
+    PMap &map = v.AsPMap();
+    map.Each([&](Value key, Value val) {
+      todo.push_back(key);
+      todo.push_back(val);
+    });
+    // Entries only. Nodes of the trie aren't counted.
+    return sizeof(PMap) + map.Size() * 2 * sizeof(Value);
+  }
+  case ValueType::PVECTOR: {
+    PVector &vec = v.AsPVector();
+    for (size_t i = 0; i < vec.Size(); i++) {
+      todo.push_back(vec.Ref(i));
+    }
+    return sizeof(PVector) + vec.Size() * sizeof(Value);
+  }
+  case ValueType::PROCEDURE: {
+    Procedure &proc = v.AsProcedure();
+    todo.push_back(proc.Params());
+    todo.push_back(proc.Body());
+    return sizeof(Procedure);
+  }
+  default:
+    return 0;
+  }
+}
+
+HeapCensus heap_census(VM &vm) {
+  vector<Value> todo;
+  vm.RootEnv().Each([&](Value v) { todo.push_back(v); });
+  todo.insert(todo.end(), vm.Stack().begin(), vm.Stack().end());
+
+  HeapCensus census{};
+  unordered_set<const void *> visited;
+  while (!todo.empty()) {
+    Value v = todo.back();
+    todo.pop_back();
+    const void *obj = heap_object(v);
+    if (!obj || !visited.insert(obj).second) {
+      continue;
+    }
+    auto &entry = census[(size_t)v.Type()];
+    entry.Count++;
+    entry.Bytes += scan_object(v, todo);
+  }
+  return census;
+}
+
+void write_room(ostream &os, VM &vm) {
+  HeapCensus census = heap_census(vm);
+  vector<size_t> types;
+  for (size_t i = 0; i < census.size(); i++) {
+    if (census[i].Count > 0) {
+      types.push_back(i);
+    }
+  }
+  sort(types.begin(), types.end(),
+       [&](size_t a, size_t b) { return census[a].Bytes > census[b].Bytes; });
+
+  AllocStats::Entry total;
+  os << left << setw(24) << "type" << right << setw(12) << "objects"
+     << setw(14) << "bytes" << '\n';
+  for (size_t i : types) {
+    os << left << setw(24) << to_str((ValueType)i) << right << setw(12)
+       << census[i].Count << setw(14) << census[i].Bytes << '\n';
+    total.Count += census[i].Count;
+    total.Bytes += census[i].Bytes;
+  }
+  os << left << setw(24) << "total" << right << setw(12) << total.Count
+     << setw(14) << total.Bytes << '\n';
+#ifdef CXXLISP_GC_ENABLED
+  os << "GC heap " << GC_get_heap_size() << " bytes, free "
+     << GC_get_free_bytes() << " bytes, " << GC_get_gc_no()
+     << " collections\n";
+#endif
+  os.flush();
+}
+
+//===================================================================
+// Coverage
+//===================================================================
+
+// Call `f` with each form in compiled `code` which Eval evaluates, skipping
+// quoted data, parameters, names and binding lists.
+template <typename F> static void each_form(Value code, F &f);
+
+template <typename F> static void each_form_in(Value list, F &f) {
+  for (; list.IsCell(); list = cdr(list)) {
+    each_form(car(list), f);
+  }
+}
+
+template <typename F> static void each_form(Value code, F &f) {
+  if (!code.IsCell()) {
+    return;
+  }
+  f(code);
+  Value head = car(code), rest = cdr(code);
+  if (head.IsAtom()) {
+    switch ((SpecialForm)head.AsAtom().Id()) {
+    case SpecialForm::QUOTE:
+      return;
+    case SpecialForm::LAMBDA:
+    case SpecialForm::DEFINE:
+    case SpecialForm::SET_EX:
+    case SpecialForm::BLOCK:
+    case SpecialForm::RETURN_FROM:
+      each_form_in(cdr(rest), f);
+      return;
+    case SpecialForm::RECORD_REF:
+    case SpecialForm::RECORD_SET:
+      each_form_in(cdr(cdr(rest)), f);
+      return;
+    case SpecialForm::LET:
+      for (Value decl = car(rest); decl.IsCell(); decl = cdr(decl)) {
+        each_form_in(cdr(car(decl)), f);
+      }
+      each_form_in(cdr(rest), f);
+      return;
+    case SpecialForm::COND:
+      for (; rest.IsCell(); rest = cdr(rest)) {
+        each_form_in(car(rest), f);
+      }
+      return;
+    default:
+      break;
+    }
+  }
+  each_form_in(code, f);
+}
+
+map<uint32_t, map<uint32_t, size_t>> Coverage::Lines(VM &vm) const {
+  map<uint32_t, map<uint32_t, size_t>> lines;
+  SourceMap &sources = vm.Sources();
+  auto add = [&](Value form, size_t count) {
+    SourceLocation loc = sources.Find(form);
+    if (loc.IsKnown()) {
+      size_t &n = lines[loc.File][loc.Line];
+      n = max(n, count);
+    }
+  };
+
+  unordered_set<const Procedure *> visited;
+  auto add_form = [&](Value form) {
+    auto it = hits_.find(&form.AsCell());
+    add(form, it == hits_.end() ? 0 : it->second);
+  };
+  vm.RootEnv().Each([&](Value v) {
+    if (v.IsProcedure() && visited.insert(&v.AsProcedure()).second) {
+      each_form_in(v.AsProcedure().Body(), add_form);
+    }
+  });
+  // Top-level forms which ran aren't reachable from the environment.
+  for (auto &[cell, count] : hits_) {
+    add(Value(const_cast<Cell *>(cell)), count);
+  }
+  return lines;
+}
+
+void Coverage::Write(ostream &os, VM &vm) const {
+  for (auto &[file, lines] : Lines(vm)) {
+    os << "TN:\nSF:" << vm.Sources().FileName(file) << '\n';
+    size_t hit = 0;
+    for (auto &[line, count] : lines) {
+      os << "DA:" << line << ',' << count << '\n';
+      hit += count > 0;
+    }
+    os << "LF:" << lines.size() << "\nLH:" << hit << "\nend_of_record\n";
+  }
+  os.flush();
+}
+
+} // namespace cxxlisp
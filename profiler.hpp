@@ -0,0 +1,231 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+class VM;
+
+/**
+ * Set by SIGPROF while the profiler is running, and cleared by
+ * Profiler::Sample().
+ */
+extern volatile std::sig_atomic_t profile_pending;
+
+/**
+ * Sampling profiler of Lisp procedures.
+ *
+ * A CPU timer raises SIGPROF, whose handler only sets `profile_pending`.
+ * Eval checks the flag at each call and return, where VM::Stack() is
+ * consistent, and takes the sample there. So the signal handler never
+ * touches the VM.
+ *
+ * Samples are counted by stack of procedure names, and written as folded
+ * stacks ("main;f;g 12"), as flamegraph.pl and speedscope read them.
+ *
+ * The timer is per process, so only one profiler can run at a time.
+ */
+class Profiler : noncopyable {
+  std::unordered_map<std::string, size_t> counts_;
+  size_t samples_ = 0;
+  bool running_ = false;
+
+public:
+  static const int DEFAULT_INTERVAL_US = 1000;
+
+  Profiler() {}
+  ~Profiler();
+
+  /**
+   * Start sampling every `interval_us` microseconds of CPU time.
+   * Throw LispException if a profiler is already running.
+   */
+  void Start(int interval_us = DEFAULT_INTERVAL_US);
+  void Stop();
+  bool IsRunning() const { return running_; }
+
+  /**
+   * Record the current stack of `vm`. `leaf` is the native procedure being
+   * returned from, which isn't on the stack.
+   */
+  void Sample(const VM &vm, const Procedure *leaf);
+
+  size_t Samples() const { return samples_; }
+  void Clear();
+
+  /**
+   * Write the samples as folded stacks, sorted by stack.
+   */
+  void Write(std::ostream &os) const;
+};
+
+/**
+ * Call counts and times of each procedure.
+ *
+ * While VM::EnableCallStats is set, Eval calls Enter() and Leave() around
+ * each call. Self time excludes callees, and total time includes them. Total
+ * time of a recursive procedure is counted at the outermost call only.
+ */
+class CallStats : noncopyable {
+public:
+  struct Entry {
+    size_t Calls = 0;
+    int64_t SelfNs = 0;
+    int64_t TotalNs = 0;
+    int Active = 0; // Depth of recursion.
+  };
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct Frame {
+    Entry *entry;
+    clock::time_point start;
+    int64_t childNs;
+  };
+
+  std::unordered_map<const Procedure *, Entry> entries_;
+  std::vector<Frame> frames_;
+
+public:
+  CallStats() {}
+
+  void Enter(const Procedure &proc);
+  void Leave();
+
+  /**
+   * Reset counts. Calls in progress are still accounted on return.
+   */
+  void Clear();
+
+  /**
+   * Called procedures, sorted by self time in descending order.
+   */
+  std::vector<std::pair<const Procedure *, Entry>> Sorted() const;
+
+  /**
+   * Write a report of Sorted() as a table.
+   */
+  void Write(std::ostream &os) const;
+};
+
+/**
+ * Allocation profiler.
+ *
+ * While `alloc_profiling` is set, constructors of Cell, StringValue,
+ * Procedure and Env call record_alloc(), which counts the object by kind and
+ * by site. A site is the innermost call form on VM::Stack() and the
+ * procedure running it, so an allocation by (cons a b) in `f` is attributed
+ * to that form in `f`.
+ *
+ * Bytes are of the object itself, and of the characters for strings which
+ * own them.
+ */
+class AllocStats : noncopyable {
+public:
+  struct Entry {
+    size_t Count = 0;
+    size_t Bytes = 0;
+  };
+
+  struct Site {
+    const Procedure *Proc; // nullptr at top level.
+    Cell *Form;            // nullptr if not in a call.
+    Entry Total;
+  };
+
+private:
+  using site_key_t = std::pair<const Procedure *, Cell *>;
+
+  struct SiteHash {
+    size_t operator()(const site_key_t &k) const {
+      return std::hash<const void *>()(k.first) * 31 +
+             std::hash<const void *>()(k.second);
+    }
+  };
+
+  std::array<Entry, (size_t)AllocKind::MAX> kinds_;
+  std::unordered_map<site_key_t, Entry, SiteHash> sites_;
+
+public:
+  AllocStats() {}
+
+  void Start();
+  void Stop();
+  void Record(const VM &vm, AllocKind kind, size_t bytes);
+  void Clear();
+
+  const Entry &Kind(AllocKind kind) const { return kinds_[(size_t)kind]; }
+
+  /**
+   * Sites sorted by bytes in descending order.
+   */
+  std::vector<Site> Sites() const;
+
+  /**
+   * Write totals by kind and the top `limit` sites.
+   */
+  void Write(std::ostream &os, size_t limit = 20) const;
+};
+
+const char *alloc_kind_name(AllocKind kind);
+
+/**
+ * Live objects by type, counted by walking from the root environment and
+ * the call stack of `vm`. Bytes are approximate: the object and its own
+ * storage, excluding the allocator's overhead.
+ */
+using HeapCensus = std::array<AllocStats::Entry,
+                              (size_t)ValueType::CUSTOM_OBJECT + 1>;
+HeapCensus heap_census(VM &vm);
+
+/**
+ * Write heap_census() as a table, and the size of GC heap if available.
+ */
+void write_room(std::ostream &os, VM &vm);
+
+/**
+ * Code coverage of Lisp sources.
+ *
+ * While VM::EnableCoverage is set, Eval counts evaluations of each form.
+ * The forms which could have run are found when writing, by walking the
+ * bodies of procedures in the root environment, so compilation isn't
+ * affected. Both are mapped to lines by VM::Sources(), and written in lcov
+ * format for each source file.
+ */
+class Coverage : noncopyable {
+  std::unordered_map<const Cell *, size_t> hits_;
+
+public:
+  Coverage() {}
+
+  void Hit(Value form) { hits_[&form.AsCell()]++; }
+  void Clear() { hits_.clear(); }
+
+  /**
+   * Execution count of each line, by file id of VM::Sources().
+   * Lines which have code but didn't run have count 0.
+   */
+  std::map<uint32_t, std::map<uint32_t, size_t>> Lines(VM &vm) const;
+
+  void Write(std::ostream &os, VM &vm) const;
+};
+
+/**
+ * Name of `proc` in profiles.
+ */
+inline const std::string &profile_name(const Procedure &proc) {
+  static const std::string LAMBDA = "lambda";
+  return proc.Name().empty() ? LAMBDA : proc.Name();
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,29 @@
+#include <sstream>
+
+#include "record.hpp"
+#include "util.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+int RecordType::FieldIndex(Value field) const {
+  for (size_t i = 0; i < fields_.size(); i++) {
+    if (fields_[i] == field) {
+      return (int)i;
+    }
+  }
+  throw LispException("Record " + name_ + " has no field " +
+                      field.ToString() + ".");
+}
+
+Record &check_record(Value v, const RecordType &type) {
+  if (!v.IsRecord() || &v.AsRecord().Type() != &type) {
+    stringstream s;
+    s << "Value is not " << type.Name() << " record, but " << v << ".";
+    throw LispException(s.str());
+  }
+  return v.AsRecord();
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Type of record defined by define-record-type.
+ */
+class RecordType final : public gc_cleanup, noncopyable {
+  std::string name_;
+  std::vector<Value> fields_; // Atoms of field names.
+
+public:
+  RecordType(std::string_view name, std::vector<Value> &&fields)
+      : name_(name), fields_(std::move(fields)) {}
+
+  const std::string &Name() const { return name_; }
+  const std::vector<Value> &Fields() const { return fields_; }
+
+  /**
+   * Slot index of `field`. Throw LispException if not found.
+   */
+  int FieldIndex(Value field) const;
+};
+
+/**
+ * Instance of RecordType.
+ *
+ * Slots are laid out in the order of RecordType::Fields(), so accessors
+ * load them by a fixed index.
+ */
+class Record final : public gc_cleanup, noncopyable {
+  RecordType *type_;
+  std::vector<Value> slots_;
+
+public:
+  explicit Record(RecordType *type)
+      : type_(type), slots_(type->Fields().size()) {}
+
+  RecordType &Type() const { return *type_; }
+  Value &Slot(int idx) { return slots_[idx]; }
+  size_t Size() const { return slots_.size(); }
+};
+
+/**
+ * Returns `v` as a record of `type`. Throw LispException if it isn't.
+ */
+Record &check_record(Value v, const RecordType &type);
+
+} // namespace cxxlisp
@@ -0,0 +1,93 @@
+#include "source_map.hpp"
+
+#ifdef CXXLISP_GC_ENABLED
+#include <gc.h>
+#endif
+
+namespace cxxlisp {
+
+using namespace std;
+
+#ifdef CXXLISP_GC_ENABLED
+// Hidden, so that GC doesn't see the entry as a reference.
+static void *hide(const Cell *cell) {
+  return (void *)GC_HIDE_POINTER(cell);
+}
+
+static void link(void **entry, const Cell *cell) {
+  GC_general_register_disappearing_link(entry, cell);
+}
+#else
+static void *hide(const Cell *cell) { return (void *)cell; }
+static void link(void **entry, const Cell *cell) {}
+#endif
+
+SourceMap::~SourceMap() {
+#ifdef CXXLISP_GC_ENABLED
+  for (auto &entry : entries_) {
+    if (entry.cell) {
+      GC_unregister_disappearing_link(&entry.cell);
+    }
+  }
+#endif
+}
+
+uint32_t SourceMap::AddFile(string_view name) {
+  for (size_t i = 1; i < files_.size(); i++) {
+    if (files_[i] == name) {
+      return i;
+    }
+  }
+  files_.emplace_back(name);
+  return files_.size() - 1;
+}
+
+void SourceMap::Add(const Cell *cell, SourceLocation loc) {
+  auto it = index_.find(cell);
+  if (it != index_.end()) {
+    // The same cell, or a new one at the address of a collected one.
+    Entry &entry = entries_[it->second];
+    if (!entry.cell) {
+      entry.cell = hide(cell);
+      link(&entry.cell, cell);
+    }
+    entry.loc = loc;
+    return;
+  }
+
+  entries_.push_back({hide(cell), loc});
+  link(&entries_.back().cell, cell);
+  index_.emplace(cell, entries_.size() - 1);
+}
+
+SourceLocation SourceMap::Find(Value v) const {
+  if (!v.IsCell()) {
+    return SourceLocation();
+  }
+  auto it = index_.find(&v.AsCell());
+  if (it == index_.end()) {
+    return SourceLocation();
+  }
+  const Entry &entry = entries_[it->second];
+  return entry.cell ? entry.loc : SourceLocation();
+}
+
+void SourceMap::Inherit(Value from, Value to) {
+  if (!to.IsCell() || from == to || Find(to).IsKnown()) {
+    return;
+  }
+  SourceLocation loc = Find(from);
+  if (loc.IsKnown()) {
+    Add(&to.AsCell(), loc);
+  }
+}
+
+string SourceMap::Describe(SourceLocation loc) const {
+  if (!loc.IsKnown()) {
+    return "";
+  }
+  return files_[loc.File] + ":" + to_string(loc.Line) + ":" +
+         to_string(loc.Column);
+}
+
+} // namespace cxxlisp
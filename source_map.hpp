@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Position in a source file. Line and column start from 1, and column is in
+ * bytes. File 0 means unknown.
+ */
+struct SourceLocation {
+  uint32_t File = 0;
+  uint32_t Line = 0;
+  uint32_t Column = 0;
+
+  bool IsKnown() const { return File != 0; }
+};
+
+/**
+ * Side table of source locations of lists, keyed by the address of their
+ * first cell.
+ *
+ * The parser adds the location of each list it reads from a file, and the
+ * compiler copies it to the forms it rewrites, so the code which runs can be
+ * mapped back to the source. Cells don't grow, and evaluation doesn't touch
+ * this table.
+ *
+ * Cells are held weakly. With GC, an entry is cleared when its cell is
+ * collected, so a new cell at the same address isn't mistaken for it.
+ */
+class SourceMap : noncopyable {
+  struct Entry {
+    void *cell; // Hidden pointer, cleared by GC when the cell is collected.
+    SourceLocation loc;
+  };
+
+  std::vector<std::string> files_{""};
+  std::deque<Entry> entries_; // Addresses must be stable for GC.
+  std::unordered_map<const Cell *, size_t> index_;
+
+public:
+  SourceMap() {}
+  ~SourceMap();
+
+  /**
+   * Returns id of file `name`, registering it if new.
+   */
+  uint32_t AddFile(std::string_view name);
+  const std::string &FileName(uint32_t file) const { return files_[file]; }
+
+  void Add(const Cell *cell, SourceLocation loc);
+
+  /**
+   * Location of `v` if it's a list read from a file, otherwise unknown.
+   */
+  SourceLocation Find(Value v) const;
+
+  /**
+   * Copy the location of `from` to `to`, unless `to` has its own.
+   */
+  void Inherit(Value from, Value to);
+
+  /**
+   * "file:line:column", or empty if unknown.
+   */
+  std::string Describe(SourceLocation loc) const;
+
+  size_t Size() const { return index_.size(); }
+};
+
+} // namespace cxxlisp
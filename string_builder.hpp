@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Mutable buffer to build a string incrementally.
+ *
+ * Appending is amortized O(1) per byte, unlike repeated string-append.
+ */
+class StringBuilder final : public gc_cleanup, noncopyable {
+  std::string buf_;
+
+public:
+  size_t Size() const { return buf_.size(); }
+  const std::string &Ref() const { return buf_; }
+
+  void Append(std::string_view s) { buf_ += s; }
+  void Append(const StringValue &s) {
+    s.Each([this](std::string_view piece) { buf_ += piece; });
+  }
+  void Clear() { buf_.clear(); }
+};
+
+} // namespace cxxlisp
@@ -8,12 +8,12 @@
 ;; Test string functions.
 (expect 'hoge (string->symbol "hoge"))
 (expect "hoge" (symbol->string 'hoge))
-(expect '(97 98 99) (string->list "abc"))
+(expect '(#\a #\b #\c) (string->list "abc"))
 (expect "123" (string-append "1" "2" "3"))
 (expect "bc" (substring "abcd" 1 3))
 
 ;; Test list functions.
-(expect "ABC" (list->string '(65 66 67)))
+(expect "ABC" (list->string '(#\A #\B #\C)))
 (expect #t (list? '(1 2)))
 (expect #f (list? '(1 . 2)))
 (expect '(2) (list-tail '(0 1 2) 2))
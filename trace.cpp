@@ -0,0 +1,137 @@
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+#ifdef CXXLISP_GC_ENABLED
+#include <gc.h>
+#endif
+
+namespace cxxlisp {
+
+using namespace std;
+
+atomic<bool> tracing = false;
+
+// Small sequential id of the current thread, which is easier to read than
+// the system's one.
+static uint32_t thread_id() {
+  static atomic<uint32_t> next_id = 1;
+  thread_local uint32_t id = next_id++;
+  return id;
+}
+
+static void write_json_string(ostream &os, string_view s) {
+  os << '"';
+  for (char c : s) {
+    switch (c) {
+    case '"':
+      os << "\\\"";
+      break;
+    case '\\':
+      os << "\\\\";
+      break;
+    case '\n':
+      os << "\\n";
+      break;
+    case '\t':
+      os << "\\t";
+      break;
+    default:
+      if ((unsigned char)c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        os << buf;
+      } else {
+        os << c;
+      }
+    }
+  }
+  os << '"';
+}
+
+#ifdef CXXLISP_GC_ENABLED
+// Called by the collecting thread with the allocation lock held, so this
+// must not allocate from GC heap.
+static void on_gc_event(GC_EventType event) {
+  static int64_t start = 0;
+  if (event == GC_EVENT_START) {
+    start = Tracer::Now();
+  } else if (event == GC_EVENT_END) {
+    Tracer::Instance().Complete("gc", "collect", start, Tracer::Now() - start);
+  }
+}
+#endif
+
+Tracer &Tracer::Instance() {
+  static Tracer tracer;
+  return tracer;
+}
+
+void Tracer::Start() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    events_.clear();
+  }
+#ifdef CXXLISP_GC_ENABLED
+  GC_set_on_collection_event(on_gc_event);
+#endif
+  tracing = true;
+}
+
+void Tracer::Stop() {
+  tracing = false;
+#ifdef CXXLISP_GC_ENABLED
+  GC_set_on_collection_event(nullptr);
+#endif
+}
+
+int64_t Tracer::Now() {
+  using namespace chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::Complete(const char *cat, const char *name, int64_t ts,
+                      int64_t dur, string args) {
+  uint32_t tid = thread_id();
+  lock_guard<mutex> lock(mutex_);
+  events_.push_back({cat, name, ts, dur, tid, std::move(args)});
+}
+
+size_t Tracer::Size() {
+  lock_guard<mutex> lock(mutex_);
+  return events_.size();
+}
+
+void Tracer::Write(ostream &os) {
+  lock_guard<mutex> lock(mutex_);
+  os << "{\"traceEvents\":[";
+  const char *sep = "\n";
+  for (auto &e : events_) {
+    os << sep << "{\"ph\":\"X\",\"cat\":\"" << e.cat << "\",\"name\":\""
+       << e.name << "\",\"ts\":" << e.ts << ",\"dur\":" << e.dur
+       << ",\"pid\":" << getpid() << ",\"tid\":" << e.tid;
+    if (!e.args.empty()) {
+      os << ",\"args\":{" << e.args << "}";
+    }
+    os << "}";
+    sep = ",\n";
+  }
+  os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  os.flush();
+}
+
+void TraceSpan::Arg(const char *key, string_view val) {
+  stringstream s;
+  if (!args_.empty()) {
+    s << ',';
+  }
+  write_json_string(s, key);
+  s << ':';
+  write_json_string(s, val);
+  args_ += s.str();
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+// Set while the tracer is running.
+extern std::atomic<bool> tracing;
+
+/**
+ * Recorder of trace events in the Chrome trace event format, which
+ * chrome://tracing and Perfetto show as a timeline.
+ *
+ * Events are spans of parse, compile and execution of each top-level form,
+ * load of files, and GC pauses. They are buffered in memory, and written as
+ * JSON by Write(). Events may be added from any thread, and are shown per
+ * thread.
+ */
+class Tracer : noncopyable {
+  struct Event {
+    const char *cat;
+    const char *name;
+    int64_t ts; // Microseconds.
+    int64_t dur;
+    uint32_t tid;
+    std::string args; // JSON object members, or empty.
+  };
+
+  std::mutex mutex_;
+  std::vector<Event> events_;
+
+  Tracer() {}
+
+public:
+  static Tracer &Instance();
+
+  /**
+   * Clear events and start recording.
+   */
+  void Start();
+  void Stop();
+
+  /**
+   * Microseconds since an arbitrary epoch, for timestamps of events.
+   */
+  static int64_t Now();
+
+  /**
+   * Add a complete event. `cat` and `name` must be static strings.
+   */
+  void Complete(const char *cat, const char *name, int64_t ts, int64_t dur,
+                std::string args = "");
+
+  size_t Size();
+  void Write(std::ostream &os);
+};
+
+/**
+ * Span of a trace event, from construction to destruction.
+ *
+ * Usage:
+ *   TraceSpan span("eval", "execute");
+ *   if (span.IsActive()) {
+ *     span.Arg("form", code.ToString());
+ *   }
+ */
+class TraceSpan : noncopyable {
+  const char *cat_;
+  const char *name_;
+  int64_t start_ = -1;
+  std::string args_;
+
+public:
+  TraceSpan(const char *cat, const char *name) : cat_(cat), name_(name) {
+    if (tracing.load(std::memory_order_relaxed)) [[unlikely]] {
+      start_ = Tracer::Now();
+    }
+  }
+  ~TraceSpan() {
+    if (start_ >= 0) [[unlikely]] {
+      Tracer::Instance().Complete(cat_, name_, start_,
+                                  Tracer::Now() - start_, std::move(args_));
+    }
+  }
+
+  bool IsActive() const { return start_ >= 0; }
+
+  /**
+   * Add a string argument shown with the event.
+   */
+  void Arg(const char *key, std::string_view val);
+};
+
+} // namespace cxxlisp
@@ -0,0 +1,101 @@
+#include <bit>
+#include <cstring>
+
+#include "utf8.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+static const char32_t REPLACEMENT_CHAR = 0xfffd;
+
+// High bit of each byte in a word.
+static const uint64_t HIGH_BITS = 0x8080808080808080ULL;
+
+Char utf8_decode(string_view s, size_t pos) {
+  unsigned char b = s[pos];
+  if (b < 0x80) {
+    return Char(b);
+  }
+
+  size_t len;
+  char32_t code;
+  if ((b & 0xe0) == 0xc0) {
+    len = 2;
+    code = b & 0x1f;
+  } else if ((b & 0xf0) == 0xe0) {
+    len = 3;
+    code = b & 0x0f;
+  } else if ((b & 0xf8) == 0xf0) {
+    len = 4;
+    code = b & 0x07;
+  } else {
+    return Char(REPLACEMENT_CHAR);
+  }
+  if (pos + len > s.size()) {
+    return Char(REPLACEMENT_CHAR);
+  }
+  for (size_t i = 1; i < len; i++) {
+    if (!utf8_is_cont(s[pos + i])) {
+      return Char(REPLACEMENT_CHAR);
+    }
+    code = (code << 6) | (s[pos + i] & 0x3f);
+  }
+  return Char(code);
+}
+
+void utf8_encode(string &s, Char c) {
+  char32_t code = c.Code();
+  if (code < 0x80) {
+    s.push_back((char)code);
+  } else if (code < 0x800) {
+    s.push_back((char)(0xc0 | (code >> 6)));
+    s.push_back((char)(0x80 | (code & 0x3f)));
+  } else if (code < 0x10000) {
+    s.push_back((char)(0xe0 | (code >> 12)));
+    s.push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+    s.push_back((char)(0x80 | (code & 0x3f)));
+  } else {
+    s.push_back((char)(0xf0 | (code >> 18)));
+    s.push_back((char)(0x80 | ((code >> 12) & 0x3f)));
+    s.push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+    s.push_back((char)(0x80 | (code & 0x3f)));
+  }
+}
+
+// Both functions below scan 8 bytes at a time.
+
+bool utf8_is_ascii(string_view s) {
+  size_t i = 0;
+  uint64_t acc = 0;
+  for (; i + 8 <= s.size(); i += 8) {
+    uint64_t w;
+    memcpy(&w, s.data() + i, 8);
+    acc |= w;
+  }
+  for (; i < s.size(); i++) {
+    acc |= (unsigned char)s[i];
+  }
+  return (acc & HIGH_BITS) == 0;
+}
+
+size_t utf8_length(string_view s) {
+  size_t conts = 0;
+  size_t i = 0;
+  for (; i + 8 <= s.size(); i += 8) {
+    uint64_t w;
+    memcpy(&w, s.data() + i, 8);
+    // Bytes whose bit 7 is set and bit 6 is clear.
+    conts += popcount(w & ~(w << 1) & HIGH_BITS);
+  }
+  for (; i < s.size(); i++) {
+    conts += utf8_is_cont(s[i]);
+  }
+  size_t len = s.size() - conts;
+  if (!s.empty() && utf8_is_cont(s[0])) {
+    len++; // A character starts at the first byte anyway.
+  }
+  return len;
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * UTF-8 helpers.
+ *
+ * A character starts at the first byte and at each byte which is not a
+ * continuation byte (10xxxxxx), so malformed input still splits into
+ * characters consistently.
+ */
+
+inline bool utf8_is_cont(char b) { return ((unsigned char)b & 0xc0) == 0x80; }
+
+// Whether a character starts at `pos`, or `pos` is the end of `s`.
+inline bool utf8_is_boundary(std::string_view s, size_t pos) {
+  return pos == 0 || pos >= s.size() || !utf8_is_cont(s[pos]);
+}
+
+// Byte offset of the character after the one at `pos`.
+inline size_t utf8_next(std::string_view s, size_t pos) {
+  for (pos++; pos < s.size() && utf8_is_cont(s[pos]); pos++) {
+  }
+  return pos;
+}
+
+// Byte offset of the character before the one at `pos`.
+inline size_t utf8_prev(std::string_view s, size_t pos) {
+  for (pos--; pos > 0 && utf8_is_cont(s[pos]); pos--) {
+  }
+  return pos;
+}
+
+// Longest prefix of `s` of at most `n` bytes which ends at a character
+// boundary.
+inline std::string_view utf8_truncate(std::string_view s, size_t n) {
+  if (n >= s.size()) {
+    return s;
+  }
+  while (n > 0 && utf8_is_cont(s[n])) {
+    n--;
+  }
+  return s.substr(0, n);
+}
+
+// Decodes the character at `pos`. Malformed sequences decode to U+FFFD.
+Char utf8_decode(std::string_view s, size_t pos);
+
+void utf8_encode(std::string &s, Char c);
+
+bool utf8_is_ascii(std::string_view s);
+
+// Number of characters in `s`.
+size_t utf8_length(std::string_view s);
+
+} // namespace cxxlisp
@@ -1,6 +1,8 @@
 #include <fstream>
 
 #include "parser.hpp"
+#include "trace.hpp"
+#include "utf8.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
@@ -8,47 +10,72 @@ namespace cxxlisp {
 
 using namespace std;
 
-Value run(VM &vm, string_view src) {
-  Parser parser{vm, src};
+Value run(VM &vm, string_view src, string_view file,
+          const function<void(Value)> &on_compile, size_t skip) {
+  Parser parser{vm, src, file};
   Value result = UNDEF;
-  for (;;) {
+  for (size_t i = 0;; i++) {
     Value code;
     try {
+      TraceSpan span("lisp", "parse");
       code = parser.Read();
     } catch (EndOfSourceException &) {
       break;
     }
+    if (i < skip) {
+      continue;
+    }
 
+    TraceSpan span("lisp", "toplevel");
+    if (span.IsActive()) {
+      span.Arg("form", utf8_truncate(code.ToString(), 80));
+    }
     if (vm.EnableTrace) {
       cout << "trace: " << code << endl;
     }
-    code = Compiler().Compile(vm, code);
+    {
+      TraceSpan compile_span("lisp", "compile");
+      code = Compiler().Compile(vm, code);
+    }
+    if (on_compile) {
+      on_compile(code);
+    }
     if (vm.EnableTraceMacroExpand) {
       cout << "trace: expand ";
       pretty_print(cout, vm, code, 1000);
       cout << endl;
     }
+    TraceSpan exec_span("lisp", "execute");
     result = Eval().Execute(vm, code);
   }
   return result;
 }
 
 Value run_file(VM &vm, string_view path) {
+  TraceSpan span("lisp", "load");
+  if (span.IsActive()) {
+    span.Arg("path", path);
+  }
   ifstream fs(string(path).c_str());
   if (!fs.is_open()) {
     throw LispException("Can't open '"s + string(path) + "'.");
   }
 
   string src((istreambuf_iterator<char>(fs)), istreambuf_iterator<char>());
-  return run(vm, src);
+  if (vm.Modules().IsEnabled()) {
+    return vm.Modules().Load(vm, path, src);
+  }
+  return run(vm, src, path);
 }
 
-void add_proc_varg(VM &vm, bool is_macro, const char *id,
-                   Value (*f)(Ctx &, Value)) {
+Procedure *add_proc_varg(VM &vm, bool is_macro, const char *id,
+                         Value (*f)(Ctx &, Value)) {
   auto *proc = new Procedure(-1, f);
   proc->SetName(id);
   proc->SetIsMacro(is_macro);
+  proc->SetIsStable(true);
   vm.RootEnv().Define(vm.Intern(id), proc);
+  return proc;
 }
 
 } // namespace cxxlisp
@@ -1,6 +1,7 @@
 #pragma once
 #include <functional>
 #include <utility>
+#include <vector>
 
 #include "value.hpp"
 #include "vm.hpp"
@@ -17,13 +18,28 @@ template <typename T> inline T val_as(Value v);
 template <> inline vint_t val_as<vint_t>(Value v) { return v.AsNumber(); }
 template <> inline bool val_as<bool>(Value v) { return v.Truthy(); }
 template <> inline Atom val_as<Atom>(Value v) { return v.AsAtom(); }
+template <> inline Char val_as<Char>(Value v) { return v.AsChar(); }
 template <> inline Cell &val_as<Cell &>(Value v) { return v.AsCell(); }
-template <> inline const std::string &val_as<const std::string &>(Value v) {
+template <> inline std::string_view val_as<std::string_view>(Value v) {
   return v.AsString();
 }
+template <> inline StringBuilder &val_as<StringBuilder &>(Value v) {
+  return v.AsStringBuilder();
+}
 template <> inline Procedure &val_as<Procedure &>(Value v) {
   return v.AsProcedure();
 }
+template <> inline Vector &val_as<Vector &>(Value v) { return v.AsVector(); }
+template <> inline HashTable &val_as<HashTable &>(Value v) {
+  return v.AsHashTable();
+}
+template <> inline RecordType &val_as<RecordType &>(Value v) {
+  return v.AsRecordType();
+}
+template <> inline PMap &val_as<PMap &>(Value v) { return v.AsPMap(); }
+template <> inline PVector &val_as<PVector &>(Value v) {
+  return v.AsPVector();
+}
 template <> inline Value val_as<Value>(Value v) { return v; }
 
 inline Value car(Value v) { return v.AsCell().Car; }
@@ -105,7 +121,7 @@ template <typename... T> std::tuple<T...> uncons_rest(Value pair) {
  * Convert C++ function to Value(VM&,Value) function.
  *
  * Usage::
- *   Value f(VM &vm, vint_t arg0, const string &arg1);
+ *   Value f(VM &vm, vint_t arg0, string_view arg1);
  *
  *   std::functional<Value(VM&,Value)> proc = ProcCaller(f);
  *
@@ -141,15 +157,17 @@ template <typename T> Procedure *make_procedure(T func) {
 }
 
 template <typename T>
-void add_proc(VM &vm, bool is_macro, const char *id, T f) {
+Procedure *add_proc(VM &vm, bool is_macro, const char *id, T f) {
   auto *proc = make_procedure(f);
   proc->SetName(id);
   proc->SetIsMacro(is_macro);
+  proc->SetIsStable(true);
   vm.RootEnv().Define(vm.Intern(id), proc);
+  return proc;
 }
 
-void add_proc_varg(VM &vm, bool is_macro, const char *id,
-                   Value (*f)(Ctx &, Value));
+Procedure *add_proc_varg(VM &vm, bool is_macro, const char *id,
+                         Value (*f)(Ctx &, Value));
 
 /**
  * Iterator of cons list.
@@ -191,7 +209,7 @@ public:
 inline ListIterator begin(Value &v) { return ListIterator(v); }
 inline ListIterator end([[maybe_unused]] Value &v) { return ListIterator(); }
 
-template <typename T> T fold(Value list, std::function<T(T, T)> f) {
+template <typename T, typename F> T fold(Value list, F f) {
   Value head = car(list);
   Value rest = cdr(list);
   T r = val_as<T>(head);
@@ -201,8 +219,7 @@ template <typename T> T fold(Value list, std::function<T(T, T)> f) {
   return r;
 }
 
-template <typename T>
-T foldc(Value list, std::function<T(const T &, const T &)> f) {
+template <typename T, typename F> T foldc(Value list, F f) {
   Value head = car(list);
   Value rest = cdr(list);
   T r = val_as<const T &>(head);
@@ -212,9 +229,20 @@ T foldc(Value list, std::function<T(const T &, const T &)> f) {
   return r;
 }
 
-Value run(VM &vm, std::string_view src);
+/**
+ * Read and evaluate each form of `src`. If `file` is given, source
+ * locations are recorded. If `on_compile` is given, it's called with each
+ * compiled form before the form is executed. The first `skip` forms are only
+ * read.
+ */
+Value run(VM &vm, std::string_view src, std::string_view file = "",
+          const std::function<void(Value)> &on_compile = nullptr,
+          size_t skip = 0);
 Value run_file(VM &vm, std::string_view src);
 
+// lib_string.cpp
+Value string_concat(Value strs);
+
 // pretty_print.cpp
 const int PRETTY_PRINT_DEFAULT_LEN = 256;
 std::ostream &pretty_print(std::ostream &os, const VM &vm, Value v,
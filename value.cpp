@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
 
 #include "errors.hpp"
+#include "number.hpp"
+#include "persistent.hpp"
+#include "utf8.hpp"
 #include "util.hpp"
+#include "vector.hpp"
 #include "vm.hpp"
 
 namespace cxxlisp {
@@ -18,7 +23,9 @@ Value NIL;
 Value BOOL_T = Value::CreateSpecial("#t");
 Value BOOL_F = Value::CreateSpecial("#f");
 Value UNDEF = Value::CreateSpecial("#undef");
+Value ESCAPE = Value::CreateSpecial("#escape");
 
+Value SYM_BEGIN = Value::CreateSpecialForm(SpecialForm::BEGIN);
 Value SYM_QUOTE = Value::CreateSpecialForm(SpecialForm::QUOTE);
 Value SYM_QUASIQUOTE = Value::CreateSpecialForm(SpecialForm::QUASIQUOTE);
 Value SYM_UNQUOTE = Value::CreateSpecialForm(SpecialForm::UNQUOTE);
@@ -30,8 +37,11 @@ Value SYM_COND = Value::CreateSpecialForm(SpecialForm::COND);
 Value SYM_ELSE = Value::CreateSpecialForm(SpecialForm::ELSE);
 
 const char *VALUE_TYPE_NAMES[] = {
-    "NIL",  "SPECIAL", "NUMBER",    "ATOM",
-    "CELL", "STRING",  "PROCEDURE", "CUSTOM_OBJECT",
+    "NIL",            "SPECIAL",        "NUMBER",         "FLONUM",
+    "BIGNUM",         "ATOM",           "CHAR",           "CELL",
+    "STRING",         "STRING_BUILDER", "VECTOR",         "HASH_TABLE",
+    "RECORD_TYPE",    "RECORD",         "PMAP",           "PVECTOR",
+    "PROCEDURE",      "CUSTOM_OBJECT",
 };
 
 //===================================================================
@@ -50,13 +60,223 @@ bool operator==(const Value &a, const Value &b) {
   case ValueType::NIL:
     return true;
   case ValueType::STRING:
-    return a.AsString() == b.AsString();
+    return a.AsStringValue() == b.AsStringValue();
+  case ValueType::BIGNUM:
+    return a.AsBignum() == b.AsBignum();
   default:
     return a.i_ == b.i_;
   }
 }
 
-const string &Value::AsString() const {
+bool is_equal(const Value &a, const Value &b) {
+  Value x = a;
+  Value y = b;
+  // Loop on cdr to avoid deep recursion on long lists.
+  while (x.IsCell() && y.IsCell()) {
+    if (!is_equal(x.AsCell().Car, y.AsCell().Car)) {
+      return false;
+    }
+    x = x.AsCell().Cdr;
+    y = y.AsCell().Cdr;
+  }
+
+  if (x.IsVector() && y.IsVector()) {
+    Vector &vx = x.AsVector();
+    Vector &vy = y.AsVector();
+    if (vx.Type() != VectorType::VALUE || vy.Type() != VectorType::VALUE) {
+      return vx == vy;
+    }
+    if (vx.Size() != vy.Size()) {
+      return false;
+    }
+    for (size_t i = 0; i < vx.Size(); i++) {
+      if (!is_equal(vx.Ref(i), vy.Ref(i))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (x.IsPVector() && y.IsPVector()) {
+    PVector &vx = x.AsPVector();
+    PVector &vy = y.AsPVector();
+    if (vx.Size() != vy.Size()) {
+      return false;
+    }
+    for (size_t i = 0; i < vx.Size(); i++) {
+      if (!is_equal(vx.Ref(i), vy.Ref(i))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (x.IsPMap() && y.IsPMap()) {
+    PMap &mx = x.AsPMap();
+    PMap &my = y.AsPMap();
+    if (mx.Size() != my.Size()) {
+      return false;
+    }
+    bool r = true;
+    mx.Each([&](Value k, Value v) {
+      const Value *w = my.Find(k);
+      r = r && w && is_equal(v, *w);
+    });
+    return r;
+  }
+  return x == y;
+}
+
+// Finalizer of splitmix64.
+static uint64_t mix(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+static uint64_t combine(uint64_t h, uint64_t v) {
+  return mix(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+uint64_t hash_eq(const Value &v) {
+  switch (v.Type()) {
+  case ValueType::NIL:
+    return 0;
+  case ValueType::STRING:
+    return v.AsStringValue().Hash();
+  case ValueType::BIGNUM: {
+    const Bignum &b = v.AsBignum();
+    uint64_t h = b.IsNegative();
+    for (uint32_t limb : b.Limbs()) {
+      h = combine(h, limb);
+    }
+    return h;
+  }
+  default:
+    return mix(v.i_ ^ ((uint64_t)v.Type() << 56));
+  }
+}
+
+// Elements hashed by hash_equal() at most. Bounds the cost of hashing long
+// lists and cyclic structures.
+static const int HASH_EQUAL_LIMIT = 16;
+
+static uint64_t hash_equal_(Value v, int &budget) {
+  if (--budget < 0) {
+    return 0;
+  }
+  if (v.IsCell()) {
+    uint64_t h = (uint64_t)ValueType::CELL;
+    for (; v.IsCell() && budget > 0; v = v.AsCell().Cdr) {
+      h = combine(h, hash_equal_(v.AsCell().Car, budget));
+    }
+    return v.IsCell() ? h : combine(h, hash_equal_(v, budget));
+  } else if (v.IsVector() && v.AsVector().Type() == VectorType::VALUE) {
+    Vector &vec = v.AsVector();
+    uint64_t h = combine((uint64_t)ValueType::VECTOR, vec.Size());
+    for (size_t i = 0; i < vec.Size() && budget > 0; i++) {
+      h = combine(h, hash_equal_(vec.Ref(i), budget));
+    }
+    return h;
+  } else if (v.IsVector()) {
+    Vector &vec = v.AsVector();
+    uint64_t h = combine((uint64_t)vec.Type(), vec.Size());
+    for (size_t i = 0; i < vec.Size() && budget > 0; i++, budget--) {
+      h = combine(h, hash_eq(vec.Ref(i)));
+    }
+    return h;
+  } else if (v.IsPVector()) {
+    PVector &vec = v.AsPVector();
+    uint64_t h = combine((uint64_t)ValueType::PVECTOR, vec.Size());
+    for (size_t i = 0; i < vec.Size() && budget > 0; i++) {
+      h = combine(h, hash_equal_(vec.Ref(i), budget));
+    }
+    return h;
+  } else if (v.IsPMap()) {
+    // Entries are unordered, so only the size is hashed.
+    return combine((uint64_t)ValueType::PMAP, v.AsPMap().Size());
+  } else {
+    return hash_eq(v);
+  }
+}
+
+uint64_t hash_equal(const Value &v) {
+  int budget = HASH_EQUAL_LIMIT;
+  return hash_equal_(v, budget);
+}
+
+void StringValue::flatten() const {
+  std::string s;
+  s.reserve(size_);
+  Each([&s](string_view piece) { s += piece; });
+  v_ = std::move(s);
+  view_ = v_;
+  left_ = right_ = nullptr;
+}
+
+// Doesn't flatten a rope.
+void StringValue::index() const {
+  if (indexed_) {
+    return;
+  }
+  ascii_ = true;
+  length_ = 0;
+  Each([this](string_view piece) {
+    ascii_ = ascii_ && utf8_is_ascii(piece);
+    length_ += utf8_length(piece);
+  });
+  indexed_ = true;
+}
+
+const vector<size_t> &StringValue::breadcrumbs() const {
+  if (!breadcrumbs_) {
+    string_view s = Ref();
+    auto crumbs = make_unique<vector<size_t>>();
+    crumbs->reserve(Length() / BREADCRUMB_INTERVAL + 1);
+    size_t idx = 0;
+    for (size_t pos = 0; pos < s.size(); pos = utf8_next(s, pos), idx++) {
+      if (idx % BREADCRUMB_INTERVAL == 0) {
+        crumbs->push_back(pos);
+      }
+    }
+    breadcrumbs_ = std::move(crumbs);
+  }
+  return *breadcrumbs_;
+}
+
+size_t StringValue::ByteOffset(size_t idx) const {
+  assert(idx <= Length());
+  if (IsAscii()) {
+    return idx;
+  } else if (idx == length_) {
+    return size_;
+  }
+  string_view s = Ref();
+  size_t pos = breadcrumbs()[idx / BREADCRUMB_INTERVAL];
+  for (size_t i = 0; i < idx % BREADCRUMB_INTERVAL; i++) {
+    pos = utf8_next(s, pos);
+  }
+  return pos;
+}
+
+size_t StringValue::CharIndex(size_t pos) const {
+  assert(pos <= size_);
+  if (IsAscii()) {
+    return pos;
+  } else if (pos == size_) {
+    return length_;
+  }
+  string_view s = Ref();
+  auto &crumbs = breadcrumbs();
+  auto it = upper_bound(crumbs.begin(), crumbs.end(), pos) - 1;
+  size_t idx = (it - crumbs.begin()) * BREADCRUMB_INTERVAL;
+  for (size_t p = *it; p < pos; p = utf8_next(s, p)) {
+    idx++;
+  }
+  return idx;
+}
+
+string_view Value::AsString() const {
   chk(ValueType::STRING);
   return ref<StringValue>().Ref();
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <bit>
 #include <cassert>
 #include <cstdint>
 #include <functional>
@@ -6,6 +7,8 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "config.hpp"
 #include "errors.hpp"
@@ -13,21 +16,31 @@
 namespace cxxlisp {
 
 using atom_id_t = int;
-using vint_t = int;
+using vint_t = int64_t;
 
 class VM;
 struct Ctx;
 class CustomObject;
 class Cell;
 class StringValue;
+class StringBuilder;
 class Procedure;
+class Bignum;
+class Vector;
+class HashTable;
+class RecordType;
+class Record;
+class PMap;
+class PVector;
 class Value;
 
 extern Value NIL;
 extern Value BOOL_F;
 extern Value BOOL_T;
 extern Value UNDEF;
+extern Value ESCAPE;
 
+extern Value SYM_BEGIN;
 extern Value SYM_QUOTE;
 extern Value SYM_QUASIQUOTE;
 extern Value SYM_UNQUOTE;
@@ -56,13 +69,34 @@ public:
   const std::string &ToString();
 };
 
+/**
+ * Character, which is an immediate value.
+ */
+class Char {
+  char32_t code_;
+
+public:
+  explicit Char(char32_t code) : code_(code) {}
+  char32_t Code() const { return code_; }
+};
+
 enum class ValueType : uint8_t {
   NIL,
   SPECIAL,
   NUMBER,
+  FLONUM,
+  BIGNUM,
   ATOM,
+  CHAR,
   CELL,
   STRING,
+  STRING_BUILDER,
+  VECTOR,
+  HASH_TABLE,
+  RECORD_TYPE,
+  RECORD,
+  PMAP,
+  PVECTOR,
   PROCEDURE,
   CUSTOM_OBJECT,
 };
@@ -81,6 +115,10 @@ enum class SpecialForm {
   LET,
   COND,
   ELSE,
+  BLOCK,
+  RETURN_FROM,
+  RECORD_REF,
+  RECORD_SET,
   MAX,
 };
 
@@ -114,35 +152,84 @@ class Value {
 public:
   Value() : type_(ValueType::NIL) {}
   Value(int v) : type_(ValueType::NUMBER), i_(v) {}
+  Value(vint_t v) : type_(ValueType::NUMBER), i_(v) {}
+  Value(double v)
+      : type_(ValueType::FLONUM), i_(std::bit_cast<uintptr_t>(v)) {}
+  Value(Bignum *v) : type_(ValueType::BIGNUM), i_((uintptr_t)v) { assert(v); }
   Value(bool v) : Value(v ? BOOL_T : BOOL_F) {}
   Value(Atom v) : type_(ValueType::ATOM), i_(v.Id()) {}
+  Value(Char v) : type_(ValueType::CHAR), i_(v.Code()) {}
   Value(Cell *v) : type_(ValueType::CELL), i_((uintptr_t)v) { assert(v); }
   Value(const std::string &v);
   Value(const char *v) : Value(std::string(v)) { assert(v); }
+  Value(const StringValue *v) : type_(ValueType::STRING), i_((uintptr_t)v) {
+    assert(v);
+  }
+  Value(StringBuilder *v)
+      : type_(ValueType::STRING_BUILDER), i_((uintptr_t)v) {
+    assert(v);
+  }
   Value(Procedure *v) : type_(ValueType::PROCEDURE), i_((uintptr_t)v) {
     assert(v);
   }
+  Value(Vector *v) : type_(ValueType::VECTOR), i_((uintptr_t)v) { assert(v); }
+  Value(HashTable *v) : type_(ValueType::HASH_TABLE), i_((uintptr_t)v) {
+    assert(v);
+  }
+  Value(RecordType *v) : type_(ValueType::RECORD_TYPE), i_((uintptr_t)v) {
+    assert(v);
+  }
+  Value(Record *v) : type_(ValueType::RECORD), i_((uintptr_t)v) { assert(v); }
+  Value(PMap *v) : type_(ValueType::PMAP), i_((uintptr_t)v) { assert(v); }
+  Value(PVector *v) : type_(ValueType::PVECTOR), i_((uintptr_t)v) { assert(v); }
 
   ValueType Type() const { return type_; }
 
   bool IsNil() const { return type_ == ValueType::NIL; }
   bool IsSpecial() const { return type_ == ValueType::SPECIAL; }
   bool IsNumber() const { return type_ == ValueType::NUMBER; }
+  bool IsFlonum() const { return type_ == ValueType::FLONUM; }
+  bool IsBignum() const { return type_ == ValueType::BIGNUM; }
+  bool IsExactInteger() const { return IsNumber() || IsBignum(); }
+  bool IsNumeric() const { return IsExactInteger() || IsFlonum(); }
   bool IsAtom() const { return type_ == ValueType::ATOM; }
+  bool IsChar() const { return type_ == ValueType::CHAR; }
   bool IsCell() const { return type_ == ValueType::CELL; }
   bool IsString() const { return type_ == ValueType::STRING; }
+  bool IsStringBuilder() const { return type_ == ValueType::STRING_BUILDER; }
+  bool IsVector() const { return type_ == ValueType::VECTOR; }
+  bool IsHashTable() const { return type_ == ValueType::HASH_TABLE; }
+  bool IsRecordType() const { return type_ == ValueType::RECORD_TYPE; }
+  bool IsRecord() const { return type_ == ValueType::RECORD; }
+  bool IsPMap() const { return type_ == ValueType::PMAP; }
+  bool IsPVector() const { return type_ == ValueType::PVECTOR; }
   bool IsProcedure() const { return type_ == ValueType::PROCEDURE; }
   bool IsBoolean() const { return IsT() || IsF(); }
 
   bool IsT() const { return *this == BOOL_T; }
   bool IsF() const { return *this == BOOL_F; }
 
+  // Marker of non-local exit by break or return-from. See VM::Escape().
+  bool IsEscape() const {
+    return type_ == ValueType::SPECIAL && i_ == ESCAPE.i_;
+  }
+
   bool Truthy() const { return !Falsy(); }
   bool Falsy() const { return type_ == ValueType::NIL || IsF(); }
 
-  int AsNumber() const {
+  vint_t AsNumber() const {
     chk(ValueType::NUMBER);
-    return (int)i_;
+    return (vint_t)i_;
+  }
+
+  double AsFlonum() const {
+    chk(ValueType::FLONUM);
+    return std::bit_cast<double>(i_);
+  }
+
+  const Bignum &AsBignum() const {
+    chk(ValueType::BIGNUM);
+    return ref<Bignum>();
   }
 
   const std::string &AsSpecial() const {
@@ -155,16 +242,56 @@ public:
     return Atom((int)i_);
   }
 
+  Char AsChar() const {
+    chk(ValueType::CHAR);
+    return Char((char32_t)i_);
+  }
+
   Cell &AsCell() {
     chk(ValueType::CELL);
     return ref<Cell>();
   }
 
-  const StringValue &AsStringValue() {
+  const StringValue &AsStringValue() const {
     chk(ValueType::STRING);
     return ref<StringValue>();
   }
-  const std::string &AsString() const;
+  std::string_view AsString() const;
+
+  StringBuilder &AsStringBuilder() {
+    chk(ValueType::STRING_BUILDER);
+    return ref<StringBuilder>();
+  }
+
+  Vector &AsVector() {
+    chk(ValueType::VECTOR);
+    return ref<Vector>();
+  }
+
+  HashTable &AsHashTable() {
+    chk(ValueType::HASH_TABLE);
+    return ref<HashTable>();
+  }
+
+  RecordType &AsRecordType() {
+    chk(ValueType::RECORD_TYPE);
+    return ref<RecordType>();
+  }
+
+  Record &AsRecord() {
+    chk(ValueType::RECORD);
+    return ref<Record>();
+  }
+
+  PMap &AsPMap() {
+    chk(ValueType::PMAP);
+    return ref<PMap>();
+  }
+
+  PVector &AsPVector() {
+    chk(ValueType::PVECTOR);
+    return ref<PVector>();
+  }
 
   Procedure &AsProcedure() {
     chk(ValueType::PROCEDURE);
@@ -179,6 +306,7 @@ public:
   const std::string ToString(const VM *vm = nullptr) const;
   const std::string ToString(const VM &vm) const;
   friend bool operator==(const Value &, const Value &);
+  friend uint64_t hash_eq(const Value &);
 
   static Value CreateSpecial(std::string_view name) {
     return Value(ValueType::SPECIAL,
@@ -197,6 +325,30 @@ inline std::ostream &operator<<(std::ostream &s, const Value &value) {
 bool operator==(const Value &a, const Value &b);
 inline bool operator!=(const Value &a, const Value &b) { return !(a == b); }
 
+/**
+ * Structural equality of equal?.
+ */
+bool is_equal(const Value &a, const Value &b);
+
+// Hash functions consistent with operator== and is_equal().
+uint64_t hash_eq(const Value &v);
+uint64_t hash_equal(const Value &v);
+
+/**
+ * Kinds of objects counted by the allocation profiler. See AllocStats.
+ */
+enum class AllocKind : uint8_t { CELL, STRING, PROCEDURE, ENV, MAX };
+
+// Set while the allocation profiler is running.
+extern bool alloc_profiling;
+void record_alloc(AllocKind kind, size_t bytes);
+
+inline void count_alloc(AllocKind kind, size_t bytes) {
+  if (alloc_profiling) [[unlikely]] {
+    record_alloc(kind, bytes);
+  }
+}
+
 /**
  * Base class of lisp object.
  */
@@ -212,20 +364,145 @@ class Cell final : public gc, noncopyable {
 public:
   std::string str();
   Value Car, Cdr;
-  Cell() : Car(), Cdr() {}
-  Cell(Value car, Value cdr) : Car(car), Cdr(cdr) {}
+  Cell() : Car(), Cdr() { count_alloc(AllocKind::CELL, sizeof(Cell)); }
+  Cell(Value car, Value cdr) : Car(car), Cdr(cdr) {
+    count_alloc(AllocKind::CELL, sizeof(Cell));
+  }
 };
 
 /**
  * StringValue
+ *
+ * Strings are immutable, so the hash is computed on first use and cached.
+ * Interned strings (see VM::InternString()) are unique by content in their
+ * VM, so two of the same VM are equal only if they are the same object.
+ *
+ * A slice shares the bytes of its base string instead of copying them, and
+ * keeps the base alive.
+ *
+ * A rope is the concatenation of two strings. It is flattened on the first
+ * call of Ref(), but Each() visits its pieces without flattening.
+ *
+ * Strings are UTF-8. Characters are indexed by ByteOffset(), which is O(1)
+ * for ASCII strings. For others, the byte offset of every
+ * BREADCRUMB_INTERVAL-th character is recorded on first use, so it scans
+ * at most that many characters.
  */
 class StringValue final : public gc_cleanup, noncopyable {
-  std::string v_;
+  mutable std::string v_; // Empty if slice.
+  const StringValue *base_ = nullptr;
+  mutable const StringValue *left_ = nullptr, *right_ = nullptr;
+  mutable std::string_view view_;
+  size_t size_;
+  mutable uint64_t hash_ = 0;
+  mutable bool hashed_ = false;
+  const VM *internedBy_ = nullptr;
+
+  // Character index, built by index() and breadcrumbs().
+  mutable bool indexed_ = false;
+  mutable bool ascii_ = false;
+  mutable size_t length_ = 0;
+  mutable std::unique_ptr<std::vector<size_t>> breadcrumbs_;
+
+  void flatten() const;
+  void index() const;
+  const std::vector<size_t> &breadcrumbs() const;
 
 public:
-  StringValue(const std::string &v) : v_(v) {}
-  std::string str() const { return v_; };
-  const std::string &Ref() const { return v_; };
+  explicit StringValue(const std::string &v)
+      : v_(v), view_(v_), size_(v_.size()) {
+    count_alloc(AllocKind::STRING, sizeof(StringValue) + size_);
+  }
+  explicit StringValue(std::string &&v)
+      : v_(std::move(v)), view_(v_), size_(v_.size()) {
+    count_alloc(AllocKind::STRING, sizeof(StringValue) + size_);
+  }
+  StringValue(const StringValue *base, size_t pos, size_t len)
+      : base_(base->base_ ? base->base_ : base),
+        view_(base->Ref().substr(pos, len)), size_(view_.size()) {
+    count_alloc(AllocKind::STRING, sizeof(StringValue));
+  }
+  StringValue(const StringValue *left, const StringValue *right)
+      : left_(left), right_(right), size_(left->size_ + right->size_) {
+    count_alloc(AllocKind::STRING, sizeof(StringValue));
+  }
+  std::string str() const { return std::string(Ref()); };
+  std::string_view Ref() const {
+    if (left_) {
+      flatten();
+    }
+    return view_;
+  };
+  static const size_t BREADCRUMB_INTERVAL = 64;
+
+  // Size in bytes.
+  size_t Size() const { return size_; }
+
+  // Number of characters.
+  size_t Length() const {
+    index();
+    return length_;
+  }
+
+  bool IsAscii() const {
+    index();
+    return ascii_;
+  }
+
+  // Byte offset of `idx`-th character. `idx` may be Length().
+  size_t ByteOffset(size_t idx) const;
+
+  // Character index of the character at byte offset `pos`.
+  size_t CharIndex(size_t pos) const;
+
+  bool IsSlice() const { return base_ != nullptr; }
+  bool IsRope() const { return left_ != nullptr; }
+
+  // Strings this refers to: the base of a slice, or the halves of a rope.
+  const StringValue *Base() const { return base_; }
+  const StringValue *Left() const { return left_; }
+  const StringValue *Right() const { return right_; }
+
+  /**
+   * Calls `f(std::string_view)` for each piece of the string in order.
+   */
+  template <typename F> void Each(F f) const {
+    std::vector<const StringValue *> stack{this};
+    while (!stack.empty()) {
+      const StringValue *s = stack.back();
+      stack.pop_back();
+      if (s->left_) {
+        stack.push_back(s->right_);
+        stack.push_back(s->left_);
+      } else if (!s->view_.empty()) {
+        f(s->view_);
+      }
+    }
+  }
+
+  uint64_t Hash() const {
+    if (!hashed_) {
+      hash_ = std::hash<std::string_view>()(Ref());
+      hashed_ = true;
+    }
+    return hash_;
+  }
+
+  bool IsInterned() const { return internedBy_; }
+  void SetInterned(const VM *vm) { internedBy_ = vm; }
+
+  friend bool operator==(const StringValue &a, const StringValue &b) {
+    if (&a == &b) {
+      return true;
+    } else if (a.internedBy_ && a.internedBy_ == b.internedBy_) {
+      return false;
+    } else if (a.size_ != b.size_) {
+      return false;
+    } else if (a.hashed_ && b.hashed_ && a.hash_ != b.hash_) {
+      return false;
+    }
+    return a.Ref() == b.Ref();
+  }
 };
 
 inline void spread(int n, Value *vals, Value head) {
@@ -247,14 +524,21 @@ class Procedure : public gc_cleanup, noncopyable {
   Value params_;
   Value body_;
   bool isMacro_ = false;
+  bool isPure_ = false;
+  bool isStable_ = false;
+  Value intrinsic_;
 
   std::string name_;
 
 public:
   Procedure(int arity, func_t func)
-      : isNative_(true), arity_(arity), func_(func) {}
+      : isNative_(true), arity_(arity), func_(func) {
+    count_alloc(AllocKind::PROCEDURE, sizeof(Procedure));
+  }
   Procedure(Value params, Value body)
-      : isNative_(false), params_(params), body_(body) {}
+      : isNative_(false), params_(params), body_(body) {
+    count_alloc(AllocKind::PROCEDURE, sizeof(Procedure));
+  }
 
   bool IsNative() const { return isNative_; }
   int Arity() const { return arity_; }
@@ -265,6 +549,28 @@ public:
   void SetName(std::string_view v) { name_ = v; }
   bool IsMacro() const { return isMacro_; }
   void SetIsMacro(bool v) { isMacro_ = v; }
+
+  /**
+   * Pure procedure has no side effect and returns the same value for the same
+   * arguments, so the optimizer can fold it when the arguments are constant.
+   */
+  bool IsPure() const { return isPure_; }
+  void SetIsPure(bool v) { isPure_ = v; }
+
+  /**
+   * Stable procedure is never redefined, so the optimizer can resolve and
+   * inline it at compile time.
+   */
+  bool IsStable() const { return isStable_; }
+  void SetIsStable(bool v) { isStable_ = v; }
+
+  /**
+   * Head of a special form which does the same as this procedure, such as
+   * (%record-ref type index). When the procedure is stable, the optimizer
+   * replaces a call (f args...) with (head... args...).
+   */
+  Value Intrinsic() const { return intrinsic_; }
+  void SetIntrinsic(Value v) { intrinsic_ = v; }
 };
 
 } // namespace cxxlisp
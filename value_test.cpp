@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include <string>
 
+#include "number.hpp"
+#include "persistent.hpp"
 #include "util.hpp"
 #include "value.hpp"
 #include "vm.hpp"
@@ -43,6 +45,37 @@ TEST(ValueTest, String) {
   EXPECT_EQ("hoge", Value("hoge").AsString());
 }
 
+TEST(ValueTest, StringHash) {
+  Value a("hoge");
+  Value b("hoge");
+  EXPECT_EQ(hash_eq(a), hash_eq(b));
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, Value("fuga"));
+  EXPECT_NE(a, Value("hoge!"));
+}
+
+TEST(ValueTest, StringUtf8) {
+  // 200 characters of mixed 1, 2 and 3 bytes.
+  string s;
+  for (int i = 0; i < 50; i++) {
+    s += "aé日b";
+  }
+  StringValue str(s);
+  EXPECT_FALSE(str.IsAscii());
+  EXPECT_EQ(200, str.Length());
+  EXPECT_EQ(350, str.Size());
+  const size_t offsets[] = {0, 1, 3, 6};
+  for (size_t i = 0; i <= str.Length(); i++) {
+    size_t pos = str.ByteOffset(i);
+    EXPECT_EQ(i / 4 * 7 + offsets[i % 4], pos);
+    EXPECT_EQ(i, str.CharIndex(pos));
+  }
+
+  StringValue ascii("abc");
+  EXPECT_TRUE(ascii.IsAscii());
+  EXPECT_EQ(2, ascii.ByteOffset(2));
+}
+
 static Value func0(Ctx &ctx) { return 0; }
 static Value func1(Ctx &ctx, vint_t arg1) { return arg1; }
 
@@ -59,3 +92,103 @@ TEST(ValueTest, Procedure) {
   EXPECT_EQ(1, proc1->Arity());
   EXPECT_EQ(1, proc1->Func()(ctx, cons(1, NIL)));
 }
+
+TEST(ValueTest, Bignum) {
+  VM vm;
+  // Operands large enough to use Karatsuba multiplication.
+  run(vm, "(define a (+ (expt 7 1500) 12345))");
+  Value r = run(vm, "(define b (- (expt 3 2000) 1)) (define c (* a b))"
+                    "(list (= a (quotient c b)) (remainder (+ c 5) b)"
+                    "      (= c (* b a)) (- (quotient c a) b))");
+  EXPECT_EQ("(#t 5 #t 0)", r.ToString());
+
+  Value v;
+  EXPECT_TRUE(parse_number("123456789012345678901234567890", v));
+  EXPECT_TRUE(v.IsBignum());
+  EXPECT_EQ("123456789012345678901234567890", number_to_string(v));
+  EXPECT_TRUE(parse_number("-9223372036854775808", v));
+  EXPECT_TRUE(v.IsNumber());
+  EXPECT_FALSE(parse_number("1.", v));
+  EXPECT_FALSE(parse_number("abc", v));
+}
+
+TEST(ValueTest, PMap) {
+  const int N = 5000;
+  PMap *m = PMap::Empty();
+  vector<PMap *> versions;
+  for (int i = 0; i < N; i++) {
+    versions.push_back(m);
+    m = m->Set(i, i * 2);
+  }
+  EXPECT_EQ(N, m->Size());
+  for (int i = 0; i < N; i++) {
+    ASSERT_TRUE(m->Find(i));
+    EXPECT_EQ(i * 2, *m->Find(i));
+  }
+  // Old versions are not changed.
+  EXPECT_EQ(100, versions[100]->Size());
+  EXPECT_FALSE(versions[100]->Find(100));
+  EXPECT_EQ(198, *versions[100]->Find(99));
+
+  // Keys are compared by equal?.
+  m = m->Set(list(1, "a"), 1);
+  EXPECT_EQ(1, *m->Find(list(1, "a")));
+
+  PMap *t = m->Transient();
+  for (int i = 0; i < N; i += 2) {
+    t->DeleteInPlace(i);
+  }
+  t->Persistent();
+  EXPECT_EQ(N / 2 + 1, t->Size());
+  EXPECT_FALSE(t->Find(0));
+  EXPECT_EQ(2, *t->Find(1));
+  EXPECT_EQ(N + 1, m->Size());
+  EXPECT_THROW(t->SetInPlace(1, 1), LispException);
+
+  for (int i = 1; i < N; i += 2) {
+    t = t->Delete(i);
+  }
+  EXPECT_EQ(1, t->Size());
+  EXPECT_EQ(t, t->Delete(-1));
+}
+
+TEST(ValueTest, PVector) {
+  // Over 32 * 32 * 32 elements, so the trie has three levels.
+  const int N = 33000;
+  PVector *v = PVector::Empty()->Transient();
+  for (int i = 0; i < N; i++) {
+    v->PushInPlace(i);
+  }
+  v->Persistent();
+  EXPECT_EQ(N, v->Size());
+  for (int i = 0; i < N; i += 7) {
+    EXPECT_EQ(i, v->Ref(i));
+  }
+
+  PVector *w = v->Set(1000, -1)->Set(N - 1, -2);
+  EXPECT_EQ(-1, w->Ref(1000));
+  EXPECT_EQ(-2, w->Ref(N - 1));
+  EXPECT_EQ(1000, v->Ref(1000));
+  EXPECT_THROW(v->Ref(N), LispException);
+
+  // Pop down to empty across the trie levels.
+  PVector *p = v;
+  for (int i = N - 1; i >= 0; i--) {
+    if (i % 97 == 0 || i < 40) {
+      ASSERT_EQ(i, p->Ref(i));
+      ASSERT_EQ(0, p->Ref(0));
+    }
+    p = p->Pop();
+    ASSERT_EQ(i, p->Size());
+  }
+  EXPECT_THROW(p->Pop(), LispException);
+  EXPECT_EQ(N - 1, v->Ref(N - 1));
+
+  PVector *q = PVector::Empty();
+  for (int i = 0; i < 2000; i++) {
+    q = q->Push(i);
+  }
+  for (int i = 0; i < 2000; i += 3) {
+    EXPECT_EQ(i, q->Ref(i));
+  }
+}
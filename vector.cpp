@@ -0,0 +1,328 @@
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <type_traits>
+
+#include "number.hpp"
+#include "util.hpp"
+#include "vector.hpp"
+
+namespace cxxlisp {
+
+using namespace std;
+
+//===================================================================
+// Vector
+//===================================================================
+
+static const char *VECTOR_TYPE_NAMES[] = {"value", "u8", "i32", "i64", "f64"};
+
+const char *vector_type_name(VectorType type) {
+  return VECTOR_TYPE_NAMES[(int)type];
+}
+
+VectorType vector_type_from_name(const string &name) {
+  for (int i = 0; i <= (int)VectorType::F64; i++) {
+    if (name == VECTOR_TYPE_NAMES[i]) {
+      return (VectorType)i;
+    }
+  }
+  throw LispException("Unknown vector type '" + name + "'.");
+}
+
+/**
+ * Convert `v` to element type T. Throw LispException if it doesn't fit.
+ */
+template <typename T> static T to_elem(Value v) {
+  if constexpr (is_same_v<T, Value>) {
+    return v;
+  } else if constexpr (is_same_v<T, double>) {
+    return to_double(v);
+  } else {
+    if (v.IsNumber() && v.AsNumber() >= numeric_limits<T>::min() &&
+        v.AsNumber() <= numeric_limits<T>::max()) {
+      return (T)v.AsNumber();
+    }
+    stringstream s;
+    s << "Can't store " << v << " in vector of "
+      << (sizeof(T) == 1 ? "u8" : sizeof(T) == 4 ? "i32" : "i64") << ".";
+    throw LispException(s.str());
+  }
+}
+
+template <typename T> static Value from_elem(T x) {
+  if constexpr (is_same_v<T, Value>) {
+    return x;
+  } else if constexpr (is_same_v<T, double>) {
+    return x;
+  } else {
+    return (vint_t)x;
+  }
+}
+
+Vector::Vector(VectorType type, size_t size, Value fill) {
+  switch (type) {
+  case VectorType::VALUE:
+    v_.emplace<vector<Value>>(size, fill);
+    break;
+  case VectorType::U8:
+    v_.emplace<vector<uint8_t>>(size, to_elem<uint8_t>(fill));
+    break;
+  case VectorType::I32:
+    v_.emplace<vector<int32_t>>(size, to_elem<int32_t>(fill));
+    break;
+  case VectorType::I64:
+    v_.emplace<vector<int64_t>>(size, to_elem<int64_t>(fill));
+    break;
+  case VectorType::F64:
+    v_.emplace<vector<double>>(size, to_elem<double>(fill));
+    break;
+  }
+}
+
+size_t Vector::Size() const {
+  return visit([](auto &v) { return v.size(); }, v_);
+}
+
+static void check_index(vint_t idx, size_t size) {
+  if (idx < 0 || (size_t)idx >= size) {
+    throw LispException("Index " + to_string(idx) + " out of range, size " +
+                        to_string(size) + ".");
+  }
+}
+
+Value Vector::Ref(vint_t idx) const {
+  return visit(
+      [idx](auto &v) {
+        check_index(idx, v.size());
+        return from_elem(v[idx]);
+      },
+      v_);
+}
+
+void Vector::Set(vint_t idx, Value x) {
+  visit(
+      [idx, x](auto &v) {
+        check_index(idx, v.size());
+        v[idx] = to_elem<typename decay_t<decltype(v)>::value_type>(x);
+      },
+      v_);
+}
+
+//===================================================================
+// SIMD kernels
+//
+// They use GCC/Clang vector extensions, which compile to SSE/AVX/NEON
+// instructions depending on the target. Integers are computed as unsigned
+// so that overflow wraps around instead of being undefined.
+//===================================================================
+
+// Width of a SIMD vector in bytes.
+static const size_t SIMD_BYTES = 32;
+
+// Number of accumulator lanes for reductions. Several independent lanes
+// hide the latency of add instructions.
+static const size_t ACC_LANES = 8;
+
+template <typename T> struct Arith {
+  using type = make_unsigned_t<T>;
+  using acc = uint64_t;
+};
+
+template <> struct Arith<double> {
+  using type = double;
+  using acc = double;
+};
+
+template <typename T>
+static void add_kernel(const T *a0, const T *b0, T *r0, size_t n) {
+  using U = typename Arith<T>::type;
+  typedef U vec_t __attribute__((vector_size(SIMD_BYTES)));
+  const size_t W = SIMD_BYTES / sizeof(U);
+
+  auto a = reinterpret_cast<const U *>(a0);
+  auto b = reinterpret_cast<const U *>(b0);
+  auto r = reinterpret_cast<U *>(r0);
+  size_t i = 0;
+  for (; i + W <= n; i += W) {
+    vec_t x, y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    x += y;
+    memcpy(r + i, &x, sizeof(x));
+  }
+  for (; i < n; i++) {
+    r[i] = a[i] + b[i];
+  }
+}
+
+template <typename T>
+static typename Arith<T>::acc sum_kernel(const T *a, size_t n) {
+  using Acc = typename Arith<T>::acc;
+  typedef T src_t __attribute__((vector_size(ACC_LANES * sizeof(T))));
+  typedef Acc acc_t __attribute__((vector_size(ACC_LANES * sizeof(Acc))));
+
+  acc_t acc = {};
+  size_t i = 0;
+  for (; i + ACC_LANES <= n; i += ACC_LANES) {
+    src_t x;
+    memcpy(&x, a + i, sizeof(x));
+    acc += __builtin_convertvector(x, acc_t);
+  }
+  Acc r = 0;
+  for (size_t j = 0; j < ACC_LANES; j++) {
+    r += acc[j];
+  }
+  for (; i < n; i++) {
+    r += (Acc)a[i];
+  }
+  return r;
+}
+
+template <typename T>
+static typename Arith<T>::acc dot_kernel(const T *a, const T *b, size_t n) {
+  using Acc = typename Arith<T>::acc;
+  typedef T src_t __attribute__((vector_size(ACC_LANES * sizeof(T))));
+  typedef Acc acc_t __attribute__((vector_size(ACC_LANES * sizeof(Acc))));
+
+  acc_t acc = {};
+  size_t i = 0;
+  for (; i + ACC_LANES <= n; i += ACC_LANES) {
+    src_t x, y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    acc += __builtin_convertvector(x, acc_t) * __builtin_convertvector(y, acc_t);
+  }
+  Acc r = 0;
+  for (size_t j = 0; j < ACC_LANES; j++) {
+    r += acc[j];
+  }
+  for (; i < n; i++) {
+    r += (Acc)a[i] * (Acc)b[i];
+  }
+  return r;
+}
+
+// Sum of an i64 vector, or dot product of an i32 or i64 vector, may
+// overflow the 64-bit accumulator. Then these scalar kernels are used,
+// which continue with bignums from the first overflow.
+
+template <typename T> static Value checked_sum(const T *a, size_t n) {
+  vint_t r = 0;
+  for (size_t i = 0; i < n; i++) {
+    vint_t x;
+    if (__builtin_add_overflow(r, (vint_t)a[i], &x)) {
+      Value big = r;
+      for (; i < n; i++) {
+        big = num_add(big, (vint_t)a[i]);
+      }
+      return big;
+    }
+    r = x;
+  }
+  return r;
+}
+
+template <typename T>
+static Value checked_dot(const T *a, const T *b, size_t n) {
+  vint_t r = 0;
+  for (size_t i = 0; i < n; i++) {
+    vint_t p, x;
+    if (__builtin_mul_overflow((vint_t)a[i], (vint_t)b[i], &p) ||
+        __builtin_add_overflow(r, p, &x)) {
+      Value big = r;
+      for (; i < n; i++) {
+        big = num_add(big, num_mul((vint_t)a[i], (vint_t)b[i]));
+      }
+      return big;
+    }
+    r = x;
+  }
+  return r;
+}
+
+template <typename Acc> static Value acc_to_value(Acc r) {
+  if constexpr (is_same_v<Acc, double>) {
+    return r;
+  } else {
+    return (vint_t)r;
+  }
+}
+
+//===================================================================
+// Bulk operations
+//===================================================================
+
+static void check_same_shape(const Vector &a, const Vector &b) {
+  if (a.Type() != b.Type()) {
+    throw LispException("Vector type mismatch, "s + vector_type_name(a.Type()) +
+                        " and " + vector_type_name(b.Type()) + ".");
+  }
+  if (a.Size() != b.Size()) {
+    throw LispException("Vector size mismatch, " + to_string(a.Size()) +
+                        " and " + to_string(b.Size()) + ".");
+  }
+}
+
+Vector *vector_add(const Vector &a, const Vector &b) {
+  check_same_shape(a, b);
+  auto r = new Vector(a.Type(), a.Size(), 0);
+  visit(
+      [&](auto &rv) {
+        using T = typename decay_t<decltype(rv)>::value_type;
+        auto &av = get<vector<T>>(a.Storage());
+        auto &bv = get<vector<T>>(b.Storage());
+        if constexpr (is_same_v<T, Value>) {
+          for (size_t i = 0; i < rv.size(); i++) {
+            rv[i] = num_add(av[i], bv[i]);
+          }
+        } else {
+          add_kernel(av.data(), bv.data(), rv.data(), rv.size());
+        }
+      },
+      r->Storage());
+  return r;
+}
+
+Value vector_sum(const Vector &v) {
+  return visit(
+      [](auto &vv) -> Value {
+        using T = typename decay_t<decltype(vv)>::value_type;
+        if constexpr (is_same_v<T, Value>) {
+          Value r = 0;
+          for (auto x : vv) {
+            r = num_add(r, x);
+          }
+          return r;
+        } else if constexpr (is_same_v<T, int64_t>) {
+          return checked_sum(vv.data(), vv.size());
+        } else {
+          return acc_to_value(sum_kernel(vv.data(), vv.size()));
+        }
+      },
+      v.Storage());
+}
+
+Value vector_dot(const Vector &a, const Vector &b) {
+  check_same_shape(a, b);
+  return visit(
+      [&](auto &av) -> Value {
+        using T = typename decay_t<decltype(av)>::value_type;
+        auto &bv = get<vector<T>>(b.Storage());
+        if constexpr (is_same_v<T, Value>) {
+          Value r = 0;
+          for (size_t i = 0; i < av.size(); i++) {
+            r = num_add(r, num_mul(av[i], bv[i]));
+          }
+          return r;
+        } else if constexpr (is_same_v<T, int32_t> ||
+                             is_same_v<T, int64_t>) {
+          return checked_dot(av.data(), bv.data(), av.size());
+        } else {
+          return acc_to_value(dot_kernel(av.data(), bv.data(), av.size()));
+        }
+      },
+      a.Storage());
+}
+
+} // namespace cxxlisp
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+#include "value.hpp"
+
+namespace cxxlisp {
+
+/**
+ * Element type of Vector.
+ *
+ * The order must be same as the alternatives of Vector::storage_t.
+ */
+enum class VectorType : uint8_t {
+  VALUE,
+  U8,
+  I32,
+  I64,
+  F64,
+};
+
+/**
+ * Homogeneous vector.
+ *
+ * Numeric elements are stored unboxed in a contiguous array, so bulk
+ * operations below can run on SIMD registers.
+ */
+class Vector final : public gc_cleanup, noncopyable {
+public:
+  using storage_t =
+      std::variant<std::vector<Value>, std::vector<uint8_t>,
+                   std::vector<int32_t>, std::vector<int64_t>,
+                   std::vector<double>>;
+
+private:
+  storage_t v_;
+
+public:
+  Vector(VectorType type, size_t size, Value fill);
+
+  VectorType Type() const { return (VectorType)v_.index(); }
+  size_t Size() const;
+  storage_t &Storage() { return v_; }
+  const storage_t &Storage() const { return v_; }
+
+  Value Ref(vint_t idx) const;
+  void Set(vint_t idx, Value v);
+
+  friend bool operator==(const Vector &a, const Vector &b) {
+    return a.v_ == b.v_;
+  }
+};
+
+const char *vector_type_name(VectorType type);
+
+/**
+ * Parse element type name such as "i32". Throw LispException if unknown.
+ */
+VectorType vector_type_from_name(const std::string &name);
+
+// Bulk operations.
+//
+// Both vectors must have the same type and size. Integer elements of
+// vector_add wrap around like C. Sums and dot products are accumulated in
+// 64 bits, and become bignums when that overflows.
+Vector *vector_add(const Vector &a, const Vector &b);
+Value vector_sum(const Vector &v);
+Value vector_dot(const Vector &a, const Vector &b);
+
+} // namespace cxxlisp
@@ -1,4 +1,8 @@
+#include <algorithm>
+
 #include "vm.hpp"
+#include "record.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
 namespace cxxlisp {
@@ -9,14 +13,25 @@ using namespace std;
 // Env
 //===================================================================
 
+// Only the root environment is observed, to keep Env small.
+EnvObserver *Env::observer() const {
+  return upper_ ? nullptr : vm_->RootEnvObserver();
+}
+
 bool Env::Get(Atom id, Value &result) const {
   auto it = map_.find(id.Id());
   if (it != map_.end()) {
+    if (EnvObserver *o = observer()) [[unlikely]] {
+      o->OnRead(id);
+    }
     result = it->second;
     return true;
   } else if (upper_) {
     return upper_->Get(id, result);
   } else {
+    if (EnvObserver *o = observer()) [[unlikely]] {
+      o->OnRead(id);
+    }
     return false;
   }
 }
@@ -30,11 +45,19 @@ Value Env::GetOr(Atom id, Value default_) const {
   }
 }
 
-void Env::Define(Atom id, Value v) { map_[id.Id()] = v; }
+void Env::Define(Atom id, Value v) {
+  if (EnvObserver *o = observer()) [[unlikely]] {
+    o->OnWrite(id);
+  }
+  map_[id.Id()] = v;
+}
 
 bool Env::Set(Atom id, Value v) {
   auto it = map_.find(id.Id());
   if (it != map_.end()) {
+    if (EnvObserver *o = observer()) [[unlikely]] {
+      o->OnWrite(id);
+    }
     map_[id.Id()] = v;
     return true;
   } else if (upper_) {
@@ -72,7 +95,7 @@ Value Compiler::doDefine(Ctx &ctx, Value rest) {
 
 Value Compiler::doSet(Ctx &ctx, Value rest) {
   auto [name, value] = uncons<Atom, Value>(rest);
-  return list(name, value);
+  return list(name, doValue(ctx, value));
 }
 
 Value Compiler::doIf(Ctx &ctx, Value rest) {
@@ -80,7 +103,7 @@ Value Compiler::doIf(Ctx &ctx, Value rest) {
   if (else_.IsNil()) {
     else_ = list(UNDEF);
   }
-  return cons(doValue(ctx, cond), doValue(ctx, then), else_);
+  return cons(doValue(ctx, cond), doValue(ctx, then), doBegin(ctx, else_));
 }
 
 Value Compiler::doQuote(Ctx &ctx, Value rest) { return car(rest); }
@@ -114,7 +137,10 @@ Value Compiler::doCond(Ctx &ctx, Value rest) {
 Value Compiler::doValue(Ctx &ctx, Value code, bool one) {
   switch (code.Type()) {
   case ValueType::CELL: {
-    return doForm(ctx, code, one);
+    // Rewritten forms, and code from macros, keep the location of `code`.
+    Value result = doForm(ctx, code, one);
+    ctx.vm->Sources().Inherit(code, result);
+    return result;
   }
   default:
     return code;
@@ -155,6 +181,13 @@ Value Compiler::doForm(Ctx &ctx, Value code, bool one) {
       return code;
     case SpecialForm::LOOP:
       return cons(head, doBegin(ctx, pair.Cdr));
+    case SpecialForm::BLOCK:
+    case SpecialForm::RETURN_FROM:
+      return cons(head, car(pair.Cdr), doBegin(ctx, cdr(pair.Cdr)));
+    case SpecialForm::RECORD_REF:
+    case SpecialForm::RECORD_SET:
+      return cons(head, car(pair.Cdr), car(cdr(pair.Cdr)),
+                  doBegin(ctx, cdr(cdr(pair.Cdr))));
     case SpecialForm::LET:
       return cons(head, doLet(ctx, pair.Cdr));
     case SpecialForm::COND:
@@ -164,7 +197,17 @@ Value Compiler::doForm(Ctx &ctx, Value code, bool one) {
       // Macro transform.
       if (ctx.vm->RootEnv().Get(atom, f) && f.IsProcedure()) {
         if (f.AsProcedure().IsMacro()) {
-          Value result = Eval().Call(ctx, f, cdr(code));
+          auto expand = [&] { return Eval().Call(ctx, f, cdr(code)); };
+          // A hit doesn't run the macro, so lookups of globals it depends
+          // on wouldn't be observed.
+          Value result =
+              ctx.vm->EnableMacroCache && !ctx.vm->RootEnvObserver()
+                  ? ctx.vm->Macros().Expand(atom, f, cdr(code), expand)
+                  : expand();
+          if (result.IsEscape()) {
+            ctx.vm->TakeEscapeValue();
+            throw LispException("Non-local exit from macro.");
+          }
           if (one) {
             return result;
           } else {
@@ -180,13 +223,27 @@ Value Compiler::doForm(Ctx &ctx, Value code, bool one) {
 
 Value Compiler::Compile(VM &vm, Value code) {
   Ctx ctx{&vm, &vm.RootEnv(), NIL};
+  size_t depth = vm.StackDepth();
+  // Globals looked up by macros and the optimizer decide the result, so the
+  // module cache observes them.
+  auto *observer = vm.ObserveRootEnv(vm.Modules().CompileObserver());
   Value result;
   try {
-    result = doValue(ctx, code);
+    {
+      TraceSpan span("lisp", "macro-expand");
+      result = doValue(ctx, code);
+    }
+    if (vm.EnableOptimize) {
+      TraceSpan span("lisp", "optimize");
+      result = Optimizer().Optimize(ctx, result);
+    }
   } catch (LispException &ex) {
+    vm.ObserveRootEnv(observer);
+    vm.UnwindStack(ex, depth);
     cout << ex.StackTrace();
     throw;
   }
+  vm.ObserveRootEnv(observer);
   return result;
 }
 
@@ -196,6 +253,128 @@ Value Compiler::ExpandOne(Ctx &ctx, Value code) {
   return doValue(ctx, code, true);
 }
 
+//===================================================================
+// MacroCache
+//===================================================================
+
+// Unlike hash_equal(), hashes the whole of `code`, which is finite.
+uint64_t MacroCache::hash(Value code) {
+  uint64_t h = 0;
+  for (; code.IsCell(); code = cdr(code)) {
+    h = h * 31 + hash(car(code));
+  }
+  return h * 31 + hash_equal(code);
+}
+
+bool MacroCache::isSame(Value old_proc, Value proc) {
+  Procedure &a = old_proc.AsProcedure();
+  Procedure &b = proc.AsProcedure();
+  return !a.IsNative() && !b.IsNative() && is_equal(a.Params(), b.Params()) &&
+         is_equal(a.Body(), b.Body());
+}
+
+// Call `f` with each cell of `code` in preorder, which is the same order for
+// equal `code`, until it returns false.
+template <typename F> static bool each_cell(Value code, F &f) {
+  for (; code.IsCell(); code = cdr(code)) {
+    if (!f(code) || !each_cell(car(code), f)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Value copy_tree(Value code) {
+  if (!code.IsCell()) {
+    return code;
+  }
+  return new Cell(copy_tree(car(code)), copy_tree(cdr(code)));
+}
+
+// Copy of `code`, except cells in `index`, which are added to `slots`.
+static Value make_template(Value code,
+                           const unordered_map<const Cell *, uint32_t> &index,
+                           vector<pair<uint32_t, const Cell *>> &slots) {
+  if (!code.IsCell()) {
+    return code;
+  }
+  auto it = index.find(&code.AsCell());
+  if (it != index.end()) {
+    slots.emplace_back(it->second, it->first);
+    return code;
+  }
+  return new Cell(make_template(car(code), index, slots),
+                  make_template(cdr(code), index, slots));
+}
+
+// Copy of `code`, with the cells in `slots` replaced by `cells`.
+static Value instantiate(Value code,
+                         const unordered_map<const Cell *, uint32_t> &slots,
+                         const vector<Value> &cells) {
+  if (!code.IsCell()) {
+    return code;
+  }
+  if (!slots.empty()) {
+    auto it = slots.find(&code.AsCell());
+    if (it != slots.end()) {
+      return cells[it->second];
+    }
+  }
+  return new Cell(instantiate(car(code), slots, cells),
+                  instantiate(cdr(code), slots, cells));
+}
+
+MacroCache::Entry MacroCache::makeEntry(Value args, Value expansion) {
+  unordered_map<const Cell *, uint32_t> index;
+  auto add = [&](Value cell) {
+    index.emplace(&cell.AsCell(), index.size());
+    return true;
+  };
+  each_cell(args, add);
+
+  vector<pair<uint32_t, const Cell *>> slots;
+  Entry entry{copy_tree(args), make_template(expansion, index, slots), {}, {}};
+  sort(slots.begin(), slots.end());
+  slots.erase(unique(slots.begin(), slots.end()), slots.end());
+  for (auto [pos, cell] : slots) {
+    entry.Slots.emplace(cell, entry.Positions.size());
+    entry.Positions.push_back(pos);
+  }
+  return entry;
+}
+
+bool MacroCache::find(const Macro &macro, uint64_t h, Value args,
+                      Value &result) const {
+  auto [begin, end] = macro.Entries.equal_range(h);
+  for (auto it = begin; it != end; ++it) {
+    const Entry &entry = it->second;
+    if (is_equal(entry.Args, args)) {
+      // Cells of `args` at the positions of the slots.
+      vector<Value> cells;
+      cells.reserve(entry.Positions.size());
+      uint32_t pos = 0;
+      auto add = [&](Value cell) {
+        if (cells.size() < entry.Positions.size() &&
+            entry.Positions[cells.size()] == pos++) {
+          cells.push_back(cell);
+        }
+        return cells.size() < entry.Positions.size();
+      };
+      if (!entry.Positions.empty()) {
+        each_cell(args, add);
+      }
+      result = instantiate(entry.Template, entry.Slots, cells);
+      return true;
+    }
+  }
+  return false;
+}
+
+void MacroCache::Clear() {
+  macros_.clear();
+  hits_ = misses_ = invalidations_ = 0;
+}
+
 //===================================================================
 // Eval
 //===================================================================
@@ -203,7 +382,7 @@ Value Compiler::ExpandOne(Ctx &ctx, Value code) {
 Value Eval::doBegin(Ctx &ctx, Value rest) {
   // cout << "run: " << car(rest) << endl;
   Value r = doValue(ctx, car(rest));
-  if (cdr(rest).IsNil()) {
+  if (cdr(rest).IsNil() || r.IsEscape()) {
     return r;
   } else {
     return doBegin(ctx, cdr(rest));
@@ -212,13 +391,21 @@ Value Eval::doBegin(Ctx &ctx, Value rest) {
 
 Value Eval::doDefine(Ctx &ctx, Value rest) {
   auto [name, val] = uncons<Atom, Value>(rest);
-  ctx.vm->RootEnv().Define(name, doValue(ctx, val));
+  Value v = doValue(ctx, val);
+  if (v.IsEscape()) {
+    return v;
+  }
+  ctx.vm->RootEnv().Define(name, v);
   return NIL;
 }
 
 Value Eval::doSet(Ctx &ctx, Value rest) {
   auto [name, val] = uncons<Atom, Value>(rest);
-  if (ctx.vm->RootEnv().Set(name, doValue(ctx, val))) {
+  Value v = doValue(ctx, val);
+  if (v.IsEscape()) {
+    return v;
+  }
+  if (ctx.vm->RootEnv().Set(name, v)) {
     return NIL;
   } else {
     throw LispException(string("Symbol '") + ctx.vm->AtomToString(name) +
@@ -229,7 +416,9 @@ Value Eval::doSet(Ctx &ctx, Value rest) {
 Value Eval::doIf(Ctx &ctx, Value rest) {
   auto [cond, then, else_] = uncons_rest<Value, Value, Value>(rest);
   Value v = doValue(ctx, cond);
-  if (v.Truthy()) {
+  if (v.IsEscape()) {
+    return v;
+  } else if (v.Truthy()) {
     return doValue(ctx, then);
   } else {
     return doBegin(ctx, else_);
@@ -243,30 +432,83 @@ Value Eval::doLambda(Ctx &ctx, Value rest) {
 }
 
 Value Eval::doLoop(Ctx &ctx, Value rest) {
-  try {
-    for (;;) {
-      doBegin(ctx, rest);
+  for (;;) {
+    Value r = doBegin(ctx, rest);
+    if (r.IsEscape()) {
+      if (ctx.vm->EscapeTag().IsNil()) {
+        return ctx.vm->TakeEscapeValue();
+      } else {
+        return r;
+      }
     }
-  } catch (BreakException &ex) {
-    return ex.Result();
   }
 }
 
-void Eval::doLetDecl(Ctx &ctx, Env &new_env, Value rest) {
+Value Eval::doBlock(Ctx &ctx, Value rest) {
+  Value r = doBegin(ctx, cdr(rest));
+  if (r.IsEscape() && ctx.vm->EscapeTag() == car(rest)) {
+    return ctx.vm->TakeEscapeValue();
+  } else {
+    return r;
+  }
+}
+
+Value Eval::doReturnFrom(Ctx &ctx, Value rest) {
+  auto [name, val] = uncons_rest<Atom, Value>(rest);
+  Value v = val.IsNil() ? UNDEF : doValue(ctx, car(val));
+  if (v.IsEscape()) {
+    return v;
+  }
+  return ctx.vm->Escape(name, v);
+}
+
+// (%record-ref type index expr)
+Value Eval::doRecordRef(Ctx &ctx, Value rest) {
+  auto [type, idx, expr] = uncons<Value, vint_t, Value>(rest);
+  Value v = doValue(ctx, expr);
+  if (v.IsEscape()) {
+    return v;
+  }
+  return check_record(v, type.AsRecordType()).Slot(idx);
+}
+
+// (%record-set! type index expr value)
+Value Eval::doRecordSet(Ctx &ctx, Value rest) {
+  auto [type, idx, expr, val] = uncons<Value, vint_t, Value, Value>(rest);
+  Value v = doValue(ctx, expr);
+  if (v.IsEscape()) {
+    return v;
+  }
+  Record &record = check_record(v, type.AsRecordType());
+  Value x = doValue(ctx, val);
+  if (x.IsEscape()) {
+    return x;
+  }
+  return record.Slot(idx) = x;
+}
+
+Value Eval::doLetDecl(Ctx &ctx, Env &new_env, Value rest) {
   if (rest.IsNil()) {
-    return;
+    return NIL;
   } else {
     auto [name, expr] = uncons<Atom, Value>(car(rest));
-    new_env.Define(name, doValue(ctx, expr));
+    Value v = doValue(ctx, expr);
+    if (v.IsEscape()) {
+      return v;
+    }
+    new_env.Define(name, v);
 
-    doLetDecl(ctx, new_env, cdr(rest));
+    return doLetDecl(ctx, new_env, cdr(rest));
   }
 }
 
 Value Eval::doLet(Ctx &ctx, Value rest) {
   Env *new_env = new Env(ctx.vm, ctx.env);
   Ctx new_ctx{ctx.vm, new_env, rest};
-  doLetDecl(ctx, *new_env, car(rest));
+  Value r = doLetDecl(ctx, *new_env, car(rest));
+  if (r.IsEscape()) {
+    return r;
+  }
   return doBegin(new_ctx, cdr(rest));
 }
 Value Eval::doCond(Ctx &ctx, Value rest) {
@@ -279,7 +521,9 @@ Value Eval::doCond(Ctx &ctx, Value rest) {
     return doBegin(ctx, cdr(head));
   } else {
     Value v = doValue(ctx, car(head));
-    if (v.Truthy()) {
+    if (v.IsEscape()) {
+      return v;
+    } else if (v.Truthy()) {
       return doBegin(ctx, cdr(head));
     } else {
       return doCond(ctx, cdr(rest));
@@ -315,11 +559,22 @@ Value Eval::doList(Ctx &ctx, Value code) {
       throw "`code` in doList() must be cell";
     }
   } else {
-    return new Cell(doValue(ctx, car(code)), doList(ctx, cdr(code)));
+    Value v = doValue(ctx, car(code));
+    if (v.IsEscape()) {
+      return v;
+    }
+    Value rest = doList(ctx, cdr(code));
+    if (rest.IsEscape()) {
+      return rest;
+    }
+    return new Cell(v, rest);
   }
 }
 
 Value Eval::doForm(Ctx &ctx, Value code) {
+  if (ctx.vm->EnableCoverage) [[unlikely]] {
+    ctx.vm->Cover().Hit(code);
+  }
   Cell &pair = code.AsCell();
   Value head = pair.Car;
   if (head.IsAtom()) {
@@ -337,6 +592,14 @@ Value Eval::doForm(Ctx &ctx, Value code) {
       return doQuote(ctx, pair.Cdr);
     case SpecialForm::LOOP:
       return doLoop(ctx, pair.Cdr);
+    case SpecialForm::BLOCK:
+      return doBlock(ctx, pair.Cdr);
+    case SpecialForm::RETURN_FROM:
+      return doReturnFrom(ctx, pair.Cdr);
+    case SpecialForm::RECORD_REF:
+      return doRecordRef(ctx, pair.Cdr);
+    case SpecialForm::RECORD_SET:
+      return doRecordSet(ctx, pair.Cdr);
     case SpecialForm::SET_EX:
       return doSet(ctx, pair.Cdr);
     case SpecialForm::LET:
@@ -348,20 +611,43 @@ Value Eval::doForm(Ctx &ctx, Value code) {
     }
   }
 
+  ctx.vm->PushFrame(code);
+  Value result = doValue(ctx, head);
+  if (!result.IsEscape()) {
+    Value args = doList(ctx, pair.Cdr);
+    result = args.IsEscape() ? args : call(ctx, result, args);
+  }
+  ctx.vm->PopFrame();
+  return result;
+}
+
+Value Eval::call(Ctx &ctx, Value proc, Value args) {
+  if (!ctx.vm->EnableCallStats) [[likely]] {
+    return invoke(ctx, proc, args);
+  }
+
+  CallStats &stats = ctx.vm->Stats();
+  stats.Enter(proc.AsProcedure());
+  Value result;
   try {
-    return call(ctx, doValue(ctx, head), doList(ctx, pair.Cdr));
-  } catch (LispException &ex) {
-    ex.Stack.push_back(code.ToString());
+    result = invoke(ctx, proc, args);
+  } catch (...) {
+    stats.Leave();
     throw;
   }
+  stats.Leave();
+  return result;
 }
 
-Value Eval::call(Ctx &ctx, Value proc_, Value args) {
+Value Eval::invoke(Ctx &ctx, Value proc_, Value args) {
   // cout << "call " << proc_ << " " << args << endl;
   auto &proc = proc_.AsProcedure();
+  sample(ctx, nullptr);
   if (proc.IsNative()) {
     // Call native procecure.
-    return proc.Func()(ctx, args);
+    Value result = proc.Func()(ctx, args);
+    sample(ctx, &proc);
+    return result;
   } else {
     // Call lisp procedure.
     Env *new_env = new Env(ctx.vm, ctx.env);
@@ -378,12 +664,15 @@ Value Eval::call(Ctx &ctx, Value proc_, Value args) {
       }
     }
 
-    Value result;
-    try {
-      result = doBegin(new_ctx, proc.Body());
-    } catch (LispException &ex) {
-      ex.Stack.push_back(proc_.ToString());
-      throw;
+    ctx.vm->PushFrame(proc_);
+    Value result = doBegin(new_ctx, proc.Body());
+    sample(ctx, nullptr);
+    ctx.vm->PopFrame();
+
+    // Catch return-from by procedure name.
+    if (result.IsEscape() && !proc.Name().empty() &&
+        ctx.vm->EscapeTag() == Value(ctx.vm->Intern(proc.Name()))) {
+      return ctx.vm->TakeEscapeValue();
     }
     return result;
   }
@@ -394,10 +683,22 @@ Value Eval::Call(Ctx &ctx, Value proc, Value args) {
 }
 
 Value Eval::Execute(Ctx &ctx, Value code) {
+  size_t depth = ctx.vm->StackDepth();
   Value result;
   try {
     result = doValue(ctx, code);
+    if (result.IsEscape()) {
+      Value tag = ctx.vm->EscapeTag();
+      ctx.vm->TakeEscapeValue();
+      if (tag.IsNil()) {
+        throw LispException("'break' out of loop.");
+      } else {
+        throw LispException("'return-from' to unknown block " +
+                            tag.ToString() + ".");
+      }
+    }
   } catch (LispException &ex) {
+    ctx.vm->UnwindStack(ex, depth);
     cout << ex.StackTrace();
     throw;
   }
@@ -417,9 +718,17 @@ void lib_core_init(VM &vm);
 void lib_number_init(VM &vm);
 void lib_list_init(VM &vm);
 void lib_string_init(VM &vm);
-
-VM::VM(bool init_core, bool init_func) : rootEnv_(this, nullptr) {
+void lib_char_init(VM &vm);
+void lib_vector_init(VM &vm);
+void lib_hash_table_init(VM &vm);
+void lib_record_init(VM &vm);
+void lib_persistent_init(VM &vm);
+void lib_profile_init(VM &vm);
+
+VM::VM(bool init_core, bool init_func, string_view module_cache_dir)
+    : rootEnv_(this, nullptr) {
   Default = this;
+  moduleCache_.SetDir(module_cache_dir);
 
   Intern("begin");
   Intern("define");
@@ -434,6 +743,10 @@ VM::VM(bool init_core, bool init_func) : rootEnv_(this, nullptr) {
   Intern("let");
   Intern("cond");
   Intern("else");
+  Intern("block");
+  Intern("return-from");
+  Intern("%record-ref");
+  Intern("%record-set!");
 
   assert(atomIdToKey_.size() == (size_t)SpecialForm::MAX);
 
@@ -442,6 +755,12 @@ VM::VM(bool init_core, bool init_func) : rootEnv_(this, nullptr) {
     lib_number_init(*this);
     lib_list_init(*this);
     lib_string_init(*this);
+    lib_char_init(*this);
+    lib_vector_init(*this);
+    lib_hash_table_init(*this);
+    lib_record_init(*this);
+    lib_persistent_init(*this);
+    lib_profile_init(*this);
     if (init_func) {
       run_file(*this, "lib/prelude.lisp");
     }
@@ -460,6 +779,29 @@ Atom VM::Intern(const char *v) {
   }
 }
 
+Value VM::InternString(string_view str) {
+  auto it = strings_.find(str);
+  if (it != strings_.end()) {
+    return it->second;
+  }
+  auto s = new StringValue(string(str));
+  s->SetInterned(this);
+  strings_.emplace(s->Ref(), s);
+  return s;
+}
+
+void VM::UnwindStack(LispException &ex, size_t depth) {
+  if (!ex.Stack) {
+    ex.Stack = make_shared<vector<Value>>();
+    ex.Locations = make_shared<vector<string>>();
+  }
+  for (size_t i = stack_.size(); i > depth; i--) {
+    ex.Stack->push_back(stack_[i - 1]);
+    ex.Locations->push_back(sources_.Describe(sources_.Find(stack_[i - 1])));
+  }
+  stack_.resize(depth);
+}
+
 VM *VM::Default = nullptr;
 
 } // namespace cxxlisp
@@ -3,6 +3,9 @@
 #include <vector>
 
 #include "config.hpp"
+#include "module_cache.hpp"
+#include "profiler.hpp"
+#include "source_map.hpp"
 #include "value.hpp"
 
 namespace cxxlisp {
@@ -17,19 +20,46 @@ struct Ctx : public noncopyable {
   Ctx(VM *v, Env *e, Value c) : vm(v), env(e), code(c) {}
 };
 
+/**
+ * Observer of names looked up and defined in an Env, see
+ * VM::ObserveRootEnv().
+ */
+class EnvObserver {
+public:
+  virtual ~EnvObserver() {}
+  virtual void OnRead(Atom id) = 0;
+  virtual void OnWrite(Atom id) = 0;
+};
+
 class Env : public gc_cleanup, noncopyable {
-  VM *vm_; // unused tempolary
+  VM *vm_; // For the observer of the root environment.
   Env *upper_;
   std::unordered_map<atom_id_t, Value> map_;
 
+  EnvObserver *observer() const;
+
 public:
-  Env(VM *vm, Env *upper) : vm_(vm), upper_(upper) {}
+  Env(VM *vm, Env *upper) : vm_(vm), upper_(upper) {
+    count_alloc(AllocKind::ENV, sizeof(Env));
+  }
   bool Get(Atom id, Value &result) const;
+
   Value GetOr(Atom id, Value default_ = NIL) const;
   void Define(Atom id, Value v);
   bool Set(Atom id, Value v);
 
   int Count() { return map_.size(); }
+
+  template <typename F> void Each(F f) const {
+    for (auto &[id, v] : map_) {
+      f(v);
+    }
+  }
+  template <typename F> void EachBinding(F f) const {
+    for (auto &[id, v] : map_) {
+      f(Atom(id), v);
+    }
+  }
 };
 
 /**
@@ -59,6 +89,118 @@ public:
   Value ExpandOne(Ctx &ctx, Value code);
 };
 
+/**
+ * Cache of macro expansions, keyed by the macro and the structure of the
+ * arguments of each use.
+ *
+ * Macros are assumed to be pure, so a use equal to an earlier one expands to
+ * the same code. A hit returns new cells, where the cells of the earlier
+ * arguments are replaced by the ones at the same place in the new use, so
+ * the expansion keeps their source locations, and changing it doesn't change
+ * the cache. Entries of a macro are dropped when its name is bound to another
+ * procedure, unless it has the same code, as when a file is loaded again.
+ */
+class MacroCache : noncopyable {
+  struct Entry {
+    Value Args;     // Copy of the arguments.
+    Value Template; // Copy of the expansion, with cells of the arguments.
+    std::unordered_map<const Cell *, uint32_t> Slots; // Cells of arguments.
+    std::vector<uint32_t> Positions; // Preorder index of each slot, sorted.
+  };
+  struct Macro {
+    Value Proc;
+    std::unordered_multimap<uint64_t, Entry> Entries;
+  };
+
+  std::unordered_map<atom_id_t, Macro> macros_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t invalidations_ = 0;
+
+public:
+  MacroCache() {}
+
+  /**
+   * Returns the expansion of the use of macro `proc` named `name` with
+   * `args`. Calls `expand()` on a miss, and caches its result unless it's an
+   * escape.
+   */
+  template <typename F>
+  Value Expand(Atom name, Value proc, Value args, F expand) {
+    Macro &macro = macros_[name.Id()];
+    if (!(macro.Proc == proc)) {
+      if (!macro.Entries.empty() && !isSame(macro.Proc, proc)) {
+        invalidations_++;
+        macro.Entries.clear();
+      }
+      macro.Proc = proc;
+    }
+    uint64_t h = hash(args);
+    Value result;
+    if (find(macro, h, args, result)) {
+      hits_++;
+      return result;
+    }
+    misses_++;
+    result = expand();
+    if (!result.IsEscape()) {
+      macro.Entries.emplace(h, makeEntry(args, result));
+    }
+    return result;
+  }
+
+  void Clear();
+
+  size_t Hits() const { return hits_; }
+  size_t Misses() const { return misses_; }
+  size_t Invalidations() const { return invalidations_; }
+
+private:
+  static uint64_t hash(Value code);
+  static bool isSame(Value old_proc, Value proc);
+  static Entry makeEntry(Value args, Value expansion);
+  bool find(const Macro &macro, uint64_t h, Value args, Value &result) const;
+};
+
+/**
+ * Optimizer.
+ *
+ * Simplify compiled code by constant folding, dead branch elimination,
+ * beta reduction and inlining of stable procedures.
+ */
+class Optimizer {
+  std::vector<atom_id_t> locals_;
+  int inlineDepth_ = 0;
+
+  bool isLocal(Atom atom) const;
+  void pushParams(Value params);
+  bool findProcedure(Ctx &ctx, Value head, Procedure *&result) const;
+  bool fold(Ctx &ctx, Value proc, Value args, Value &result);
+  bool inlineBody(Ctx &ctx, Value params, Value body, Value args,
+                  Value &result);
+  bool isTransparent(Ctx &ctx, Value code, Value params);
+
+  Value doBody(Ctx &ctx, Value body);
+  Value doBegin(Ctx &ctx, Value code);
+  Value doIf(Ctx &ctx, Value code);
+  Value doLambda(Ctx &ctx, Value code);
+  Value doLet(Ctx &ctx, Value code);
+  Value doCondClause(Ctx &ctx, Value rest);
+  Value doCond(Ctx &ctx, Value code);
+  Value doCall(Ctx &ctx, Value code);
+
+  Value doValue(Ctx &ctx, Value code);
+  Value doList(Ctx &ctx, Value code);
+  Value doForm(Ctx &ctx, Value code);
+
+public:
+  static const int INLINE_MAX_SIZE = 32;
+  static const int INLINE_MAX_DEPTH = 8;
+
+  Optimizer() {}
+  Value Optimize(Ctx &ctx, Value code);
+};
+
 class Eval {
   Value doBegin(Ctx &ctx, Value rest);
   Value doDefine(Ctx &ctx, Value rest);
@@ -67,7 +209,11 @@ class Eval {
   Value doQuote(Ctx &ctx, Value rest);
   Value doLambda(Ctx &ctx, Value rest);
   Value doLoop(Ctx &ctx, Value rest);
-  void doLetDecl(Ctx &ctx, Env &new_env, Value rest);
+  Value doBlock(Ctx &ctx, Value rest);
+  Value doReturnFrom(Ctx &ctx, Value rest);
+  Value doRecordRef(Ctx &ctx, Value rest);
+  Value doRecordSet(Ctx &ctx, Value rest);
+  Value doLetDecl(Ctx &ctx, Env &new_env, Value rest);
   Value doLet(Ctx &ctx, Value rest);
   Value doCond(Ctx &ctx, Value rest);
 
@@ -75,6 +221,9 @@ class Eval {
   Value doList(Ctx &ctx, Value code);
   Value doForm(Ctx &ctx, Value code);
   Value call(Ctx &ctx, Value proc, Value args);
+  Value invoke(Ctx &ctx, Value proc, Value args);
+
+  void sample(Ctx &ctx, const Procedure *leaf);
 
 public:
   Eval(){};
@@ -91,16 +240,36 @@ public:
 class VM : public noncopyable {
   std::unordered_map<std::string, Atom> atomKeyToId_;
   std::vector<std::string> atomIdToKey_;
+  std::unordered_map<std::string_view, StringValue *> strings_;
   Env rootEnv_;
+  Value escapeTag_;
+  Value escapeValue_;
+  std::vector<Value> stack_;
+  Profiler profiler_;
+  CallStats callStats_;
+  AllocStats allocStats_;
+  Coverage coverage_;
+  SourceMap sources_;
+  MacroCache macroCache_;
+  ModuleCache moduleCache_;
+  EnvObserver *rootEnvObserver_ = nullptr;
 
 public:
   bool EnableStackTrace = true;
   bool EnableTrace = false;
   bool EnableTraceMacroExpand = false;
+  bool EnableOptimize = true;
+  bool EnableCallStats = false;
+  bool EnableCoverage = false;
+  bool EnableMacroCache = true;
 
   static VM *Default;
 
-  VM(bool init_core = true, bool init_func = true);
+  /**
+   * `module_cache_dir` enables the module cache, including for the prelude.
+   */
+  VM(bool init_core = true, bool init_func = true,
+     std::string_view module_cache_dir = "");
 
   Atom Intern(const char *v);
   Atom Intern(const std::string &v) { return Intern(v.c_str()); }
@@ -108,19 +277,75 @@ public:
     return atomIdToKey_[atom.Id()];
   }
 
+  /**
+   * Returns the interned string of `str`. Used for string literals and
+   * symbol names, so that equal strings share one object.
+   */
+  Value InternString(std::string_view str);
+
   Env &RootEnv() { return rootEnv_; }
-};
 
-/**
- * 'break' in loop.
- */
-class BreakException : public std::exception {
-  Value result_;
+  /**
+   * Notify `observer` of names looked up in the root environment, and not
+   * found in inner ones, and of names defined or set in it. Or stop if null.
+   * Returns the previous observer.
+   */
+  EnvObserver *ObserveRootEnv(EnvObserver *observer) {
+    std::swap(observer, rootEnvObserver_);
+    return observer;
+  }
+  EnvObserver *RootEnvObserver() const { return rootEnvObserver_; }
+  Profiler &Profile() { return profiler_; }
+  CallStats &Stats() { return callStats_; }
+  AllocStats &Allocs() { return allocStats_; }
+  Coverage &Cover() { return coverage_; }
+  SourceMap &Sources() { return sources_; }
+  MacroCache &Macros() { return macroCache_; }
+  ModuleCache &Modules() { return moduleCache_; }
 
-public:
-  BreakException(Value v) : result_(v) {}
+  /**
+   * Start non-local exit.
+   *
+   * Returns ESCAPE, which is passed up to the caller until it reaches the
+   * target. `tag` is NIL for `break` (nearest loop), or the name of a block or
+   * procedure for `return-from`.
+   */
+  Value Escape(Value tag, Value v) {
+    escapeTag_ = tag;
+    escapeValue_ = v;
+    return ESCAPE;
+  }
+  Value EscapeTag() const { return escapeTag_; }
+  Value TakeEscapeValue() {
+    Value v = escapeValue_;
+    escapeTag_ = NIL;
+    escapeValue_ = NIL;
+    return v;
+  }
 
-  Value Result() const { return result_; }
+  /**
+   * Lisp call stack.
+   *
+   * Eval pushes the form and the procedure of each call, and pops them on
+   * return. Frames are not popped while an exception unwinds, so the stack at
+   * the point of error is kept until UnwindStack() is called.
+   */
+  void PushFrame(Value v) { stack_.push_back(v); }
+  void PopFrame() { stack_.pop_back(); }
+  size_t StackDepth() const { return stack_.size(); }
+  const std::vector<Value> &Stack() const { return stack_; }
+
+  /**
+   * Move frames above `depth` into `ex`.
+   */
+  void UnwindStack(LispException &ex, size_t depth);
 };
 
+// Take a sample if SIGPROF has been raised since the last one.
+inline void Eval::sample(Ctx &ctx, const Procedure *leaf) {
+  if (profile_pending) [[unlikely]] {
+    ctx.vm->Profile().Sample(*ctx.vm, leaf);
+  }
+}
+
 } // namespace cxxlisp
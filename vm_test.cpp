@@ -1,7 +1,13 @@
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <map>
 #include <string>
+#include <thread>
+#include <unistd.h>
 
 #include "parser.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include "vm.hpp"
 
@@ -37,7 +43,7 @@ static Value compile(VM &vm, string_view src) {
 
 TEST(CompilerTest, Uncons) {
   Value v = list(1, "2", NIL);
-  auto [a, b, c] = uncons<vint_t, const string &, Value>(v);
+  auto [a, b, c] = uncons<vint_t, string_view, Value>(v);
   EXPECT_EQ(1, a);
   EXPECT_EQ("2", b);
   EXPECT_EQ(NIL, c);
@@ -52,15 +58,59 @@ TEST(CompilerTest, Simple) {
       {"(define x 1)", "(define x 1)"},
       {"(define f (procedure-set-name! (quote f) (lambda (x) x)))",
        "(define (f x) x)"},
+      {"(if 1 2 (cons 3 (quote ())))", "(if 1 2 `(3))"},
+      {"(let ((x (cons 1 (quote ())))) x)", "(let ((x `(1))) x)"},
   };
 
   for (const auto &t : tests) {
     VM vm;
+    vm.EnableOptimize = false;
     Value result = compile(vm, get<1>(t));
     EXPECT_EQ(string(get<0>(t)), result.ToString(vm));
   }
 }
 
+TEST(OptimizerTest, Simple) {
+  tuple<const char *, const char *> tests[] = {
+      // {expect, test}
+      {"3", "(+ 1 2)"},
+      {"(+ x 2)", "(+ x (* 1 2))"},
+      {"(quote (1 2))", "(cdr '(0 1 2))"},
+      {"(/ 1 0)", "(/ 1 0)"},
+      {"2", "(if #t 2 3)"},
+      {"3", "(if (> 1 2) 2 3)"},
+      {"(if x 2 3)", "(if x 2 3)"},
+      {"(f 20)", "(cond (#f (f 10)) ((< 1 2) (f 20)) (else 30))"},
+      {"(cond (x 10) (else 20))", "(cond (x 10) (#t 20) (x 30))"},
+      {"(let ((x (f))) (g x))", "((lambda (x) (g x)) (f))"},
+      {"(f)", "((lambda () 1 (f)))"},
+      {"(car (cdr y))", "(cadr y)"},
+      {"2", "(cadr '(1 2))"},
+      {"(car (car (cdr (cdr y))))", "(caar (cddr y))"},
+      {"(let ((x (f))) (car (cdr x)))", "(cadr (f))"},
+      {"(lambda (cadr) (cadr 1))", "(lambda (cadr) (cadr 1))"},
+      {"(lambda (+) (+ 1 2))", "(lambda (+) (+ 1 2))"},
+  };
+
+  for (const auto &t : tests) {
+    VM vm;
+    Value result = compile(vm, get<1>(t));
+    EXPECT_EQ(string(get<0>(t)), result.ToString(vm));
+  }
+}
+
+TEST(OptimizerTest, RecordAccessor) {
+  VM vm;
+  run(vm, "(define-record-type point (make-point x y) point?"
+          "  (x point-x set-point-x!) (y point-y))");
+  EXPECT_EQ("(%record-ref #<record-type point> 1 p)",
+            compile(vm, "(point-y p)").ToString(vm));
+  EXPECT_EQ("(%record-set! #<record-type point> 0 p 3)",
+            compile(vm, "(set-point-x! p 3)").ToString(vm));
+  // Wrong number of arguments is left to runtime.
+  EXPECT_EQ("(point-x)", compile(vm, "(point-x)").ToString(vm));
+}
+
 TEST(EvalTest, Simple) {
   tuple<const char *, const char *> tests[] = {
       // {expect, test}
@@ -92,6 +142,97 @@ TEST(EvalTest, Simple) {
       {"(1 2)", R"((let ((a 1) (b 2)) (list a b)))"},
       {"10", R"((cond (#t 10) (#f 20)))"},
       {"30", R"((cond (#f 10) (#f 20) (else 30)))"},
+      {"2", R"((define l '(1 2)) (cadr l))"},
+      {"1", R"((min 3 1 2))"},
+      {"3", R"((max 3 1 2))"},
+      {"1.0", R"((min 1 2.0))"},
+      {"3.0", R"((max 3 1.5 2))"},
+      {"-4", R"((- 1 2 3))"},
+      {"#t", R"((< 1 2 3))"},
+      {"#f", R"((< 1 3 2))"},
+      {"#t", R"((>= 3 3 1))"},
+      {"#t", R"((< "a" "b"))"},
+      {"4294967296", R"((* 65536 65536))"},
+      {"9223372036854775808", R"((- 9223372036854775807 -1))"},
+      {"-9223372036854775808", R"((- -9223372036854775807 1))"},
+      {"18446744073709551616", R"((* 4294967296 4294967296))"},
+      {"1267650600228229401496703205376", R"((expt 2 100))"},
+      {"-12345678901234567890123", R"(-12345678901234567890123)"},
+      {"10000000000", R"((quotient (expt 10 30) (expt 10 20)))"},
+      {"2", R"((modulo (- 0 (expt 2 70)) 3))"},
+      {"-1", R"((remainder (- 0 (expt 2 70)) 3))"},
+      {"#t", R"((= (expt 2 64) (* 4294967296 4294967296)))"},
+      {"#t", R"((< 1 1.5 (expt 2 70)))"},
+      {"3.5", R"((+ 1.5 2))"},
+      {"0.25", R"((/ 1.0 4))"},
+      {"2.0", R"((round 2.5))"},
+      {"-3.0", R"((floor -2.5))"},
+      {"1e+21", R"(1e21)"},
+      {"1180591620717411303424", R"((exact (* 1.0 (expt 2 70))))"},
+      {"#t", R"((= 1 1.0))"},
+      {"3", R"((sqrt 9))"},
+      {"5", R"((loop (let ((x 5)) (cond ((> x 1) (break x))))))"},
+      {"2", R"((define (f) (loop (break 1)) 2) (f))"},
+      {"7", R"((define (g) (break 7)) (loop (g)))"},
+      {"5", R"((loop (break (+ 1 (break 5)))))"},
+      {"1", R"((define (f x) (if x (return-from f 1)) 2) (f #t))"},
+      {"2", R"((define (f x) (if x (return-from f 1)) 2) (f #f))"},
+      {"3", R"((block b (return-from b 3) 4))"},
+      {"3", R"((define (f) (block b (loop (return-from f 3))) 4) (f))"},
+      {"3", R"((define x 1) ((lambda (y) (+ x y)) 2))"},
+      {"#(1 a \"s\")", R"((vector 1 'a "s"))"},
+      {"#i32(7 7 7)", R"((make-vector 3 7 'i32))"},
+      {"#f64(1.5 2.0)", R"((list->vector '(1.5 2) 'f64))"},
+      {"9", R"((define v (make-vector 3 0 'u8)) (vector-set! v 1 9) (vector-ref v 1))"},
+      {"(1 2)", R"((vector->list (vector 1 2)))"},
+      {"#i64(11 22 33)", R"((vector-add (list->vector '(1 2 3) 'i64) (list->vector '(10 20 30) 'i64)))"},
+      {"#u8(4 0)", R"((vector-add (make-vector 2 2 'u8) (list->vector '(2 254) 'u8)))"},
+      {"#(3 4.5)", R"((vector-add (vector 1 2) (vector 2 2.5)))"},
+      {"2000", R"((vector-sum (make-vector 1000 2 'i32)))"},
+      {"8589934590", R"((vector-sum (make-vector 2 4294967295 'i64)))"},
+      {"9223372036854775808", R"((vector-sum (make-vector 2 4611686018427387904 'i64)))"},
+      {"-9223372036854775809", R"((vector-sum (list->vector '(-9223372036854775808 -1 0) 'i64)))"},
+      {"13835058055282163712", R"((vector-dot (make-vector 3 -2147483648 'i32) (make-vector 3 -2147483648 'i32)))"},
+      {"170141183460469231731687303715884105728", R"((vector-dot (make-vector 2 -9223372036854775808 'i64) (make-vector 2 -9223372036854775808 'i64)))"},
+      {"32", R"((vector-dot (list->vector '(1 2 3) 'i32) (list->vector '(4 5 6) 'i32)))"},
+      {"1.5", R"((vector-dot (list->vector '(0.5 1) 'f64) (list->vector '(1 1) 'f64)))"},
+      {"#i32(1 4 9)", R"((vector-map square (list->vector '(1 2 3) 'i32)))"},
+      {"i32", R"((vector-type (make-vector 1 0 'i32)))"},
+      {"#t", R"((equal? (vector 1 '(2)) (vector 1 '(2))))"},
+      {"2", R"((define h (make-hash-table)) (hash-table-set! h '(a) 2) (hash-table-ref h (list 'a)))"},
+      {"#pmap(a 1)", R"((pmap 'a 1))"},
+      {"(2 #f 1)", R"((define m (pmap '(k) 1)) (define n (pmap-set m (list 'k) 2)) (list (pmap-ref n '(k)) (pmap-contains? (pmap-delete n '(k)) '(k)) (pmap-ref m '(k))))"},
+      {"0", R"((pmap-ref (pmap) 'x 0))"},
+      {"#pvector(1 9 3)", R"((define v (pvector 1 2 3)) (pvector-set v 1 9))"},
+      {"((1 2) (1 2 3) (1))", R"((define v (pvector 1 2)) (list (pvector->list v) (pvector->list (pvector-push v 3)) (pvector->list (pvector-pop v))))"},
+      {"#pvector(0 1 2)", R"((define t (transient (pvector))) (pvector-push! t 0) (pvector-push! t 1) (pvector-push! t 2) (persistent! t))"},
+      {"#t", R"((equal? (pmap 1 (pvector 2)) (pmap 1 (pvector 2))))"},
+      {"(#<p 1 2> 1 2 #t #f)", R"((define-record-type p (make-p a b) p? (a p-a) (b p-b)) (define x (make-p 1 2)) (list x (p-a x) (p-b x) (p? x) (p? 1)))"},
+      {"#<p 2 1>", R"((define-record-type p (make-p b) p? (a p-a set-p-a!) (b p-b)) (define x (make-p 1)) (set-p-a! x 2) (list (p-a x) (p-b x)) x)"},
+      {"5", R"((define-record-type p (make-p a) p? (a p-a set-p-a!)) (define (f x) (set-p-a! x (+ (p-a x) 1))) (define x (make-p 4)) (f x) (p-a x))"},
+      {"#f", R"((define h (make-hash-table eq?)) (hash-table-set! h '(a) 2) (hash-table-contains? h (list 'a)))"},
+      {"1", R"((define h (make-hash-table eq?)) (hash-table-set! h "a" 1) (hash-table-ref h "a"))"},
+      {"0", R"((define h (make-hash-table)) (hash-table-ref h 'x (lambda () 0)))"},
+      {"x", R"((define h (make-hash-table)) (hash-table-ref/default h 1 'x))"},
+      {"(#t #f 0)", R"((define h (make-hash-table)) (hash-table-set! h 1 1) (list (hash-table-delete! h 1) (hash-table-delete! h 1) (hash-table-count h)))"},
+      {"3", R"((define h (make-hash-table)) (hash-table-update!/default h 'k (lambda (x) (+ x 1)) 2) (hash-table-ref h 'k))"},
+      {"((a . 1))", R"((define h (make-hash-table)) (hash-table-update! h 'a (lambda (x) (+ x 1)) (lambda () 0)) (hash-table->alist h))"},
+      {"6", R"((define h (make-hash-table)) (define n 0) (hash-table-set! h 1 2) (hash-table-set! h 3 4) (hash-table-walk h (lambda (k v) (set! n (+ n (* k v))))) (- n 8))"},
+      {"\"cd\"", R"((substring "abcde" 2 4))"},
+      {"(#\\a #\\b #\\c)", R"((define s "abc") (define (f c) (if (= c (string-cursor-end s)) '() (cons (string-cursor-ref s c) (f (string-cursor-next s c))))) (f (string-cursor-start s)))"},
+      {"\"a1(b)\"", R"((define sb (make-string-builder)) (sb-append! sb "a" 1 '(b)) (sb->string sb))"},
+      {"(3 0 #t)", R"((define sb (make-string-builder)) (sb-append! sb "abc") (list (sb-length sb) (begin (sb-clear! sb) (sb-length sb)) (string-builder? sb)))"},
+      {"(2 #f 4 3)", R"((list (string-index "a,b" #\b) (string-index "abc" #\d) (string-index "ab cd" (lambda (c) (char>? c #\c))) (string-index "a,b,c" #\, 2)))"},
+      {"(2 #f 0)", R"((list (string-contains "abcabc" "ca") (string-contains "abc" "cb") (string-contains "abc" "")))"},
+      {"(\"a\" \"\" \"bc\" \"\")", R"((string-split "a,,bc," ","))"},
+      {"(\"a\" \"b\")", R"((string-split "a::b" "::"))"},
+      {"(\"a b\" \"a, b\" \"\")", R"((list (string-join '("a" "b")) (string-join '("a" "b") ", ") (string-join '())))"},
+      {"(#\\a #\\space #\\newline #\\x1 #\\( #\\A)", R"('(#\a #\space #\newline #\x1 #\( #\x41))"},
+      {"(97 #\\B #\\a #t #f #t)", R"((list (char->integer #\a) (char-upcase #\b) (char-downcase #\A) (char-alphabetic? #\z) (char-numeric? #\a) (char-whitespace? #\tab)))"},
+      {"(#\\b \"Abc\")", R"((define n 0) (string-for-each (lambda (c) (set! n (+ n (char->integer c)))) "abc") (list (string-ref "abc" 1) (list->string (list (integer->char (- n 229)) #\b #\c))))"},
+      {"(#t #f)", R"((list (char<? #\a #\b #\c) (char=? #\a #\a #\b)))"},
+      {"(3 #\\x65e5 \"é日\" (#\\a #\\xe9 #\\x65e5))", R"((define s "aé日") (list (string-length s) (string-ref s 2) (substring s 1 3) (string->list s)))"},
+      {"(2 1 \"é日\")", R"((list (string-index "aé日" #\日) (string-contains "aé日" "é") (list->string (list #\xe9 #\x65e5))))"},
       //{"1", R"((begin (define x 1) ((lambda () y))))"},
   };
 
@@ -105,3 +246,565 @@ TEST(EvalTest, Simple) {
     EXPECT_EQ(get<0>(t), result.ToString());
   }
 }
+
+TEST(EvalTest, EscapeOutOfLoop) {
+  VM vm;
+  EXPECT_THROW(run(vm, "(break 1)"), LispException);
+  EXPECT_THROW(run(vm, "(return-from f 1)"), LispException);
+  EXPECT_EQ(1, run(vm, "(loop (break 1))"));
+}
+
+TEST(EvalTest, NumberError) {
+  VM vm;
+  EXPECT_THROW(run(vm, "(/ 1 0)"), LispException);
+  EXPECT_THROW(run(vm, "(quotient (expt 2 100) 0)"), LispException);
+  EXPECT_THROW(run(vm, "(modulo 1 0)"), LispException);
+  EXPECT_THROW(run(vm, "(< 1 'a)"), LispException);
+}
+
+TEST(EvalTest, PrintBignum) {
+  VM vm;
+  string big(run(vm, "(number->string (expt 2 2000))").AsString());
+  ASSERT_LT(256u, big.size());
+  testing::internal::CaptureStdout();
+  run(vm, "(display (expt 2 2000)) (display (list (expt 2 2000) 1))");
+  EXPECT_EQ(big + "(" + big + "...", testing::internal::GetCapturedStdout());
+}
+
+TEST(EvalTest, Vector) {
+  VM vm;
+  // Sizes around the SIMD widths to cover the remainder loops.
+  for (int n : {0, 1, 7, 8, 9, 31, 32, 33, 1000}) {
+    string len = to_string(n);
+    string expected = to_string(n * (n - 1) / 2);
+    run(vm, "(define l '())"
+            "(define i " + len + ")"
+            "(loop (if (= i 0) (break 0)) (set! i (- i 1)) (set! l (cons i l)))");
+    for (string type : {"u8", "i32", "i64", "f64", "value"}) {
+      if (type == "u8" && n > 32) {
+        continue;
+      }
+      run(vm, "(define v (list->vector l '" + type + "))");
+      Value sum = run(vm, "(vector-sum (vector-add v v))");
+      EXPECT_EQ(n * (n - 1), run(vm, "(exact " + sum.ToString() + ")"));
+      Value dot = run(vm, "(exact (vector-dot v (make-vector " + len +
+                              " 1 '" + type + ")))");
+      EXPECT_EQ(expected, dot.ToString());
+    }
+  }
+
+  EXPECT_THROW(run(vm, "(vector-ref (vector 1) 1)"), LispException);
+  EXPECT_THROW(run(vm, "(make-vector 1 256 'u8)"), LispException);
+  EXPECT_THROW(run(vm, "(make-vector 1 1.5 'i32)"), LispException);
+  EXPECT_THROW(run(vm, "(make-vector 1 0 'i16)"), LispException);
+  EXPECT_THROW(run(vm, "(vector-add (vector 1) (make-vector 1 1 'i32))"),
+               LispException);
+  EXPECT_THROW(run(vm, "(vector-dot (vector 1) (vector 1 2))"), LispException);
+}
+
+TEST(EvalTest, HashTable) {
+  VM vm;
+  run(vm, "(define h (make-hash-table))"
+          "(define i 0)"
+          "(loop (if (= i 10000) (break 0))"
+          "  (hash-table-set! h (list i (+ \"k\" (number->string i))) i)"
+          "  (set! i (+ i 1)))"
+          "(set! i 0)"
+          "(loop (if (= i 10000) (break 0))"
+          "  (hash-table-delete! h (list i (+ \"k\" (number->string i))))"
+          "  (set! i (+ i 2)))");
+  EXPECT_EQ(5000, run(vm, "(hash-table-count h)"));
+  EXPECT_EQ(5000, run(vm, "(vector-length (list->vector (hash-table-keys h)))"));
+  EXPECT_EQ(9999, run(vm, "(hash-table-ref h (list 9999 \"k9999\"))"));
+  EXPECT_EQ(BOOL_F, run(vm, "(hash-table-contains? h (list 10 \"k10\"))"));
+  EXPECT_THROW(run(vm, "(hash-table-ref h 'missing)"), LispException);
+  EXPECT_THROW(run(vm, "(make-hash-table car)"), LispException);
+}
+
+TEST(EvalTest, Record) {
+  VM vm;
+  run(vm, "(define-record-type p (make-p a) p? (a p-a))"
+          "(define-record-type q (make-q a) q? (a q-a))"
+          "(define (f x) (p-a x))");
+  EXPECT_EQ(1, run(vm, "(f (make-p 1))"));
+  EXPECT_THROW(run(vm, "(f (make-q 1))"), LispException);
+  EXPECT_THROW(run(vm, "(p-a 1)"), LispException);
+  EXPECT_THROW(run(vm, "(record-accessor p 'b)"), LispException);
+}
+
+TEST(EvalTest, Persistent) {
+  VM vm;
+  EXPECT_THROW(run(vm, "(pmap-ref (pmap) 'x)"), LispException);
+  EXPECT_THROW(run(vm, "(pmap 1)"), LispException);
+  EXPECT_THROW(run(vm, "(pmap-set! (pmap) 1 1)"), LispException);
+  EXPECT_THROW(run(vm, "(pvector-push (transient (pvector)) 1)"),
+               LispException);
+  EXPECT_THROW(run(vm, "(define t (transient (pvector))) (persistent! t)"
+                       "(pvector-push! t 1)"),
+               LispException);
+}
+
+TEST(EvalTest, InternString) {
+  VM vm;
+  Value a = run(vm, "\"abc\"");
+  Value b = run(vm, "(symbol->string 'abc)");
+  EXPECT_TRUE(a.AsStringValue().IsInterned());
+  EXPECT_EQ(&a.AsStringValue(), &b.AsStringValue());
+  EXPECT_EQ(a, run(vm, "(+ \"ab\" \"c\")"));
+  EXPECT_NE(a, run(vm, "\"abd\""));
+
+  // Interned by another VM.
+  VM other;
+  Value c = run(other, "\"abc\"");
+  EXPECT_TRUE(c.AsStringValue().IsInterned());
+  EXPECT_TRUE(is_equal(a, c));
+  EXPECT_EQ(hash_equal(a), hash_equal(c));
+}
+
+TEST(EvalTest, StringSlice) {
+  VM vm;
+  run(vm, "(define s (+ \"0123456789\" \"0123456789\" \"0123456789\""
+          " \"0123456789\"))"
+          "(define t (substring s 1 39))");
+  Value t = run(vm, "t");
+  EXPECT_TRUE(t.AsStringValue().IsSlice());
+  EXPECT_EQ(run(vm, "s").AsString().data() + 1, t.AsString().data());
+  EXPECT_EQ("\"234567890123456789012345678901234567\"",
+            run(vm, "(substring t 1 37)").ToString());
+  EXPECT_EQ(BOOL_T, run(vm, "(equal? (substring s 10 40) (substring s 0 30))"));
+  EXPECT_FALSE(run(vm, "(substring s 0 2)").AsStringValue().IsSlice());
+  EXPECT_THROW(run(vm, "(substring s 2 1)"), LispException);
+  EXPECT_THROW(run(vm, "(substring s 0 41)"), LispException);
+  EXPECT_THROW(run(vm, "(string-cursor-next \"\" 0)"), LispException);
+
+  // Cursors in the middle of "é".
+  run(vm, "(define u \"a\u00e9b\")");
+  EXPECT_EQ("#\\b", run(vm, "(string-cursor-ref u 3)").ToString());
+  EXPECT_THROW(run(vm, "(string-cursor-ref u 2)"), LispException);
+  EXPECT_THROW(run(vm, "(string-cursor-next u 2)"), LispException);
+  EXPECT_THROW(run(vm, "(string-cursor-prev u 2)"), LispException);
+  EXPECT_THROW(run(vm, "(string-cursor->index u 2)"), LispException);
+  EXPECT_THROW(run(vm, "(substring/cursors u 0 2)"), LispException);
+  EXPECT_EQ("\"a\u00e9\"", run(vm, "(substring/cursors u 0 3)").ToString());
+}
+
+TEST(EvalTest, Rope) {
+  VM vm;
+  run(vm, "(define s \"\")"
+          "(define i 0)"
+          "(loop (if (= i 1000) (break 0))"
+          "  (set! s (string-append s (number->string (modulo i 10))))"
+          "  (set! i (+ i 1)))");
+  Value s = run(vm, "s");
+  EXPECT_TRUE(s.AsStringValue().IsRope());
+  EXPECT_EQ(1000, run(vm, "(string-length s)"));
+  EXPECT_TRUE(s.AsStringValue().IsRope());
+  EXPECT_EQ("\"0123456789\"", run(vm, "(substring s 990 1000)").ToString());
+  EXPECT_FALSE(s.AsStringValue().IsRope());
+  EXPECT_EQ(BOOL_T, run(vm, "(equal? s (+ (substring s 0 500)"
+                            " (substring s 500 1000)))"));
+}
+
+TEST(EvalTest, StackTrace) {
+  VM vm;
+  try {
+    run(vm, "(define (f x) (car x)) (f 1)");
+    FAIL();
+  } catch (LispException &ex) {
+    ASSERT_TRUE(ex.Stack);
+    EXPECT_EQ(3, ex.Stack->size());
+    EXPECT_EQ("(car x)", ex.Stack->at(0).ToString());
+    EXPECT_EQ("(f 1)", ex.Stack->back().ToString());
+  }
+  EXPECT_EQ(0, vm.StackDepth());
+}
+
+TEST(EvalTest, Profile) {
+  VM vm;
+  run(vm, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+          "(profile-start 100)");
+  EXPECT_TRUE(vm.Profile().IsRunning());
+  for (int i = 0; i < 1000 && vm.Profile().Samples() < 20; i++) {
+    run(vm, "(fib 15)");
+  }
+  vm.Profile().Stop();
+  EXPECT_FALSE(vm.Profile().IsRunning());
+  ASSERT_LT(0, vm.Profile().Samples());
+
+  stringstream s;
+  vm.Profile().Write(s);
+  EXPECT_NE(string::npos, s.str().find("fib;fib"));
+  EXPECT_THROW(run(vm, "(profile-stop)"), LispException);
+}
+
+TEST(EvalTest, ProcedureStats) {
+  VM vm;
+  run(vm, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+          "(procedure-stats-start)"
+          "(fib 10)"
+          "(procedure-stats-stop)"
+          "(fib 10)");
+  EXPECT_FALSE(vm.EnableCallStats);
+
+  // (name calls self-ms total-ms)
+  map<string, Value> stats;
+  for (Value entry : run(vm, "(procedure-stats)")) {
+    stats[car(entry).ToString()] = cdr(entry);
+  }
+  ASSERT_EQ(1, stats.count("fib"));
+  ASSERT_EQ(1, stats.count("+"));
+  EXPECT_EQ(177, car(stats["fib"]));
+  EXPECT_EQ(88, car(stats["+"]));
+  double fib_self = car(cdr(stats["fib"])).AsFlonum();
+  double fib_total = car(cdr(cdr(stats["fib"]))).AsFlonum();
+  double add_total = car(cdr(cdr(stats["+"]))).AsFlonum();
+  EXPECT_LE(fib_self, fib_total);
+  EXPECT_LE(add_total, fib_total);
+}
+
+TEST(EvalTest, AllocStats) {
+  VM vm;
+  run(vm, "(define (f x) (cons x x))"
+          "(alloc-profile-start)"
+          "(f 1)"
+          "(alloc-profile-stop)"
+          "(f 2)");
+  EXPECT_FALSE(alloc_profiling);
+  EXPECT_EQ(1, vm.Allocs().Kind(AllocKind::ENV).Count);
+  EXPECT_LE(1, vm.Allocs().Kind(AllocKind::CELL).Count);
+
+  bool found = false;
+  for (auto &site : vm.Allocs().Sites()) {
+    if (site.Proc && site.Proc->Name() == "f" && site.Form &&
+        Value(site.Form).ToString() == "(cons x x)") {
+      found = true;
+      EXPECT_LE(1, site.Total.Count);
+    }
+  }
+  EXPECT_TRUE(found);
+  EXPECT_TRUE(run(vm, "(alloc-stats)").IsCell());
+}
+
+TEST(EvalTest, Room) {
+  VM vm;
+  HeapCensus before = heap_census(vm);
+  run(vm, "(define l (list 1 2 3))"
+          "(define s (string-append \"abc\" \"def\"))"
+          "(define v (make-vector 4 l))");
+  HeapCensus after = heap_census(vm);
+  EXPECT_EQ(3, after[(size_t)ValueType::CELL].Count -
+                   before[(size_t)ValueType::CELL].Count);
+  EXPECT_EQ(1, after[(size_t)ValueType::VECTOR].Count -
+                   before[(size_t)ValueType::VECTOR].Count);
+  EXPECT_LE(1, after[(size_t)ValueType::STRING].Count -
+                   before[(size_t)ValueType::STRING].Count);
+}
+
+// Thread id of the first event `name` in trace JSON.
+static string trace_tid(const string &json, const string &name) {
+  size_t pos = json.find("\"name\":\"" + name + "\"");
+  if (pos == string::npos) {
+    return "";
+  }
+  pos = json.find("\"tid\":", pos);
+  return json.substr(pos, json.find_first_of(",}", pos) - pos);
+}
+
+TEST(EvalTest, TraceEvents) {
+  VM vm;
+  Tracer &tracer = Tracer::Instance();
+  tracer.Start();
+  run(vm, "(+ 1 2)");
+  thread([] { TraceSpan span("test", "worker"); }).join();
+  tracer.Stop();
+  run(vm, "(+ 3 4)");
+
+  stringstream s;
+  tracer.Write(s);
+  string json = s.str();
+  for (auto name : {"parse", "macro-expand", "compile", "execute", "worker"}) {
+    EXPECT_NE(string::npos, json.find("\"name\":\""s + name + "\"")) << name;
+  }
+  EXPECT_NE(string::npos, json.find("\"form\":\"(+ 1 2)\""));
+  EXPECT_EQ(string::npos, json.find("(+ 3 4)"));
+  EXPECT_NE("", trace_tid(json, "worker"));
+  EXPECT_NE(trace_tid(json, "execute"), trace_tid(json, "worker"));
+
+  tracer.Start();
+  run(vm, "\"" + string(78, 'a') + "\u00e9\"");
+  tracer.Stop();
+  s.str("");
+  tracer.Write(s);
+  EXPECT_NE(string::npos, s.str().find("\"form\":\"\\\"" + string(78, 'a') +
+                                       "\"}"));
+}
+
+TEST(EvalTest, SourceLocation) {
+  VM vm;
+  const char *src = "(define (f x)\n"
+                    "  (car x))\n"
+                    "(defmacro twice (e) `(begin ,e ,e))\n"
+                    "(define (g y)\n"
+                    "  (twice (f y)))\n";
+  run(vm, src, "test.lisp");
+
+  Parser parser{vm, "\n  (a\n   (b c))", "other.lisp"};
+  Value v = parser.Read();
+  auto &sources = vm.Sources();
+  EXPECT_EQ("other.lisp:2:3", sources.Describe(sources.Find(v)));
+  EXPECT_EQ("other.lisp:3:4", sources.Describe(sources.Find(car(cdr(v)))));
+  EXPECT_FALSE(sources.Find(cdr(v)).IsKnown());
+  EXPECT_EQ(BOOL_F, run(vm, "(source-location '(a b))"));
+
+  try {
+    run(vm, "(g 1)");
+    FAIL();
+  } catch (LispException &ex) {
+    ASSERT_TRUE(ex.Locations);
+    ASSERT_EQ(ex.Stack->size(), ex.Locations->size());
+    EXPECT_EQ("(car x)", ex.Stack->at(0).ToString());
+    EXPECT_EQ("test.lisp:2:3", ex.Locations->at(0));
+    // Expanded from (twice (f y)).
+    EXPECT_EQ("(f y)", ex.Stack->at(2).ToString());
+    EXPECT_EQ("test.lisp:5:10", ex.Locations->at(2));
+    EXPECT_NE(string::npos, ex.StackTrace().find("(car x) at test.lisp:2:3"));
+  }
+}
+
+TEST(EvalTest, Coverage) {
+  VM vm;
+  const char *src = "(define (f x)\n"
+                    "  (if (< x 0)\n"
+                    "      (- x)\n"
+                    "      (let ((y\n"
+                    "             (* x 2)))\n"
+                    "        y)))\n"
+                    "(f 1)\n"
+                    "(f 2)\n";
+  vm.EnableCoverage = true;
+  run(vm, src, "cover.lisp");
+  vm.EnableCoverage = false;
+
+  stringstream s;
+  vm.Cover().Write(s, vm);
+  string lcov = s.str();
+  size_t begin = lcov.find("SF:cover.lisp\n");
+  ASSERT_NE(string::npos, begin);
+  size_t end = lcov.find("end_of_record\n", begin);
+  ASSERT_NE(string::npos, end);
+  EXPECT_EQ("SF:cover.lisp\n"
+            "DA:1,1\n"
+            "DA:2,2\n"
+            "DA:3,0\n"
+            "DA:4,2\n"
+            "DA:5,2\n"
+            "DA:7,1\n"
+            "DA:8,1\n"
+            "LF:7\n"
+            "LH:6\n",
+            lcov.substr(begin, end - begin));
+
+  // Inlined forms are located at the call.
+  run(vm, "(define n 0)\n"
+          "(define-inline (bump) (set! n (+ n 1)))\n"
+          "(define-inline (fail x) (car x))\n",
+      "inline.lisp");
+  vm.Cover().Clear();
+  vm.EnableCoverage = true;
+  run(vm, "(define (g)\n"
+          "  (bump))\n"
+          "(g)\n"
+          "(bump)\n",
+      "inlined.lisp");
+  vm.EnableCoverage = false;
+  s.str("");
+  vm.Cover().Write(s, vm);
+  lcov = s.str();
+  begin = lcov.find("SF:inlined.lisp\n");
+  ASSERT_NE(string::npos, begin);
+  end = lcov.find("end_of_record\n", begin);
+  EXPECT_EQ("SF:inlined.lisp\n"
+            "DA:1,1\n"
+            "DA:2,1\n"
+            "DA:3,1\n"
+            "DA:4,1\n"
+            "LF:4\n"
+            "LH:4\n",
+            lcov.substr(begin, end - begin));
+
+  run(vm, "(define (h)\n"
+          "  (fail 1))\n",
+      "inlined.lisp");
+  try {
+    run(vm, "(h)");
+    FAIL();
+  } catch (LispException &ex) {
+    ASSERT_TRUE(ex.Locations);
+    EXPECT_EQ("inlined.lisp:2:3", ex.Locations->at(0));
+  }
+}
+
+TEST(EvalTest, MacroCache) {
+  VM vm;
+  MacroCache &cache = vm.Macros();
+  cache.Clear();
+  run(vm, "(define n 0)"
+          "(defmacro twice (e) (set! n (+ n 1)) `(begin ,e ,e))"
+          "(define (f x) (twice (car x)))"
+          "(define (g x) (twice (car x)))"
+          "(define (h x) (twice (cdr x)))");
+  // defmacro and define are expanded too, so count uses of twice by n.
+  EXPECT_EQ(Value(2), run(vm, "n"));
+  EXPECT_LT(0u, cache.Hits());
+  EXPECT_EQ("(begin (car x) (car x))",
+            run(vm, "(macroexpand-1 '(twice (car x)))").ToString());
+  EXPECT_EQ(Value(2), run(vm, "n"));
+
+  // Redefinition drops the expansions of the old macro.
+  run(vm, "(defmacro twice (e) (set! n (+ n 1)) `(list ,e ,e))");
+  EXPECT_EQ("(list (car x) (car x))",
+            run(vm, "(macroexpand-1 '(twice (car x)))").ToString());
+  EXPECT_EQ(Value(3), run(vm, "n"));
+  EXPECT_EQ(1u, cache.Invalidations());
+
+  // Unless the new one has the same code.
+  run(vm, "(defmacro twice (e) (set! n (+ n 1)) `(list ,e ,e))");
+  run(vm, "(macroexpand-1 '(twice (car x)))");
+  EXPECT_EQ(Value(3), run(vm, "n"));
+  EXPECT_EQ(1u, cache.Invalidations());
+
+  // Changing an expansion doesn't change the cached one.
+  run(vm, "(defmacro three () '(list 1 2 3))"
+          "(set-car! (cdr (macroexpand-1 '(three))) 0)");
+  EXPECT_EQ("(list 1 2 3)", run(vm, "(macroexpand-1 '(three))").ToString());
+  run(vm, "(set-car! (cdr (macroexpand-1 '(three))) 0)");
+  EXPECT_EQ("(list 1 2 3)", run(vm, "(macroexpand-1 '(three))").ToString());
+
+  // Impure macros can turn off the cache.
+  run(vm, "(macro-cache-enable! #f)"
+          "(macroexpand-1 '(twice (car x)))");
+  EXPECT_EQ(Value(4), run(vm, "n"));
+  run(vm, "(macro-cache-enable! #t)");
+
+  // A cached expansion refers to the forms of its own use.
+  const char *src = "(define (p x) (twice (car x)))\n"
+                    "(define (q x)\n"
+                    "  (twice (car x)))\n";
+  run(vm, src, "macro.lisp");
+  try {
+    run(vm, "(q 1)");
+    FAIL();
+  } catch (LispException &ex) {
+    ASSERT_TRUE(ex.Locations);
+    EXPECT_EQ("(car x)", ex.Stack->at(0).ToString());
+    EXPECT_EQ("macro.lisp:3:10", ex.Locations->at(0));
+  }
+}
+
+TEST(EvalTest, ModuleCache) {
+  auto dir = filesystem::temp_directory_path() /
+             ("cxxlisp-test-" + to_string(getpid()));
+  filesystem::create_directories(dir);
+  string path = (dir / "m.lisp").string();
+  ofstream(path) << "(defmacro twice (e) `(begin ,e ,e))\n"
+                    "(define-record-type p (make-p a) p? (a p-a))\n"
+                    "(define (f x)\n"
+                    "  (twice (car x)))\n"
+                    "(define (g x) (p-a x))\n";
+  auto load = [&](VM &vm) {
+    vm.Modules().SetDir((dir / "cache").string());
+    run_file(vm, path);
+  };
+
+  {
+    VM vm;
+    load(vm);
+    EXPECT_EQ(0u, vm.Modules().Hits());
+    EXPECT_EQ(1u, vm.Modules().Misses());
+  }
+  {
+    VM vm;
+    load(vm);
+    EXPECT_EQ(1u, vm.Modules().Hits());
+    // Inlined accessor refers to the record type of this VM.
+    EXPECT_EQ(Value(1), run(vm, "(g (make-p 1))"));
+    try {
+      run(vm, "(f 1)");
+      FAIL();
+    } catch (LispException &ex) {
+      ASSERT_TRUE(ex.Locations);
+      EXPECT_EQ(path + ":4:10", ex.Locations->at(0));
+    }
+  }
+
+  ofstream(path) << "(define (g x) x)\n";
+  {
+    VM vm;
+    load(vm);
+    EXPECT_EQ(1u, vm.Modules().Misses());
+    EXPECT_EQ(Value(1), run(vm, "(g 1)"));
+  }
+
+  // Procedures called by a macro are part of the environment.
+  string h_path = (dir / "h.lisp").string();
+  ofstream(path) << "(define (use) (m))\n";
+  auto load_use = [&](int n) {
+    ofstream(h_path) << "(define (helper) " << n << ")\n"
+                     << "(defmacro m () (helper))\n";
+    VM vm;
+    run_file(vm, h_path);
+    load(vm);
+    EXPECT_EQ(Value(n), run(vm, "(use)"));
+    return vm.Modules().Hits();
+  };
+  EXPECT_EQ(0u, load_use(1));
+  EXPECT_EQ(1u, load_use(1));
+  EXPECT_EQ(0u, load_use(2));
+
+  // Global names are the ones bound when the form is compiled.
+  ofstream(path) << "(define-record-type p (make-p a) p? (a p-a))\n"
+                    "(define (g x) (p-a x))\n"
+                    "(define p2 p)\n";
+  for (size_t hits : {0, 1}) {
+    VM vm;
+    load(vm);
+    EXPECT_EQ(hits, vm.Modules().Hits());
+    EXPECT_EQ(Value(1), run(vm, "(g (make-p 1))"));
+  }
+
+  // A name which isn't bound drops the cache, and the rest is compiled.
+  const char *record = "(define-record-type q (make-q a) q? (a q-a))";
+  ofstream(path) << "(define (g x) (q-a x))\n"
+                    "(define n 1)\n";
+  {
+    VM vm;
+    run(vm, record);
+    load(vm);
+  }
+  {
+    VM vm;
+    load(vm);
+    EXPECT_EQ(0u, vm.Modules().Hits());
+    EXPECT_EQ(1u, vm.Modules().Misses());
+    EXPECT_EQ(Value(1), run(vm, "n"));
+    run(vm, record);
+    EXPECT_EQ(Value(2), run(vm, "(g (make-q 2))"));
+  }
+
+  // Globals read by a macro defined in the file are checked.
+  ofstream(path) << "(defmacro m () (if debug ''debug ''release))\n"
+                    "(define mode (m))\n";
+  auto load_mode = [&](const char *debug, size_t hits) {
+    VM vm;
+    run(vm, "(define debug "s + debug + ")");
+    load(vm);
+    EXPECT_EQ(hits, vm.Modules().Hits());
+    return run(vm, "mode").ToString();
+  };
+  EXPECT_EQ("debug", load_mode("#t", 0));
+  EXPECT_EQ("debug", load_mode("#t", 1));
+  EXPECT_EQ("release", load_mode("#f", 0));
+  EXPECT_EQ("release", load_mode("#f", 0));
+  EXPECT_EQ("release", load_mode("#f", 1));
+  filesystem::remove_all(dir);
+}